@@ -10,11 +10,18 @@
  *     http://tinyurl.com/floating-scale-surface-recon
  */
 
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <limits>
 #include <string>
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
 
 #include "util/timer.h"
 #include "util/arguments.h"
+#include "math/vector.h"
 #include "fssr/pointset.h"
 #include "fssr/iso_octree.h"
 
@@ -25,6 +32,16 @@ struct AppSettings
     int skip_samples;
     float scale_factor;
     int refine_octree;
+    bool memory_mapped;
+    int load_threads;
+    bool bounds_prepass;
+    float saturation;
+    int checkpoint_minutes;
+    bool resume;
+    std::string update_octree;
+    int new_inputs;
+    int compression;
+    int tile_level;
 };
 
 int
@@ -39,6 +56,16 @@ main (int argc, char** argv)
     args.add_option('s', "scale-factor", true, "Multiply sample scale with factor [1.0]");
     args.add_option('r', "refine-octree", true, "Refines octree with N levels [0]");
     args.add_option('k', "skip-samples", true, "Skip input samples [0]");
+    args.add_option('m', "mmap", false, "Memory-map binary little endian input");
+    args.add_option('j', "load-threads", true, "Number of files loaded in parallel [4]");
+    args.add_option('b', "bounds-prepass", false, "Size octree root in a prepass (reads input twice)");
+    args.add_option('c', "saturation", true, "Stop sampling voxels at confidence C [0, disabled]");
+    args.add_option('C', "checkpoint", true, "Checkpoint voxels every N minutes [10, 0 disables]");
+    args.add_option('R', "resume", false, "Resume voxel computation from checkpoint");
+    args.add_option('u', "update", true, "Update voxels of a previous octree");
+    args.add_option('n', "new-inputs", true, "Number of last inputs new for --update [1]");
+    args.add_option('z', "compression", true, "Compress voxels with level 1-9 [0, uncompressed]");
+    args.add_option('t', "tile-level", true, "Octree level of the file tiles [4]");
     args.set_description("Builds an octree from a set of input samples. "
         "The samples must have normals and the \"values\" PLY attribute "
         "(the scale of the samples). Both confidence values and vertex colors "
@@ -51,6 +78,15 @@ main (int argc, char** argv)
     conf.skip_samples = 0;
     conf.scale_factor = 1.0f;
     conf.refine_octree = 0;
+    conf.memory_mapped = false;
+    conf.load_threads = 4;
+    conf.bounds_prepass = false;
+    conf.saturation = 0.0f;
+    conf.checkpoint_minutes = 10;
+    conf.resume = false;
+    conf.new_inputs = 1;
+    conf.compression = 0;
+    conf.tile_level = 4;
 
     /* Scan arguments. */
     while (util::ArgResult const* arg = args.next_result())
@@ -66,6 +102,16 @@ main (int argc, char** argv)
             case 's': conf.scale_factor = arg->get_arg<float>(); break;
             case 'k': conf.skip_samples = arg->get_arg<int>(); break;
             case 'r': conf.refine_octree = arg->get_arg<int>(); break;
+            case 'm': conf.memory_mapped = true; break;
+            case 'j': conf.load_threads = arg->get_arg<int>(); break;
+            case 'b': conf.bounds_prepass = true; break;
+            case 'c': conf.saturation = arg->get_arg<float>(); break;
+            case 'C': conf.checkpoint_minutes = arg->get_arg<int>(); break;
+            case 'R': conf.resume = true; break;
+            case 'u': conf.update_octree = arg->get_arg<std::string>(); break;
+            case 'n': conf.new_inputs = arg->get_arg<int>(); break;
+            case 'z': conf.compression = arg->get_arg<int>(); break;
+            case 't': conf.tile_level = arg->get_arg<int>(); break;
             default:
                 std::cerr << "Invalid option: " << arg->opt->sopt << std::endl;
                 return 1;
@@ -80,6 +126,12 @@ main (int argc, char** argv)
     conf.out_octree = conf.in_files.back();
     conf.in_files.pop_back();
 
+    if (conf.load_threads < 1)
+    {
+        std::cerr << "Invalid number of loader threads, exiting." << std::endl;
+        return 1;
+    }
+
     if (conf.refine_octree < 0 || conf.refine_octree > 3)
     {
         std::cerr << "Unreasonable refine level of " << conf.refine_octree
@@ -87,29 +139,201 @@ main (int argc, char** argv)
         return 1;
     }
 
-    /* Load input point set and insert samples in the octree. */
+    if (conf.compression < 0 || conf.compression > 9)
+    {
+        std::cerr << "Invalid compression level, exiting." << std::endl;
+        return 1;
+    }
+
+    if (conf.tile_level < 0
+        || conf.tile_level > FSSR_OCTREE_CONTAINER_MAX_TILE_LEVEL)
+    {
+        std::cerr << "Invalid tile level, exiting." << std::endl;
+        return 1;
+    }
+
+    if (conf.checkpoint_minutes < 0)
+    {
+        std::cerr << "Invalid checkpoint interval, exiting." << std::endl;
+        return 1;
+    }
+
+    if (conf.checkpoint_minutes == 0 && conf.resume)
+    {
+        std::cerr << "Resuming requires checkpoints, exiting." << std::endl;
+        return 1;
+    }
+
+    if (!conf.update_octree.empty() && (conf.new_inputs < 1
+        || conf.new_inputs > static_cast<int>(conf.in_files.size())))
+    {
+        std::cerr << "Invalid number of new inputs, exiting." << std::endl;
+        return 1;
+    }
+
+    /*
+     * Load input point sets and insert samples in the octree. The point sets
+     * are parsed concurrently, but samples are inserted in input order by
+     * one thread at a time. At most one point set per loader thread is kept
+     * in memory.
+     */
     util::WallTimer timer;
     fssr::IsoOctree octree;
-    for (std::size_t i = 0; i < conf.in_files.size(); ++i)
+
+    /*
+     * In update mode, the samples of the last inputs are new. All samples
+     * are inserted because the re-evaluated voxels also depend on the
+     * previous samples, but only the voxels influenced by the new samples
+     * are re-evaluated.
+     */
+    std::size_t const first_new_input = conf.update_octree.empty()
+        ? conf.in_files.size() : conf.in_files.size() - conf.new_inputs;
+    std::vector<fssr::Sample> new_samples;
+
+    /*
+     * Optionally compute the bounding box and the largest scale of all
+     * samples in a streaming pass. The octree root is then allocated once
+     * at its final size and never expanded during insertion.
+     */
+    if (conf.bounds_prepass)
     {
-        std::cout << "Loading: " << conf.in_files[i] << "..." << std::endl;
-        fssr::PointSet pset;
-        pset.set_scale_factor(conf.scale_factor);
-        pset.set_skip_samples(conf.skip_samples);
-        try
+        std::cout << "Computing bounds of the input samples..." << std::flush;
+        math::Vec3d aabb_min(std::numeric_limits<double>::max());
+        math::Vec3d aabb_max(-std::numeric_limits<double>::max());
+        double max_scale = 0.0;
+        bool load_error = false;
+
+#pragma omp parallel for schedule(dynamic) num_threads(conf.load_threads)
+        for (std::size_t i = 0; i < conf.in_files.size(); ++i)
         {
-            pset.read_from_file(conf.in_files[i]);
+            fssr::PointSet pset;
+            pset.set_scale_factor(conf.scale_factor);
+            pset.set_skip_samples(conf.skip_samples);
+            pset.set_memory_mapped(conf.memory_mapped);
+            math::Vec3d pset_min, pset_max;
+            double pset_max_scale;
+            try
+            {
+                pset.read_from_file(conf.in_files[i]);
+                pset.compute_bounds(&pset_min, &pset_max, &pset_max_scale);
+            }
+            catch (std::exception& e)
+            {
+#pragma omp critical
+                {
+                    std::cerr << "Error loading " << conf.in_files[i]
+                        << ": " << e.what() << std::endl;
+                    load_error = true;
+                }
+                continue;
+            }
+
+#pragma omp critical
+            for (int j = 0; j < 3; ++j)
+            {
+                aabb_min[j] = std::min(aabb_min[j], pset_min[j]);
+                aabb_max[j] = std::max(aabb_max[j], pset_max[j]);
+                max_scale = std::max(max_scale, pset_max_scale);
+            }
         }
-        catch (std::exception& e)
-        {
-            std::cerr << "Error: " << e.what() << std::endl;
+
+        if (load_error)
             return 1;
+        if (max_scale > 0.0)
+            octree.init_root(aabb_min, aabb_max, max_scale);
+        std::cout << " took " << timer.get_elapsed() << "ms" << std::endl;
+        timer.reset();
+    }
+
+    {
+#ifdef _OPENMP
+        /*
+         * Allow the octree to insert samples in parallel while loading.
+         * The nested teams of the loader threads while parsing are bounded
+         * such that all loader threads together use about one thread per
+         * core, only the inserting thread uses all cores.
+         */
+        int const insert_threads = omp_get_max_threads();
+        int const parse_threads = std::max(1,
+            insert_threads / conf.load_threads);
+        int const max_active_levels = omp_get_max_active_levels();
+        omp_set_max_active_levels(2);
+#endif
+
+        std::size_t parse_time = 0;
+        std::size_t wait_time = 0;
+        std::size_t insert_time = 0;
+        bool load_error = false;
+
+#pragma omp parallel for ordered schedule(dynamic) num_threads(conf.load_threads)
+        for (std::size_t i = 0; i < conf.in_files.size(); ++i)
+        {
+            util::WallTimer stage_timer;
+            fssr::PointSet pset;
+            pset.set_scale_factor(conf.scale_factor);
+            pset.set_skip_samples(conf.skip_samples);
+            pset.set_memory_mapped(conf.memory_mapped);
+#ifdef _OPENMP
+            omp_set_num_threads(parse_threads);
+#endif
+            /* Other loader threads may set the error flag concurrently. */
+            if (!__atomic_load_n(&load_error, __ATOMIC_RELAXED))
+            {
+                try
+                {
+                    pset.read_from_file(conf.in_files[i]);
+                }
+                catch (std::exception& e)
+                {
+#pragma omp critical
+                    std::cerr << "Error loading " << conf.in_files[i]
+                        << ": " << e.what() << std::endl;
+                    __atomic_store_n(&load_error, true, __ATOMIC_RELAXED);
+                }
+            }
+            std::size_t const parse_ms = stage_timer.get_elapsed();
+            stage_timer.reset();
+
+#pragma omp ordered
+            {
+                std::size_t const wait_ms = stage_timer.get_elapsed();
+                stage_timer.reset();
+#ifdef _OPENMP
+                omp_set_num_threads(insert_threads);
+#endif
+                if (!__atomic_load_n(&load_error, __ATOMIC_RELAXED))
+                {
+                    std::cout << "Inserting " << pset.get_num_samples()
+                        << " samples from " << conf.in_files[i]
+                        << " (parsed in " << parse_ms << "ms)..."
+                        << std::flush;
+                    octree.insert_samples(pset);
+                    for (std::size_t j = 0; i >= first_new_input
+                        && j < pset.get_num_samples(); ++j)
+                    {
+                        fssr::Sample sample;
+                        if (pset.get_sample(j, &sample))
+                            new_samples.push_back(sample);
+                    }
+                    std::cout << " took " << stage_timer.get_elapsed()
+                        << "ms" << std::endl;
+                }
+                parse_time += parse_ms;
+                wait_time += wait_ms;
+                insert_time += stage_timer.get_elapsed();
+            }
         }
+#ifdef _OPENMP
+        omp_set_max_active_levels(max_active_levels);
+#endif
 
-        std::cout << "Inserting samples into the octree..." << std::flush;
-        timer.reset();
-        octree.insert_samples(pset);
-        std::cout << " took " << timer.get_elapsed() << "ms" << std::endl;
+        if (load_error)
+            return 1;
+
+        std::cout << "Loading " << conf.in_files.size() << " files took "
+            << timer.get_elapsed() << "ms (parsing " << parse_time
+            << "ms, waiting " << wait_time << "ms, inserting "
+            << insert_time << "ms)." << std::endl;
     }
 
     /* Refine octree if requested. Each iteration adds one level voxels. */
@@ -132,13 +356,48 @@ main (int argc, char** argv)
 
     /* Compute voxels. */
     octree.print_stats(std::cout);
+    octree.set_saturation_threshold(conf.saturation);
+    std::string const checkpoint_file = conf.out_octree + ".checkpoint";
+    if (conf.checkpoint_minutes > 0)
+    {
+        std::size_t const interval
+            = static_cast<std::size_t>(conf.checkpoint_minutes) * 60 * 1000;
+        std::cout << "Checkpoint file: " << checkpoint_file << std::endl;
+        octree.set_checkpoint(checkpoint_file, interval, conf.resume);
+    }
+    if (!conf.update_octree.empty())
+    {
+        std::cout << "Loading previous octree " << conf.update_octree
+            << "..." << std::flush;
+        timer.reset();
+        fssr::IsoOctree previous;
+        try
+        {
+            previous.read_from_file(conf.update_octree);
+        }
+        catch (std::exception& e)
+        {
+            std::cerr << std::endl << "Error loading "
+                << conf.update_octree << ": " << e.what() << std::endl;
+            return 1;
+        }
+        octree.set_update(previous, new_samples);
+        std::vector<fssr::Sample>().swap(new_samples);
+        std::cout << " took " << timer.get_elapsed() << "ms" << std::endl;
+    }
     octree.compute_voxels();
 
     /* Save octree to file. */
     std::cout << "Octree output file: " << conf.out_octree << std::endl;
     std::cout << "Saving octree to file..." << std::flush;
+    octree.set_compression_level(conf.compression);
+    octree.set_tile_level(conf.tile_level);
     octree.write_to_file(conf.out_octree);
     std::cout << " done." << std::endl;
 
+    /* The checkpoint is not needed once the octree is saved. */
+    if (conf.checkpoint_minutes > 0)
+        std::remove(checkpoint_file.c_str());
+
     return 0;
 }
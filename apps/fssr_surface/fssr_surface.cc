@@ -11,6 +11,7 @@
  */
 
 #include <iostream>
+#include <sstream>
 #include <string>
 
 #include "util/timer.h"
@@ -30,8 +31,30 @@ struct AppSettings
     float conf_threshold;
     int component_size;
     bool clean_degenerated;
+    bool use_region;
+    math::Vec3d region_min;
+    math::Vec3d region_max;
 };
 
+bool
+parse_region (std::string const& str, AppSettings* conf)
+{
+    std::istringstream in(str);
+    double values[6];
+    for (int i = 0; i < 6; ++i)
+    {
+        char separator = ',';
+        if ((i > 0 && !(in >> separator)) || separator != ','
+            || !(in >> values[i]))
+            return false;
+    }
+    if (!(in >> std::ws).eof())
+        return false;
+    conf->region_min = math::Vec3d(values[0], values[1], values[2]);
+    conf->region_max = math::Vec3d(values[3], values[4], values[5]);
+    return true;
+}
+
 void
 remove_low_conf_geometry (mve::TriangleMesh::Ptr mesh, float const thres)
 {
@@ -63,12 +86,15 @@ main (int argc, char** argv)
     args.add_option('t', "threshold", true, "Threshold on the geometry confidence [1.0]");
     args.add_option('c', "component-size", true, "Minimum number of vertices per component [1000]");
     args.add_option('n', "no-clean", false, "Prevents cleanup of degenerated faces");
+    args.add_option('r', "region", true, "Extract region X1,Y1,Z1,X2,Y2,Z2 only");
     args.set_description("Extracts the isosurface from the sampled implicit "
         "function from an input octree. The accumulated weights in the octree "
         "can be thresholded to extract reliable parts of the geometry only. "
         "Small isolated components may be removed using a threshold on the "
         "vertex amount per component. A cleanup procedure for Marching Cubes "
-        "artifacts is executed, but can be disabled.");
+        "artifacts is executed, but can be disabled. A region of the octree "
+        "can be extracted, which loads only the tiles of the region from "
+        "binary octree files.");
     args.parse(argc, argv);
 
     /* Init default settings. */
@@ -78,6 +104,7 @@ main (int argc, char** argv)
     conf.conf_threshold = 1.0f;
     conf.component_size = 1000;
     conf.clean_degenerated = true;
+    conf.use_region = false;
 
     /* Scan arguments. */
     while (util::ArgResult const* arg = args.next_result())
@@ -90,6 +117,14 @@ main (int argc, char** argv)
             case 't': conf.conf_threshold = arg->get_arg<float>(); break;
             case 'c': conf.component_size = arg->get_arg<int>(); break;
             case 'n': conf.clean_degenerated = false; break;
+            case 'r':
+                conf.use_region = true;
+                if (!parse_region(arg->arg, &conf))
+                {
+                    std::cerr << "Invalid region: " << arg->arg << std::endl;
+                    return 1;
+                }
+                break;
             default:
                 std::cerr << "Invalid option: " << arg->opt->sopt << std::endl;
                 return 1;
@@ -101,16 +136,51 @@ main (int argc, char** argv)
     std::cout << "Loading octree from file..." << std::flush;
     util::WallTimer timer;
     fssr::IsoOctree octree;
-    octree.read_from_file(conf.in_octree);
+    fssr::MappedOctreeFile mapped_file;
+    std::size_t num_voxels = 0;
+    try
+    {
+        /*
+         * Voxels of binary containers are transferred from the mapping.
+         * For regions, only the tiles of the region are loaded.
+         */
+        if (conf.use_region)
+        {
+            octree.read_from_file(conf.in_octree,
+                conf.region_min, conf.region_max);
+            num_voxels = octree.get_voxels().size();
+        }
+        else if (fssr::MappedOctreeFile::is_container(conf.in_octree))
+        {
+            mapped_file.map(conf.in_octree);
+            mapped_file.read_hierarchy(&octree);
+            num_voxels = mapped_file.get_num_voxels();
+        }
+        else
+        {
+            octree.read_from_file(conf.in_octree);
+            num_voxels = octree.get_voxels().size();
+        }
+    }
+    catch (std::exception& e)
+    {
+        std::cerr << std::endl << "Error loading octree: " << e.what()
+            << std::endl;
+        return 1;
+    }
     std::cout << " took " << timer.get_elapsed() << "ms." << std::endl;
-    std::cout << "Octree contains " << octree.get_voxels().size()
+    std::cout << "Octree contains " << num_voxels
         << " voxels in " << octree.get_num_nodes() << " nodes." << std::endl;
 
     /* Transfer octree. */
     std::cout << "Transfering octree and voxel data..." << std::flush;
     timer.reset();
     SimonIsoOctree iso_tree;
-    iso_tree.set_octree(octree);
+    if (mapped_file.is_mapped())
+        iso_tree.set_octree(octree, mapped_file);
+    else
+        iso_tree.set_octree(octree);
+    mapped_file.close();
     octree.clear();
     std::cout << " took " << timer.get_elapsed() << "ms." << std::endl;
 
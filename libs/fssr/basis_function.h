@@ -132,6 +132,11 @@ weighting_function_mpu (Sample const& sample, math::Vector<T, 3> const& pos);
 
 /**
  * Transforms the given position according to the samples position and normal.
+ * The x-coordinate of the result is the distance along the (unit length)
+ * normal. All basis and weighting functions are rotationally symmetric
+ * around the normal, and the distance from the normal axis is returned as
+ * y-coordinate while the z-coordinate is zero. This avoids computing a
+ * rotation matrix with trigonometric functions for every evaluation.
  */
 math::Vec3f
 transform_position (math::Vec3f const& pos, Sample const& sample);
@@ -294,9 +299,10 @@ weighting_function_mpu (Sample const& sample, math::Vector<T, 3> const& pos)
 inline math::Vec3f
 transform_position (math::Vec3f const& pos, Sample const& sample)
 {
-    math::Matrix3f rot;
-    rotation_from_normal(sample.normal, &rot);
-    return rot * (pos - sample.pos);
+    math::Vec3f const dir = pos - sample.pos;
+    float const x = dir.dot(sample.normal);
+    float const r2 = dir.square_norm() - MATH_POW2(x);
+    return math::Vec3f(x, r2 > 0.0f ? std::sqrt(r2) : 0.0f, 0.0f);
 }
 
 FSSR_NAMESPACE_END
@@ -0,0 +1,471 @@
+/*
+ * This file is part of the Floating Scale Surface Reconstruction software.
+ * Written by Simon Fuhrmann.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "math/defines.h"
+#include "fssr/basis_function.h"
+#include "fssr/basis_kernel.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define FSSR_BASIS_KERNEL_X86 1
+#   include <immintrin.h>
+#else
+#   define FSSR_BASIS_KERNEL_X86 0
+#endif
+
+FSSR_NAMESPACE_BEGIN
+
+void
+SampleBatch::add_sample (Sample const& sample, math::Vec3d const& voxel_pos)
+{
+    std::size_t const index = this->num_samples;
+    if (this->scale.size() <= index)
+    {
+        std::size_t const size = std::max<std::size_t>(2 * index,
+            static_cast<std::size_t>(PADDING));
+        for (int i = 0; i < 3; ++i)
+        {
+            this->dir[i].resize(size);
+            this->normal[i].resize(size);
+            this->color[i].resize(size);
+        }
+        this->scale.resize(size);
+        this->confidence.resize(size);
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        this->dir[i][index] = static_cast<float>(voxel_pos[i] - sample.pos[i]);
+        this->normal[i][index] = sample.normal[i];
+        this->color[i][index] = sample.color[i];
+    }
+    this->scale[index] = sample.scale;
+    this->confidence[index] = sample.confidence;
+    this->num_samples += 1;
+}
+
+void
+SampleBatch::pad (void)
+{
+    std::size_t const size = (this->num_samples + PADDING - 1)
+        / PADDING * PADDING;
+    if (this->scale.size() < size)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            this->dir[i].resize(size);
+            this->normal[i].resize(size);
+            this->color[i].resize(size);
+        }
+        this->scale.resize(size);
+        this->confidence.resize(size);
+    }
+
+    for (std::size_t j = this->num_samples; j < size; ++j)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            this->dir[i][j] = 0.0f;
+            this->normal[i][j] = 0.0f;
+            this->color[i][j] = 0.0f;
+        }
+        this->scale[j] = 1.0f;
+        this->confidence[j] = 0.0f;
+    }
+}
+
+/* ---------------------------------------------------------------- */
+
+namespace
+{
+    /* Constants of the weighting function, see basis_function.h. */
+    float const WEIGHT_A_O = 2.0f / 27.0f;
+    float const WEIGHT_B_O = -1.0f / 3.0f;
+    float const WEIGHT_A_I = 1.0f / 9.0f;
+    float const WEIGHT_B_I = 2.0f / 3.0f;
+
+    void
+    evaluate_scalar (SampleBatch const& batch, BasisSums* sums)
+    {
+        for (std::size_t i = 0; i < batch.num_samples; ++i)
+        {
+            /* Same as transform_position() in basis_function.h. */
+            float x = 0.0f, d2 = 0.0f;
+            for (int j = 0; j < 3; ++j)
+            {
+                x += batch.dir[j][i] * batch.normal[j][i];
+                d2 += MATH_POW2(batch.dir[j][i]);
+            }
+            float const r2 = d2 - MATH_POW2(x);
+            math::Vec3f const tpos(x, r2 > 0.0f ? std::sqrt(r2) : 0.0f, 0.0f);
+
+            float const scale = batch.scale[i];
+            float const confidence = batch.confidence[i];
+            double const value = gaussian_derivative(scale, tpos);
+            double const weight = weighting_function(scale, tpos)
+                * confidence;
+            double const color_weight = gaussian_normalized(scale / 5.0f,
+                tpos) * confidence;
+
+            sums->ifn += value * weight;
+            sums->weight += weight;
+            sums->scale += scale * color_weight;
+            for (int j = 0; j < 3; ++j)
+                sums->color[j] += batch.color[j][i] * color_weight;
+            sums->color_weight += color_weight;
+        }
+    }
+
+#if FSSR_BASIS_KERNEL_X86
+
+    /* ------------------------------ AVX2 ------------------------------ */
+
+    /* Polynomial approximation of exp(x) for x in [-87, 88] (Cephes). */
+    __attribute__((target("avx2,fma")))
+    inline __m256
+    exp_avx2 (__m256 x)
+    {
+        x = _mm256_max_ps(x, _mm256_set1_ps(-87.0f));
+        x = _mm256_min_ps(x, _mm256_set1_ps(88.0f));
+        __m256 const n = _mm256_round_ps(_mm256_mul_ps(x,
+            _mm256_set1_ps(1.44269504088896341f)),
+            _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+        r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+        __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+        p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+        p = _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r);
+        p = _mm256_add_ps(p, _mm256_set1_ps(1.0f));
+
+        __m256i const e = _mm256_slli_epi32(_mm256_add_epi32(
+            _mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+        return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+    }
+
+    /* Adds the eight lanes to the four double precision lanes. */
+    __attribute__((target("avx2,fma")))
+    inline __m256d
+    accumulate_avx2 (__m256d acc, __m256 values)
+    {
+        acc = _mm256_add_pd(acc, _mm256_cvtps_pd(
+            _mm256_castps256_ps128(values)));
+        return _mm256_add_pd(acc, _mm256_cvtps_pd(
+            _mm256_extractf128_ps(values, 1)));
+    }
+
+    __attribute__((target("avx2,fma")))
+    inline double
+    horizontal_sum_avx2 (__m256d acc)
+    {
+        double values[4];
+        _mm256_storeu_pd(values, acc);
+        return values[0] + values[1] + values[2] + values[3];
+    }
+
+    __attribute__((target("avx2,fma")))
+    void
+    evaluate_avx2 (SampleBatch const& batch, BasisSums* sums)
+    {
+        __m256 const zero = _mm256_setzero_ps();
+        __m256 const one = _mm256_set1_ps(1.0f);
+        __m256 const three = _mm256_set1_ps(3.0f);
+        __m256 const abs_mask = _mm256_castsi256_ps(
+            _mm256_set1_epi32(0x7fffffff));
+        __m256 const value_factor = _mm256_set1_ps(
+            static_cast<float>(1.0 / MATH_2_PI));
+        __m256 const color_factor = _mm256_set1_ps(
+            static_cast<float>(1.0 / MATH_SQRT_2PI));
+
+        __m256d acc_ifn = _mm256_setzero_pd();
+        __m256d acc_weight = _mm256_setzero_pd();
+        __m256d acc_scale = _mm256_setzero_pd();
+        __m256d acc_color[3];
+        for (int j = 0; j < 3; ++j)
+            acc_color[j] = _mm256_setzero_pd();
+        __m256d acc_color_weight = _mm256_setzero_pd();
+
+        for (std::size_t i = 0; i < batch.num_samples; i += 8)
+        {
+            __m256 const dx = _mm256_loadu_ps(&batch.dir[0][i]);
+            __m256 const dy = _mm256_loadu_ps(&batch.dir[1][i]);
+            __m256 const dz = _mm256_loadu_ps(&batch.dir[2][i]);
+            __m256 const s = _mm256_loadu_ps(&batch.scale[i]);
+            __m256 const c = _mm256_loadu_ps(&batch.confidence[i]);
+
+            /* Position along the normal and distance from the normal. */
+            __m256 x = _mm256_mul_ps(dx, _mm256_loadu_ps(&batch.normal[0][i]));
+            x = _mm256_fmadd_ps(dy, _mm256_loadu_ps(&batch.normal[1][i]), x);
+            x = _mm256_fmadd_ps(dz, _mm256_loadu_ps(&batch.normal[2][i]), x);
+            __m256 d2 = _mm256_mul_ps(dx, dx);
+            d2 = _mm256_fmadd_ps(dy, dy, d2);
+            d2 = _mm256_fmadd_ps(dz, dz, d2);
+            __m256 const x2 = _mm256_mul_ps(x, x);
+            __m256 const r2 = _mm256_max_ps(_mm256_sub_ps(d2, x2), zero);
+            __m256 const t2 = _mm256_add_ps(x2, r2);
+
+            __m256 const inv_s = _mm256_div_ps(one, s);
+            __m256 const inv_s2 = _mm256_mul_ps(inv_s, inv_s);
+
+            /* Gaussian derivative. */
+            __m256 const g = exp_avx2(_mm256_mul_ps(_mm256_set1_ps(-0.5f),
+                _mm256_mul_ps(t2, inv_s2)));
+            __m256 const value = _mm256_mul_ps(_mm256_mul_ps(x, g),
+                _mm256_mul_ps(_mm256_mul_ps(inv_s2, inv_s2), value_factor));
+
+            /* Weighting function in x-direction. */
+            __m256 const u = _mm256_mul_ps(x, inv_s);
+            __m256 const wx_out = _mm256_fmadd_ps(_mm256_mul_ps(
+                _mm256_fmadd_ps(_mm256_set1_ps(WEIGHT_A_O), u,
+                _mm256_set1_ps(WEIGHT_B_O)), u), u, one);
+            __m256 const wx_in = _mm256_fmadd_ps(_mm256_fmadd_ps(
+                _mm256_set1_ps(WEIGHT_A_I), u, _mm256_set1_ps(WEIGHT_B_I)),
+                u, one);
+            __m256 wx = _mm256_blendv_ps(wx_in, wx_out,
+                _mm256_cmp_ps(u, zero, _CMP_GT_OQ));
+            wx = _mm256_and_ps(wx, _mm256_cmp_ps(_mm256_and_ps(u, abs_mask),
+                three, _CMP_LT_OQ));
+
+            /* Weighting function in y- and z-direction. */
+            __m256 const q = _mm256_mul_ps(r2, inv_s2);
+            __m256 wyz = _mm256_fmadd_ps(_mm256_fmadd_ps(
+                _mm256_set1_ps(WEIGHT_A_O), _mm256_sqrt_ps(q),
+                _mm256_set1_ps(WEIGHT_B_O)), q, one);
+            wyz = _mm256_and_ps(wyz, _mm256_cmp_ps(q,
+                _mm256_set1_ps(9.0f), _CMP_LE_OQ));
+            __m256 const weight = _mm256_mul_ps(_mm256_mul_ps(wx, wyz), c);
+
+            /* Normalized Gaussian with a fifth of the scale for colors. */
+            __m256 const inv_cs = _mm256_mul_ps(inv_s, _mm256_set1_ps(5.0f));
+            __m256 const cg = exp_avx2(_mm256_mul_ps(_mm256_set1_ps(-0.5f),
+                _mm256_mul_ps(t2, _mm256_mul_ps(inv_cs, inv_cs))));
+            __m256 const color_weight = _mm256_mul_ps(_mm256_mul_ps(cg,
+                inv_cs), _mm256_mul_ps(color_factor, c));
+
+            acc_ifn = accumulate_avx2(acc_ifn, _mm256_mul_ps(value, weight));
+            acc_weight = accumulate_avx2(acc_weight, weight);
+            acc_scale = accumulate_avx2(acc_scale,
+                _mm256_mul_ps(s, color_weight));
+            for (int j = 0; j < 3; ++j)
+                acc_color[j] = accumulate_avx2(acc_color[j], _mm256_mul_ps(
+                    _mm256_loadu_ps(&batch.color[j][i]), color_weight));
+            acc_color_weight = accumulate_avx2(acc_color_weight,
+                color_weight);
+        }
+
+        sums->ifn += horizontal_sum_avx2(acc_ifn);
+        sums->weight += horizontal_sum_avx2(acc_weight);
+        sums->scale += horizontal_sum_avx2(acc_scale);
+        for (int j = 0; j < 3; ++j)
+            sums->color[j] += horizontal_sum_avx2(acc_color[j]);
+        sums->color_weight += horizontal_sum_avx2(acc_color_weight);
+    }
+
+    /* ----------------------------- AVX-512 ---------------------------- */
+
+#if !defined(__clang__)
+    /* GCC warns about intentionally undefined vectors in AVX-512 intrinsics. */
+#   pragma GCC diagnostic push
+#   pragma GCC diagnostic ignored "-Wuninitialized"
+#   pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+    /* Polynomial approximation of exp(x) for x in [-87, 88] (Cephes). */
+    __attribute__((target("avx512f")))
+    inline __m512
+    exp_avx512 (__m512 x)
+    {
+        x = _mm512_max_ps(x, _mm512_set1_ps(-87.0f));
+        x = _mm512_min_ps(x, _mm512_set1_ps(88.0f));
+        __m512 const n = _mm512_roundscale_ps(_mm512_mul_ps(x,
+            _mm512_set1_ps(1.44269504088896341f)),
+            _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+        __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(0.693359375f), x);
+        r = _mm512_fnmadd_ps(n, _mm512_set1_ps(-2.12194440e-4f), r);
+
+        __m512 p = _mm512_set1_ps(1.9875691500e-4f);
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.3981999507e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(8.3334519073e-3f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(4.1665795894e-2f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(1.6666665459e-1f));
+        p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(5.0000001201e-1f));
+        p = _mm512_fmadd_ps(p, _mm512_mul_ps(r, r), r);
+        p = _mm512_add_ps(p, _mm512_set1_ps(1.0f));
+        return _mm512_scalef_ps(p, n);
+    }
+
+    /* Adds the sixteen lanes to the eight double precision lanes. */
+    __attribute__((target("avx512f")))
+    inline __m512d
+    accumulate_avx512 (__m512d acc, __m512 values)
+    {
+        acc = _mm512_add_pd(acc, _mm512_cvtps_pd(
+            _mm512_castps512_ps256(values)));
+        return _mm512_add_pd(acc, _mm512_cvtps_pd(_mm256_castpd_ps(
+            _mm512_extractf64x4_pd(_mm512_castps_pd(values), 1))));
+    }
+
+    __attribute__((target("avx512f")))
+    void
+    evaluate_avx512 (SampleBatch const& batch, BasisSums* sums)
+    {
+        __m512 const zero = _mm512_setzero_ps();
+        __m512 const one = _mm512_set1_ps(1.0f);
+        __m512 const value_factor = _mm512_set1_ps(
+            static_cast<float>(1.0 / MATH_2_PI));
+        __m512 const color_factor = _mm512_set1_ps(
+            static_cast<float>(1.0 / MATH_SQRT_2PI));
+
+        __m512d acc_ifn = _mm512_setzero_pd();
+        __m512d acc_weight = _mm512_setzero_pd();
+        __m512d acc_scale = _mm512_setzero_pd();
+        __m512d acc_color[3];
+        for (int j = 0; j < 3; ++j)
+            acc_color[j] = _mm512_setzero_pd();
+        __m512d acc_color_weight = _mm512_setzero_pd();
+
+        for (std::size_t i = 0; i < batch.num_samples; i += 16)
+        {
+            __m512 const dx = _mm512_loadu_ps(&batch.dir[0][i]);
+            __m512 const dy = _mm512_loadu_ps(&batch.dir[1][i]);
+            __m512 const dz = _mm512_loadu_ps(&batch.dir[2][i]);
+            __m512 const s = _mm512_loadu_ps(&batch.scale[i]);
+            __m512 const c = _mm512_loadu_ps(&batch.confidence[i]);
+
+            /* Position along the normal and distance from the normal. */
+            __m512 x = _mm512_mul_ps(dx, _mm512_loadu_ps(&batch.normal[0][i]));
+            x = _mm512_fmadd_ps(dy, _mm512_loadu_ps(&batch.normal[1][i]), x);
+            x = _mm512_fmadd_ps(dz, _mm512_loadu_ps(&batch.normal[2][i]), x);
+            __m512 d2 = _mm512_mul_ps(dx, dx);
+            d2 = _mm512_fmadd_ps(dy, dy, d2);
+            d2 = _mm512_fmadd_ps(dz, dz, d2);
+            __m512 const x2 = _mm512_mul_ps(x, x);
+            __m512 const r2 = _mm512_max_ps(_mm512_sub_ps(d2, x2), zero);
+            __m512 const t2 = _mm512_add_ps(x2, r2);
+
+            __m512 const inv_s = _mm512_div_ps(one, s);
+            __m512 const inv_s2 = _mm512_mul_ps(inv_s, inv_s);
+
+            /* Gaussian derivative. */
+            __m512 const g = exp_avx512(_mm512_mul_ps(_mm512_set1_ps(-0.5f),
+                _mm512_mul_ps(t2, inv_s2)));
+            __m512 const value = _mm512_mul_ps(_mm512_mul_ps(x, g),
+                _mm512_mul_ps(_mm512_mul_ps(inv_s2, inv_s2), value_factor));
+
+            /* Weighting function in x-direction. */
+            __m512 const u = _mm512_mul_ps(x, inv_s);
+            __m512 const wx_out = _mm512_fmadd_ps(_mm512_mul_ps(
+                _mm512_fmadd_ps(_mm512_set1_ps(WEIGHT_A_O), u,
+                _mm512_set1_ps(WEIGHT_B_O)), u), u, one);
+            __m512 const wx_in = _mm512_fmadd_ps(_mm512_fmadd_ps(
+                _mm512_set1_ps(WEIGHT_A_I), u, _mm512_set1_ps(WEIGHT_B_I)),
+                u, one);
+            __m512 wx = _mm512_mask_blend_ps(
+                _mm512_cmp_ps_mask(u, zero, _CMP_GT_OQ), wx_in, wx_out);
+            wx = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(_mm512_abs_ps(u),
+                _mm512_set1_ps(3.0f), _CMP_LT_OQ), wx);
+
+            /* Weighting function in y- and z-direction. */
+            __m512 const q = _mm512_mul_ps(r2, inv_s2);
+            __m512 wyz = _mm512_fmadd_ps(_mm512_fmadd_ps(
+                _mm512_set1_ps(WEIGHT_A_O), _mm512_sqrt_ps(q),
+                _mm512_set1_ps(WEIGHT_B_O)), q, one);
+            wyz = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(q,
+                _mm512_set1_ps(9.0f), _CMP_LE_OQ), wyz);
+            __m512 const weight = _mm512_mul_ps(_mm512_mul_ps(wx, wyz), c);
+
+            /* Normalized Gaussian with a fifth of the scale for colors. */
+            __m512 const inv_cs = _mm512_mul_ps(inv_s, _mm512_set1_ps(5.0f));
+            __m512 const cg = exp_avx512(_mm512_mul_ps(_mm512_set1_ps(-0.5f),
+                _mm512_mul_ps(t2, _mm512_mul_ps(inv_cs, inv_cs))));
+            __m512 const color_weight = _mm512_mul_ps(_mm512_mul_ps(cg,
+                inv_cs), _mm512_mul_ps(color_factor, c));
+
+            acc_ifn = accumulate_avx512(acc_ifn,
+                _mm512_mul_ps(value, weight));
+            acc_weight = accumulate_avx512(acc_weight, weight);
+            acc_scale = accumulate_avx512(acc_scale,
+                _mm512_mul_ps(s, color_weight));
+            for (int j = 0; j < 3; ++j)
+                acc_color[j] = accumulate_avx512(acc_color[j], _mm512_mul_ps(
+                    _mm512_loadu_ps(&batch.color[j][i]), color_weight));
+            acc_color_weight = accumulate_avx512(acc_color_weight,
+                color_weight);
+        }
+
+        sums->ifn += _mm512_reduce_add_pd(acc_ifn);
+        sums->weight += _mm512_reduce_add_pd(acc_weight);
+        sums->scale += _mm512_reduce_add_pd(acc_scale);
+        for (int j = 0; j < 3; ++j)
+            sums->color[j] += _mm512_reduce_add_pd(acc_color[j]);
+        sums->color_weight += _mm512_reduce_add_pd(acc_color_weight);
+    }
+
+#if !defined(__clang__)
+#   pragma GCC diagnostic pop
+#endif
+
+#endif /* FSSR_BASIS_KERNEL_X86 */
+}
+
+/* ---------------------------------------------------------------- */
+
+bool
+basis_kernel_supported (BasisKernel kernel)
+{
+    switch (kernel)
+    {
+        case BASIS_KERNEL_SCALAR:
+            return true;
+#if FSSR_BASIS_KERNEL_X86
+        case BASIS_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2")
+                && __builtin_cpu_supports("fma");
+        case BASIS_KERNEL_AVX512:
+            return __builtin_cpu_supports("avx512f");
+#endif
+        default:
+            return false;
+    }
+}
+
+BasisKernel
+basis_kernel_best (void)
+{
+    static BasisKernel const best = basis_kernel_supported(BASIS_KERNEL_AVX512)
+        ? BASIS_KERNEL_AVX512 : (basis_kernel_supported(BASIS_KERNEL_AVX2)
+        ? BASIS_KERNEL_AVX2 : BASIS_KERNEL_SCALAR);
+    return best;
+}
+
+void
+evaluate_basis_functions (SampleBatch* batch, BasisSums* sums,
+    BasisKernel kernel)
+{
+    switch (kernel)
+    {
+#if FSSR_BASIS_KERNEL_X86
+        case BASIS_KERNEL_AVX2:
+            batch->pad();
+            evaluate_avx2(*batch, sums);
+            break;
+        case BASIS_KERNEL_AVX512:
+            batch->pad();
+            evaluate_avx512(*batch, sums);
+            break;
+#endif
+        default:
+            evaluate_scalar(*batch, sums);
+            break;
+    }
+}
+
+FSSR_NAMESPACE_END
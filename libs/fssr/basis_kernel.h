@@ -0,0 +1,125 @@
+/*
+ * This file is part of the Floating Scale Surface Reconstruction software.
+ * Written by Simon Fuhrmann.
+ */
+
+#ifndef FSSR_BASIS_KERNEL_HEADER
+#define FSSR_BASIS_KERNEL_HEADER
+
+#include <vector>
+
+#include "math/vector.h"
+#include "fssr/defines.h"
+#include "fssr/sample.h"
+
+FSSR_NAMESPACE_BEGIN
+
+/**
+ * Structure-of-arrays copy of the samples that influence a voxel, as
+ * input for the vectorized basis function kernels. Sample positions are
+ * stored relative to the voxel position, which is computed in double
+ * precision. The arrays are padded to a multiple of the largest vector
+ * width with samples of zero confidence, which do not contribute.
+ */
+struct SampleBatch
+{
+public:
+    enum { PADDING = 16 };
+
+public:
+    SampleBatch (void);
+    void clear (void);
+    void add_sample (Sample const& sample, math::Vec3d const& voxel_pos);
+    std::size_t get_num_samples (void) const;
+    /** Pads the arrays with non-contributing samples. */
+    void pad (void);
+
+public:
+    std::vector<float> dir[3];
+    std::vector<float> normal[3];
+    std::vector<float> color[3];
+    std::vector<float> scale;
+    std::vector<float> confidence;
+    std::size_t num_samples;
+};
+
+/**
+ * Sums of the basis and weighting functions over all samples of a voxel.
+ */
+struct BasisSums
+{
+public:
+    BasisSums (void);
+
+public:
+    double ifn;
+    double weight;
+    double scale;
+    math::Vec3d color;
+    double color_weight;
+};
+
+/** Available implementations of the basis function kernel. */
+enum BasisKernel
+{
+    BASIS_KERNEL_SCALAR,
+    BASIS_KERNEL_AVX2,
+    BASIS_KERNEL_AVX512
+};
+
+/** Returns true if the CPU supports the kernel. */
+bool
+basis_kernel_supported (BasisKernel kernel);
+
+/** Returns the fastest kernel supported by the CPU. */
+BasisKernel
+basis_kernel_best (void);
+
+/**
+ * Evaluates the basis function (Gaussian derivative), the weighting
+ * function and the color weight (normalized Gaussian) for all samples in
+ * the batch and accumulates the sums in double precision. The SIMD
+ * kernels evaluate 8 (AVX2) or 16 (AVX-512) samples at once and use a
+ * polynomial approximation of the exponential function.
+ */
+void
+evaluate_basis_functions (SampleBatch* batch, BasisSums* sums,
+    BasisKernel kernel = basis_kernel_best());
+
+FSSR_NAMESPACE_END
+
+/* ------------------------- Implementation ---------------------------- */
+
+FSSR_NAMESPACE_BEGIN
+
+inline
+SampleBatch::SampleBatch (void)
+    : num_samples(0)
+{
+}
+
+inline void
+SampleBatch::clear (void)
+{
+    this->num_samples = 0;
+}
+
+inline std::size_t
+SampleBatch::get_num_samples (void) const
+{
+    return this->num_samples;
+}
+
+inline
+BasisSums::BasisSums (void)
+    : ifn(0.0)
+    , weight(0.0)
+    , scale(0.0)
+    , color(0.0)
+    , color_weight(0.0)
+{
+}
+
+FSSR_NAMESPACE_END
+
+#endif /* FSSR_BASIS_KERNEL_HEADER */
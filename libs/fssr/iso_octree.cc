@@ -7,25 +7,286 @@
 #include <cstring>
 #include <cerrno>
 #include <fstream>
+#include <iomanip>
+#include <sstream>
 #include <vector>
-#include <list>
-#include <set>
 #include <stdexcept>
 #include <limits>
+#include <algorithm>
+#include <functional>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
 
 #include "util/timer.h"
 #include "util/string.h"
 #include "fssr/basis_function.h"
+#include "fssr/basis_kernel.h"
+#include "fssr/radix_sort.h"
 #include "fssr/sample.h"
+#include "fssr/octree_file.h"
 #include "fssr/iso_octree.h"
 
 FSSR_NAMESPACE_BEGIN
 
+namespace
+{
+    /* Influence distance as factor of the sample scale. */
+    double const INFLUENCE_FACTOR = 3.0;
+
+    /* Maximum number of leaves in a subtree to form a brick. */
+    std::size_t const BRICK_MAX_LEAVES = 8;
+
+    /* The scatter engine is selected if there are more voxels per sample. */
+    std::size_t const SCATTER_VOXELS_PER_SAMPLE = 12;
+
+    /* Maximum number of sample references per scatter pass. */
+    std::size_t const SCATTER_MAX_REFERENCES = 1 << 26;
+
+    /*
+     * Maximum number of voxel indices kept from the counting pass of the
+     * scatter engine. This is the memory of the references of one pass.
+     */
+    std::size_t const SCATTER_MAX_CACHED = SCATTER_MAX_REFERENCES / 2;
+
+    /* Evaluation state of the voxels while checkpointing or updating. */
+    enum VoxelState
+    {
+        VOXEL_PENDING = 0,
+        VOXEL_DONE = 1,
+        VOXEL_CHECKPOINTED = 2,
+        VOXEL_REUSED = 3
+    };
+
+    /* Number of voxels per buffered write of the voxel arrays. */
+    std::size_t const VOXEL_WRITE_BLOCK_SIZE = 1 << 16;
+
+    /* Marks voxels not yet assigned to a brick. */
+    uint32_t const NO_BRICK = std::numeric_limits<uint32_t>::max();
+
+    /* Number of voxels a thread processes before reporting progress. */
+    std::size_t const PROGRESS_BATCH_SIZE = 64;
+
+    /* Subtrees at this level are traversed in parallel. */
+    int const SUBTREE_LEVEL = 3;
+
+    /* The influenced voxels of the samples of a node, sample by sample. */
+    struct NodeVoxels
+    {
+        std::vector<std::size_t> offsets;
+        std::vector<std::size_t> voxel_ids;
+    };
+
+    struct VoxelIndexKey
+    {
+        uint64_t operator() (uint64_t index) const
+        {
+            return index;
+        }
+    };
+
+    /* Key for sorting voxels by tile. */
+    struct TileKey
+    {
+        uint64_t operator() (std::pair<uint64_t, std::size_t> const& v) const
+        {
+            return v.first;
+        }
+    };
+
+    /* Brick tasks per thread for load balancing. */
+    std::size_t const TASKS_PER_THREAD = 64;
+
+    /* Voxels per chunk in the Morton order schedule. */
+    int const MORTON_CHUNK_SIZE = 32;
+
+    /* Morton code and position of a voxel in the voxel vector. */
+    typedef std::pair<uint64_t, std::size_t> MortonVoxel;
+
+    struct MortonVoxelKey
+    {
+        uint64_t operator() (MortonVoxel const& voxel) const
+        {
+            return voxel.first;
+        }
+    };
+
+    struct VoxelIndexCompare
+    {
+        bool operator() (IsoOctree::VoxelVector::value_type const& voxel,
+            VoxelIndex const& index) const
+        {
+            return voxel.first < index;
+        }
+    };
+
+    void
+    write_voxel (std::ostream& out, VoxelIndex const& index,
+        VoxelData const& data)
+    {
+        out.write(reinterpret_cast<char const*>(&index.index),
+            sizeof(index.index));
+        out.write(reinterpret_cast<char const*>(&data.value),
+            sizeof(data.value));
+        out.write(reinterpret_cast<char const*>(&data.conf),
+            sizeof(data.conf));
+        out.write(reinterpret_cast<char const*>(&data.scale),
+            sizeof(data.scale));
+        out.write(reinterpret_cast<char const*>(*data.color),
+            3 * sizeof(float));
+    }
+
+    bool
+    read_voxel (std::istream& in, VoxelIndex* index, VoxelData* data)
+    {
+        in.read(reinterpret_cast<char*>(&index->index), sizeof(index->index));
+        in.read(reinterpret_cast<char*>(&data->value), sizeof(data->value));
+        in.read(reinterpret_cast<char*>(&data->conf), sizeof(data->conf));
+        in.read(reinterpret_cast<char*>(&data->scale), sizeof(data->scale));
+        in.read(reinterpret_cast<char*>(*data->color), 3 * sizeof(float));
+        return !in.fail();
+    }
+
+    /* Pads the stream with zeros to the container section alignment. */
+    void
+    write_padding (std::ostream& out)
+    {
+        char const zeros[FSSR_OCTREE_CONTAINER_ALIGNMENT] = { 0 };
+        std::size_t const pos = out.tellp();
+        std::size_t const rest = pos % FSSR_OCTREE_CONTAINER_ALIGNMENT;
+        if (rest > 0)
+            out.write(zeros, FSSR_OCTREE_CONTAINER_ALIGNMENT - rest);
+    }
+
+    /*
+     * Merges runs of voxels, each sorted by index, into the result. The
+     * runs are given by their offsets. The output is split into chunks
+     * at pivot indices sampled from the runs, and the chunks are merged
+     * in parallel.
+     */
+    void
+    merge_voxel_runs (IsoOctree::VoxelVector const& voxels,
+        std::vector<std::size_t> const& offsets,
+        IsoOctree::VoxelVector* result)
+    {
+        std::size_t const num_runs = offsets.size() - 1;
+        std::size_t num_chunks = 1;
+#ifdef _OPENMP
+        num_chunks = 4 * omp_get_max_threads();
+#endif
+        std::vector<VoxelIndex> samples;
+        std::size_t const stride = std::max<std::size_t>(1,
+            voxels.size() / (16 * num_chunks));
+        for (std::size_t i = 0; i < voxels.size(); i += stride)
+            samples.push_back(voxels[i].first);
+        std::sort(samples.begin(), samples.end());
+
+        /* Run bounds of chunk c are stored at c * num_runs. */
+        std::vector<std::size_t> bounds((num_chunks + 1) * num_runs);
+        std::copy(offsets.begin(), offsets.end() - 1, bounds.begin());
+        std::copy(offsets.begin() + 1, offsets.end(),
+            bounds.end() - num_runs);
+#pragma omp parallel for schedule(static)
+        for (std::size_t c = 1; c < num_chunks; ++c)
+        {
+            VoxelIndex const& pivot = samples[c * samples.size()
+                / num_chunks];
+            for (std::size_t r = 0; r < num_runs; ++r)
+                bounds[c * num_runs + r] = std::lower_bound(
+                    voxels.begin() + offsets[r],
+                    voxels.begin() + offsets[r + 1], pivot,
+                    VoxelIndexCompare()) - voxels.begin();
+        }
+
+        result->resize(voxels.size());
+#pragma omp parallel for schedule(dynamic)
+        for (std::size_t c = 0; c < num_chunks; ++c)
+        {
+            std::size_t const* begin = &bounds[c * num_runs];
+            std::size_t const* end = &bounds[(c + 1) * num_runs];
+            std::size_t out = 0;
+            std::vector<std::size_t> pos(begin, end);
+            typedef std::pair<uint64_t, std::size_t> HeapEntry;
+            std::vector<HeapEntry> heap;
+            for (std::size_t r = 0; r < num_runs; ++r)
+            {
+                out += begin[r] - offsets[r];
+                if (begin[r] < end[r])
+                    heap.push_back(HeapEntry(voxels[begin[r]].first.index,
+                        r));
+            }
+            std::greater<HeapEntry> const heap_compare;
+            std::make_heap(heap.begin(), heap.end(), heap_compare);
+
+            while (!heap.empty())
+            {
+                std::pop_heap(heap.begin(), heap.end(), heap_compare);
+                std::size_t const r = heap.back().second;
+                (*result)[out++] = voxels[pos[r]++];
+                if (pos[r] == end[r])
+                    heap.pop_back();
+                else
+                {
+                    heap.back().first = voxels[pos[r]].first.index;
+                    std::push_heap(heap.begin(), heap.end(), heap_compare);
+                }
+            }
+        }
+    }
+
+    /*
+     * Returns true if the voxel is a corner of one of the tiles. Voxels
+     * on the lower faces of a tile belong to the neighboring tiles, which
+     * are checked as well. The tile keys must be sorted.
+     */
+    bool
+    is_tile_corner (VoxelIndex const& index, int tile_level,
+        std::vector<uint64_t> const& keys)
+    {
+        uint32_t const tile_mask = (1u << (20 - tile_level)) - 1;
+        uint32_t const offsets[3] = { index.get_offset_x(),
+            index.get_offset_y(), index.get_offset_z() };
+        for (int i = 0; i < 8; ++i)
+        {
+            VoxelIndex neighbor = index;
+            bool valid = true;
+            for (int j = 0; valid && j < 3; ++j)
+            {
+                if ((i & (1 << j)) == 0)
+                    continue;
+                valid = offsets[j] > 0 && (offsets[j] & tile_mask) == 0;
+                neighbor.index -= static_cast<uint64_t>(1) << (21 * j);
+            }
+            if (valid && std::binary_search(keys.begin(), keys.end(),
+                get_tile_key(neighbor, tile_level)))
+                return true;
+        }
+        return false;
+    }
+}
+
+inline bool
+IsoOctree::is_voxel_pending (std::size_t voxel_id) const
+{
+    return this->voxel_states.empty()
+        || this->voxel_states[voxel_id] == VOXEL_PENDING;
+}
+
+inline void
+IsoOctree::set_voxel_done (std::size_t voxel_id)
+{
+    if (!this->voxel_states.empty())
+        __atomic_store_n(&this->voxel_states[voxel_id], VOXEL_DONE,
+            __ATOMIC_RELEASE);
+}
+
 void
 IsoOctree::compute_voxels (void)
 {
     util::WallTimer timer;
     this->voxels.clear();
+    this->finalize();
     this->compute_all_voxels();
     std::cout << "Generated " << this->voxels.size()
         << " voxels, took " << timer.get_elapsed() << "ms." << std::endl;
@@ -37,150 +298,1032 @@ IsoOctree::compute_all_voxels (void)
     /* Locate all leafs and store voxels in a vector. */
     std::cout << "Computing sampling of the implicit function..." << std::endl;
     {
-        /* Make voxels unique by storing them in a set first. */
-        typedef std::set<VoxelIndex> VoxelIndexSet;
-        VoxelIndexSet voxel_set;
-        std::list<Octree::Iterator> queue;
-        queue.push_back(this->get_iterator_for_root());
-        while (!queue.empty())
-        {
-            Octree::Iterator iter = queue.front();
-            queue.pop_front();
+        /*
+         * Split the octree into subtrees, which are traversed in parallel.
+         * Every subtree collects the voxel indices of the corners of its
+         * leafs. The indices of all subtrees are concatenated, sorted and
+         * made unique, which yields the sorted voxels.
+         */
+        std::vector<Iterator> subtrees;
+        if (this->get_root_node() != NULL)
+            this->collect_subtrees(this->get_iterator_for_root(), &subtrees);
 
-            bool is_leaf = true;
-            for (int i = 0; i < 8; ++i)
+        std::vector<std::vector<uint64_t> > subtree_indices(subtrees.size());
+#pragma omp parallel for schedule(dynamic)
+        for (std::size_t i = 0; i < subtrees.size(); ++i)
+        {
+            std::vector<uint64_t>& indices = subtree_indices[i];
+            std::vector<Iterator> stack(1, subtrees[i]);
+            while (!stack.empty())
+            {
+                Iterator const iter = stack.back();
+                stack.pop_back();
                 if (iter.node_path.level < this->max_level
-                    && iter.node->children[i] != NULL)
+                    && !iter.node->is_leaf())
                 {
-                    queue.push_back(iter.descend(i));
-                    is_leaf = false;
+                    for (int j = 7; j >= 0; --j)
+                        if (iter.node->has_child(j))
+                            stack.push_back(iter.descend(j));
+                    continue;
                 }
 
-            if (!is_leaf)
-                continue;
-
-            for (int i = 0; i < 8; ++i)
-            {
-                VoxelIndex index;
-                index.from_path_and_corner(iter.node_path, i);
-                voxel_set.insert(index);
+                for (int j = 0; j < 8; ++j)
+                {
+                    VoxelIndex index;
+                    index.from_path_and_corner(iter.node_path, j);
+                    indices.push_back(index.index);
+                }
             }
         }
 
+        std::vector<std::size_t> offsets(subtrees.size() + 1, 0);
+        for (std::size_t i = 0; i < subtrees.size(); ++i)
+            offsets[i + 1] = offsets[i] + subtree_indices[i].size();
+        std::vector<uint64_t> indices(offsets.back());
+#pragma omp parallel for schedule(dynamic)
+        for (std::size_t i = 0; i < subtrees.size(); ++i)
+        {
+            std::copy(subtree_indices[i].begin(), subtree_indices[i].end(),
+                indices.begin() + offsets[i]);
+            std::vector<uint64_t>().swap(subtree_indices[i]);
+        }
+
+        /* The voxel index uses 63 bits, see voxel.h. */
+        radix_sort(&indices, VoxelIndexKey(), 63);
+        parallel_unique(&indices);
+
         /* Copy voxels over to a vector. */
         this->voxels.clear();
-        this->voxels.reserve(voxel_set.size());
-        for (VoxelIndexSet::const_iterator i = voxel_set.begin();
-            i != voxel_set.end(); ++i)
-            this->voxels.push_back(std::make_pair(*i, VoxelData()));
+        this->voxels.resize(indices.size());
+#pragma omp parallel for
+        for (std::size_t i = 0; i < indices.size(); ++i)
+            this->voxels[i].first.index = indices[i];
     }
 
     std::cout << "Sampling the implicit function at " << this->voxels.size()
         << " positions, fetch a beer..." << std::endl;
 
     /* Sample the implicit function for every voxel. */
-    std::size_t num_processed = 0;
-#pragma omp parallel for schedule(dynamic)
-    for (std::size_t i = 0; i < voxels.size(); ++i)
+    ConsoleProgress console_progress;
+    SamplingProgress* const user_progress = this->progress;
+    if (this->progress == NULL)
+        this->progress = &console_progress;
+    this->num_voxels_done = 0;
+    this->num_reused_voxels = 0;
+    if (!this->checkpoint_filename.empty())
+        this->begin_checkpoint();
+    if (!this->previous_voxels.empty())
+        this->begin_update();
+    this->num_evaluated_voxels = this->voxels.size() - this->num_voxels_done;
+
+    std::size_t num_skipped = 0;
+    std::size_t max_skipped = 0;
+    SamplingEngine engine = this->sampling_engine;
+    if (engine == SAMPLING_AUTO)
+        engine = this->get_num_samples() * SCATTER_VOXELS_PER_SAMPLE
+            < this->voxels.size() ? SAMPLING_SCATTER : SAMPLING_BRICKS;
+    switch (engine)
     {
-        VoxelIndex index = this->voxels[i].first;
-        math::Vec3d voxel_pos = index.compute_position(
+        case SAMPLING_VOXELS:
+            this->sample_voxels(&num_skipped, &max_skipped);
+            break;
+        case SAMPLING_SCATTER:
+            this->sample_scatter(&num_skipped, &max_skipped);
+            break;
+        default:
+            this->sample_bricks(&num_skipped, &max_skipped);
+            break;
+    }
+
+    /* Report progress one last time to get the 100% progress output. */
+    this->progress->on_progress(this->voxels.size(), this->voxels.size());
+    this->progress = user_progress;
+    if (!this->checkpoint_filename.empty())
+        this->write_checkpoint();
+    std::vector<uint8_t>().swap(this->voxel_states);
+    VoxelVector().swap(this->previous_voxels);
+    std::vector<Sample>().swap(this->update_samples);
+    if (!this->checkpoint_error.empty())
+        throw std::runtime_error(this->checkpoint_error);
+
+    this->num_skipped_samples = num_skipped;
+    if (this->saturation_threshold > 0.0f && !this->voxels.empty())
+    {
+        std::cout << "Saturation skipped " << num_skipped << " samples, "
+            << util::string::get_fixed(static_cast<double>(num_skipped)
+            / static_cast<double>(this->voxels.size()), 2)
+            << " per voxel on average, " << max_skipped
+            << " at most." << std::endl;
+    }
+}
+
+void
+IsoOctree::sample_voxels (std::size_t* num_skipped_ptr,
+    std::size_t* max_skipped_ptr)
+{
+    /*
+     * The voxels are sorted by index, which yields z-major slabs. Voxels
+     * are evaluated in Morton order instead, such that consecutive voxels
+     * and the chunks handed to the threads are compact in space and query
+     * the same octree nodes and samples.
+     */
+    std::vector<MortonVoxel> schedule(this->voxels.size());
+#pragma omp parallel for
+    for (std::size_t i = 0; i < schedule.size(); ++i)
+    {
+        schedule[i].first = this->voxels[i].first.get_morton_code();
+        schedule[i].second = i;
+    }
+    radix_sort(&schedule, MortonVoxelKey(), 63);
+
+    std::size_t num_skipped = 0;
+    std::size_t max_skipped = 0;
+#pragma omp parallel
+    {
+        Workspace workspace;
+        workspace.samples.reserve(2048);
+        workspace.scales.reserve(2048);
+        std::size_t num_done = 0;
+
+#pragma omp for schedule(dynamic, MORTON_CHUNK_SIZE) \
+    reduction(+:num_skipped) reduction(max:max_skipped)
+        for (std::size_t j = 0; j < schedule.size(); ++j)
+        {
+            std::size_t const i = schedule[j].second;
+            if (!this->is_voxel_pending(i))
+                continue;
+            VoxelIndex index = this->voxels[i].first;
+            math::Vec3d voxel_pos = index.compute_position(
+                this->get_root_node_center(), this->get_root_node_size());
+            std::size_t voxel_skipped = 0;
+            this->voxels[i].second = this->sample_ifn(voxel_pos,
+                &workspace, &voxel_skipped);
+            this->set_voxel_done(i);
+            num_skipped += voxel_skipped;
+            max_skipped = std::max(max_skipped, voxel_skipped);
+
+            num_done += 1;
+            if (num_done == PROGRESS_BATCH_SIZE)
+                this->report_progress(&num_done);
+        }
+        this->report_progress(&num_done);
+    }
+
+    *num_skipped_ptr = num_skipped;
+    *max_skipped_ptr = max_skipped;
+}
+
+/*
+ * State of the task-based brick evaluation. Bricks are in depth-first
+ * order, thus ranges of bricks are subtrees, and the voxels of a range of
+ * bricks form one contiguous range in the brick voxel list.
+ */
+struct IsoOctree::BrickTasks
+{
+    /* Per-thread workspace and statistics. */
+    struct ThreadState
+    {
+        Workspace workspace;
+        std::size_t num_done;
+        std::size_t num_skipped;
+        std::size_t max_skipped;
+    };
+
+    std::vector<Iterator> bricks;
+    std::vector<std::size_t> brick_offsets;
+    std::vector<std::size_t> brick_voxels;
+    /* Prefix sums of the estimated work per brick. */
+    std::vector<uint64_t> work_offsets;
+    /* Ranges with less work are not split further. */
+    uint64_t min_task_work;
+    std::vector<ThreadState> states;
+};
+
+void
+IsoOctree::sample_bricks (std::size_t* num_skipped_ptr,
+    std::size_t* max_skipped_ptr)
+{
+    /*
+     * Collect bricks, i.e. subtrees with few leaves, and assign every voxel
+     * to the first brick that contains it as leaf corner. The voxels are
+     * then grouped by brick using a counting sort.
+     */
+    BrickTasks tasks;
+    std::vector<Iterator>& bricks = tasks.bricks;
+    this->collect_bricks(this->get_iterator_for_root(), &bricks);
+
+    std::vector<uint32_t> voxel_bricks(this->voxels.size(), NO_BRICK);
+    std::vector<std::size_t> brick_samples(bricks.size());
+#pragma omp parallel for schedule(dynamic, 64)
+    for (std::size_t i = 0; i < bricks.size(); ++i)
+        brick_samples[i] = this->assign_brick_voxels(bricks[i],
+            static_cast<uint32_t>(i), &voxel_bricks[0]);
+
+    std::vector<std::size_t>& brick_offsets = tasks.brick_offsets;
+    brick_offsets.resize(bricks.size() + 1, 0);
+    for (std::size_t i = 0; i < voxel_bricks.size(); ++i)
+        brick_offsets[voxel_bricks[i] + 1] += 1;
+    for (std::size_t i = 1; i < brick_offsets.size(); ++i)
+        brick_offsets[i] += brick_offsets[i - 1];
+    tasks.brick_voxels.resize(this->voxels.size());
+    {
+        std::vector<std::size_t> fill(brick_offsets.begin(),
+            brick_offsets.end() - 1);
+        for (std::size_t i = 0; i < voxel_bricks.size(); ++i)
+            tasks.brick_voxels[fill[voxel_bricks[i]]++] = i;
+    }
+    std::vector<uint32_t>().swap(voxel_bricks);
+
+    /*
+     * The work of a brick is estimated as the number of voxels times the
+     * number of samples in the brick subtree (plus one, to account for
+     * samples in parent nodes).
+     */
+    tasks.work_offsets.resize(bricks.size() + 1, 0);
+    for (std::size_t i = 0; i < bricks.size(); ++i)
+        tasks.work_offsets[i + 1] = tasks.work_offsets[i]
+            + (brick_offsets[i + 1] - brick_offsets[i])
+            * static_cast<uint64_t>(brick_samples[i] + 1);
+
+    std::size_t num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+    tasks.min_task_work = tasks.work_offsets.back()
+        / (num_threads * TASKS_PER_THREAD) + 1;
+    tasks.states.resize(num_threads);
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        BrickTasks::ThreadState& state = tasks.states[i];
+        state.workspace.samples.reserve(2048);
+        state.workspace.brick_samples.reserve(2048);
+        state.workspace.scales.reserve(2048);
+        state.num_done = 0;
+        state.num_skipped = 0;
+        state.max_skipped = 0;
+    }
+
+    /* Recursively split the bricks into tasks of similar work. */
+#pragma omp parallel
+#pragma omp single
+    this->sample_brick_tasks(&tasks, 0, bricks.size());
+
+    std::size_t num_skipped = 0;
+    std::size_t max_skipped = 0;
+    for (std::size_t i = 0; i < num_threads; ++i)
+    {
+        BrickTasks::ThreadState& state = tasks.states[i];
+        this->report_progress(&state.num_done);
+        num_skipped += state.num_skipped;
+        max_skipped = std::max(max_skipped, state.max_skipped);
+    }
+
+    *num_skipped_ptr = num_skipped;
+    *max_skipped_ptr = max_skipped;
+}
+
+void
+IsoOctree::sample_brick_tasks (BrickTasks* tasks, std::size_t first,
+    std::size_t last)
+{
+    std::vector<uint64_t> const& work = tasks->work_offsets;
+    if (last - first > 1 && work[last] - work[first] > tasks->min_task_work)
+    {
+        /* Split the range at half of the work. */
+        std::size_t middle = std::upper_bound(work.begin() + first,
+            work.begin() + last, (work[first] + work[last]) / 2)
+            - work.begin() - 1;
+        middle = std::max(first + 1, std::min(last - 1, middle));
+
+#pragma omp task
+        this->sample_brick_tasks(tasks, first, middle);
+#pragma omp task
+        this->sample_brick_tasks(tasks, middle, last);
+        return;
+    }
+
+    std::size_t thread_id = 0;
+#ifdef _OPENMP
+    thread_id = omp_get_thread_num();
+#endif
+    BrickTasks::ThreadState& state = tasks->states[thread_id];
+    for (std::size_t i = first; i < last; ++i)
+    {
+        this->sample_brick(tasks, i, thread_id);
+        if (state.num_done >= PROGRESS_BATCH_SIZE)
+            this->report_progress(&state.num_done);
+    }
+}
+
+void
+IsoOctree::sample_brick (BrickTasks* tasks, std::size_t brick_id,
+    std::size_t thread_id)
+{
+    std::size_t const first = tasks->brick_offsets[brick_id];
+    std::size_t const last = tasks->brick_offsets[brick_id + 1];
+    if (first == last)
+        return;
+
+    /*
+     * Query the samples for the bounding box of the brick once, and
+     * select the samples for the individual voxels from the candidates.
+     * The box query returns the candidates in the same order as the point
+     * query, so the result does not depend on the engine.
+     */
+    BrickTasks::ThreadState* state = &tasks->states[thread_id];
+    Workspace& workspace = state->workspace;
+    std::vector<std::size_t> const& brick_voxels = tasks->brick_voxels;
+    std::size_t num_pending = 0;
+    math::Vec3d aabb_min(std::numeric_limits<double>::max());
+    math::Vec3d aabb_max(-std::numeric_limits<double>::max());
+    for (std::size_t j = first; j < last; ++j)
+    {
+        if (!this->is_voxel_pending(brick_voxels[j]))
+            continue;
+        num_pending += 1;
+        math::Vec3d const voxel_pos = this->voxels[brick_voxels[j]]
+            .first.compute_position(this->get_root_node_center(),
+            this->get_root_node_size());
+        for (int k = 0; k < 3; ++k)
+        {
+            aabb_min[k] = std::min(aabb_min[k], voxel_pos[k]);
+            aabb_max[k] = std::max(aabb_max[k], voxel_pos[k]);
+        }
+    }
+    if (num_pending == 0)
+        return;
+
+    std::vector<Sample const*> const& candidates = workspace.brick_samples;
+    this->influence_query(aabb_min, aabb_max, INFLUENCE_FACTOR,
+        &workspace.brick_samples);
+
+    for (std::size_t j = first; j < last; ++j)
+    {
+        if (!this->is_voxel_pending(brick_voxels[j]))
+            continue;
+        VoxelVector::value_type& voxel = this->voxels[brick_voxels[j]];
+        math::Vec3d const voxel_pos = voxel.first.compute_position(
             this->get_root_node_center(), this->get_root_node_size());
-        this->voxels[i].second = this->sample_ifn(voxel_pos);
 
-#pragma omp critical
+        workspace.samples.resize(0);
+        for (std::size_t k = 0; k < candidates.size(); ++k)
+        {
+            Sample const& s = *candidates[k];
+            if ((voxel_pos - s.pos).square_norm()
+                > MATH_POW2(INFLUENCE_FACTOR * s.scale))
+                continue;
+            workspace.samples.push_back(&s);
+        }
+
+        std::size_t voxel_skipped = 0;
+        voxel.second = this->evaluate_samples(voxel_pos,
+            &workspace, &voxel_skipped);
+        this->set_voxel_done(brick_voxels[j]);
+        state->num_skipped += voxel_skipped;
+        state->max_skipped = std::max(state->max_skipped, voxel_skipped);
+    }
+    state->num_done += num_pending;
+}
+
+void
+IsoOctree::collect_subtrees (Iterator const& iter,
+    std::vector<Iterator>* subtrees) const
+{
+    if (iter.node_path.level >= SUBTREE_LEVEL
+        || iter.node_path.level >= this->max_level || iter.node->is_leaf())
+    {
+        subtrees->push_back(iter);
+        return;
+    }
+
+    for (int i = 0; i < 8; ++i)
+        if (iter.node->has_child(i))
+            this->collect_subtrees(iter.descend(i), subtrees);
+}
+
+std::size_t
+IsoOctree::collect_bricks (Iterator const& iter,
+    std::vector<Iterator>* bricks) const
+{
+    /* Leafs are counted but only become bricks as part of a subtree. */
+    if (iter.node_path.level >= this->max_level || iter.node->is_leaf())
+    {
+        if (iter.node_path.level == 0)
+            bricks->push_back(iter);
+        return 1;
+    }
+
+    std::size_t num_leaves[8];
+    std::size_t total_leaves = 0;
+    for (int i = 0; i < 8; ++i)
+    {
+        num_leaves[i] = 0;
+        if (!iter.node->has_child(i))
+            continue;
+        num_leaves[i] = this->collect_bricks(iter.descend(i), bricks);
+        total_leaves += num_leaves[i];
+    }
+
+    /*
+     * If this subtree is too large for a brick, the children that are
+     * small enough become bricks. Larger children have already emitted
+     * their own bricks.
+     */
+    if (total_leaves > BRICK_MAX_LEAVES)
+    {
+        for (int i = 0; i < 8; ++i)
+            if (num_leaves[i] > 0 && num_leaves[i] <= BRICK_MAX_LEAVES)
+                bricks->push_back(iter.descend(i));
+    }
+    else if (iter.node_path.level == 0)
+        bricks->push_back(iter);
+
+    return total_leaves;
+}
+
+std::size_t
+IsoOctree::assign_brick_voxels (Iterator const& iter, uint32_t brick_id,
+    uint32_t* voxel_bricks) const
+{
+    std::size_t num_samples = iter.node->num_samples;
+    if (iter.node_path.level < this->max_level && !iter.node->is_leaf())
+    {
+        for (int i = 0; i < 8; ++i)
+            if (iter.node->has_child(i))
+                num_samples += this->assign_brick_voxels(iter.descend(i),
+                    brick_id, voxel_bricks);
+        return num_samples;
+    }
+
+    /* The voxel is assigned to the brick with the smallest ID. */
+    for (int i = 0; i < 8; ++i)
+    {
+        VoxelIndex index;
+        index.from_path_and_corner(iter.node_path, i);
+        std::size_t const voxel_id = std::lower_bound(this->voxels.begin(),
+            this->voxels.end(), index, VoxelIndexCompare())
+            - this->voxels.begin();
+
+        uint32_t* ptr = voxel_bricks + voxel_id;
+        uint32_t current = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+        while (brick_id < current && !__atomic_compare_exchange_n(ptr,
+            &current, brick_id, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            continue;
+    }
+
+    return num_samples;
+}
+
+void
+IsoOctree::sample_scatter (std::size_t* num_skipped_ptr,
+    std::size_t* max_skipped_ptr)
+{
+    std::vector<Sample> const& samples = this->get_samples();
+    std::size_t const num_voxels = this->voxels.size();
+
+    /* Collect all nodes with samples. Samples are packed at this point. */
+    std::vector<Node const*> nodes;
+    {
+        std::vector<Node const*> stack;
+        if (this->get_root_node() != NULL)
+            stack.push_back(this->get_root_node());
+        while (!stack.empty())
+        {
+            Node const* node = stack.back();
+            stack.pop_back();
+            if (node->num_samples > 0)
+                nodes.push_back(node);
+            for (int i = 0; i < 8; ++i)
+                if (node->has_child(i))
+                    stack.push_back(this->get_child(node, i));
+        }
+    }
+
+    /*
+     * Count the samples that influence every voxel, and remember the range
+     * of voxels influenced by every sample. The counts determine the
+     * layout of the sample references per voxel. The influenced voxels
+     * of the nodes are kept as long as they fit into the cache budget,
+     * the scatter passes query the influenced voxels of the other nodes
+     * again.
+     */
+    std::vector<uint32_t> voxel_counts(num_voxels, 0);
+    std::vector<std::pair<std::size_t, std::size_t> > sample_ranges
+        (samples.size(), std::make_pair(num_voxels, std::size_t(0)));
+    std::vector<NodeVoxels> node_voxels(nodes.size());
+    std::size_t num_cached = 0;
+#pragma omp parallel
+    {
+        Workspace workspace;
+        NodeVoxels node_cache;
+#pragma omp for schedule(dynamic, 16)
+        for (std::size_t i = 0; i < nodes.size(); ++i)
+        {
+            Node const* node = nodes[i];
+            node_cache.offsets.resize(1, 0);
+            node_cache.voxel_ids.resize(0);
+            for (uint32_t j = 0; j < node->num_samples; ++j)
+            {
+                std::size_t const sample_id = node->first_sample + j;
+                this->influenced_voxels(samples[sample_id], &workspace);
+                std::vector<std::size_t> const& ids = workspace.voxel_ids;
+                node_cache.voxel_ids.insert(node_cache.voxel_ids.end(),
+                    ids.begin(), ids.end());
+                node_cache.offsets.push_back(node_cache.voxel_ids.size());
+                if (ids.empty())
+                    continue;
+                for (std::size_t k = 0; k < ids.size(); ++k)
+                    __atomic_fetch_add(&voxel_counts[ids[k]], 1,
+                        __ATOMIC_RELAXED);
+                sample_ranges[sample_id].first = ids.front();
+                sample_ranges[sample_id].second = ids.back() + 1;
+            }
+
+            std::size_t const size = node_cache.voxel_ids.size();
+            if (size == 0)
+                continue;
+            if (__atomic_add_fetch(&num_cached, size, __ATOMIC_RELAXED)
+                > SCATTER_MAX_CACHED)
+            {
+                __atomic_sub_fetch(&num_cached, size, __ATOMIC_RELAXED);
+                continue;
+            }
+            node_voxels[i].offsets = node_cache.offsets;
+            node_voxels[i].voxel_ids = node_cache.voxel_ids;
+        }
+    }
+
+    /*
+     * Scatter the sample references to the voxels in passes over ranges
+     * of voxels to limit memory consumption. The references of a voxel
+     * are sorted by sample index, which restores the order of the
+     * influence query, and the voxel is evaluated from the references.
+     */
+    std::size_t num_skipped = 0;
+    std::size_t max_skipped = 0;
+    std::vector<std::size_t> offsets;
+    std::vector<uint32_t> references;
+    for (std::size_t first = 0; first < num_voxels;)
+    {
+        std::size_t last = first;
+        offsets.clear();
+        offsets.push_back(0);
+        while (last < num_voxels && (last == first || offsets.back()
+            + voxel_counts[last] <= SCATTER_MAX_REFERENCES))
         {
-            num_processed += 1;
-            this->print_progress(num_processed, this->voxels.size());
+            offsets.push_back(offsets.back() + voxel_counts[last]);
+            last += 1;
         }
+        references.resize(offsets.back());
+        std::vector<std::size_t> cursors(offsets.begin(), offsets.end() - 1);
+
+#pragma omp parallel
+        {
+            Workspace workspace;
+#pragma omp for schedule(dynamic, 16)
+            for (std::size_t i = 0; i < nodes.size(); ++i)
+            {
+                Node const* node = nodes[i];
+                NodeVoxels const& cache = node_voxels[i];
+                for (uint32_t j = 0; j < node->num_samples; ++j)
+                {
+                    uint32_t const sample_id = node->first_sample + j;
+                    if (sample_ranges[sample_id].first >= last
+                        || sample_ranges[sample_id].second <= first)
+                        continue;
+
+                    /* Samples in the range influence at least one voxel. */
+                    std::size_t const* ids_begin;
+                    std::size_t const* ids_end;
+                    if (!cache.voxel_ids.empty())
+                    {
+                        ids_begin = &cache.voxel_ids[0] + cache.offsets[j];
+                        ids_end = &cache.voxel_ids[0] + cache.offsets[j + 1];
+                    }
+                    else
+                    {
+                        this->influenced_voxels(samples[sample_id],
+                            &workspace);
+                        ids_begin = &workspace.voxel_ids[0];
+                        ids_end = ids_begin + workspace.voxel_ids.size();
+                    }
+
+                    for (std::size_t const* id = ids_begin;
+                        id != ids_end; ++id)
+                    {
+                        if (*id < first || *id >= last)
+                            continue;
+                        std::size_t const pos = __atomic_fetch_add(
+                            &cursors[*id - first], 1, __ATOMIC_RELAXED);
+                        references[pos] = sample_id;
+                    }
+                }
+            }
+
+            workspace.samples.reserve(2048);
+            workspace.scales.reserve(2048);
+            std::size_t num_done = 0;
+#pragma omp for schedule(dynamic, 64) \
+    reduction(+:num_skipped) reduction(max:max_skipped)
+            for (std::size_t i = first; i < last; ++i)
+            {
+                if (!this->is_voxel_pending(i))
+                    continue;
+                uint32_t* refs_begin = &references[0] + offsets[i - first];
+                uint32_t* refs_end = &references[0] + offsets[i - first + 1];
+                std::sort(refs_begin, refs_end);
+                workspace.samples.resize(0);
+                for (uint32_t* ref = refs_begin; ref != refs_end; ++ref)
+                    workspace.samples.push_back(&samples[*ref]);
+
+                VoxelVector::value_type& voxel = this->voxels[i];
+                math::Vec3d const voxel_pos = voxel.first.compute_position(
+                    this->get_root_node_center(), this->get_root_node_size());
+                std::size_t voxel_skipped = 0;
+                voxel.second = this->evaluate_samples(voxel_pos,
+                    &workspace, &voxel_skipped);
+                this->set_voxel_done(i);
+                num_skipped += voxel_skipped;
+                max_skipped = std::max(max_skipped, voxel_skipped);
+
+                num_done += 1;
+                if (num_done == PROGRESS_BATCH_SIZE)
+                    this->report_progress(&num_done);
+            }
+            this->report_progress(&num_done);
+        }
+
+        first = last;
     }
 
-    /* Print progress one last time to get the 100% progress output. */
-    this->print_progress(this->voxels.size(), this->voxels.size());
-    std::cout << std::endl;
+    *num_skipped_ptr = num_skipped;
+    *max_skipped_ptr = max_skipped;
+}
+
+void
+IsoOctree::influenced_voxels (Sample const& sample, Workspace* workspace)
+{
+    /*
+     * The voxels are the corners of the influenced leafs, or of their
+     * ancestors at the maximum level. Only voxels within the influence
+     * distance of the sample are reported, sorted and without duplicates.
+     */
+    this->influenced_query(sample, INFLUENCE_FACTOR, &workspace->nodes);
+    std::vector<std::size_t>& ids = workspace->voxel_ids;
+    ids.resize(0);
+    for (std::size_t i = 0; i < workspace->nodes.size(); ++i)
+    {
+        NodePath path = workspace->nodes[i].node_path;
+        if (path.level > this->max_level)
+        {
+            path.path = path.path >> (3 * (path.level - this->max_level));
+            path.level = this->max_level;
+        }
+
+        for (int j = 0; j < 8; ++j)
+        {
+            VoxelIndex index;
+            index.from_path_and_corner(path, j);
+            math::Vec3d const voxel_pos = index.compute_position(
+                this->get_root_node_center(), this->get_root_node_size());
+            if ((voxel_pos - sample.pos).square_norm()
+                > MATH_POW2(INFLUENCE_FACTOR * sample.scale))
+                continue;
+            ids.push_back(std::lower_bound(this->voxels.begin(),
+                this->voxels.end(), index, VoxelIndexCompare())
+                - this->voxels.begin());
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
 }
 
 VoxelData
-IsoOctree::sample_ifn (math::Vec3d const& voxel_pos)
+IsoOctree::sample_ifn (math::Vec3d const& voxel_pos,
+    Workspace* workspace, std::size_t* num_skipped)
 {
     /* Query samples that influence the voxel. */
-    std::vector<Sample const*> samples;
-    samples.reserve(2048);
-    this->influence_query(voxel_pos, 3.0, &samples);
+    this->influence_query(voxel_pos, INFLUENCE_FACTOR, &workspace->samples);
+    return this->evaluate_samples(voxel_pos, workspace, num_skipped);
+}
+
+VoxelData
+IsoOctree::evaluate_samples (math::Vec3d const& voxel_pos,
+    Workspace* workspace, std::size_t* num_skipped)
+{
+    *num_skipped = 0;
 
+    std::vector<Sample const*>& samples = workspace->samples;
     if (samples.empty())
         return VoxelData();
 
     /*
      * Handling of scale: Sort the samples according to scale, high-res
      * samples first. If the confidence of the voxel is high enough, no
-     * more samples are necessary.
+     * more samples are necessary. The scales are selected in a separate
+     * array, which avoids dereferencing the samples during nth_element.
      */
+    std::vector<float>& scales = workspace->scales;
+    scales.resize(samples.size());
+    for (std::size_t i = 0; i < samples.size(); ++i)
+        scales[i] = samples[i]->scale;
     std::size_t num_samples = samples.size() / 10;
-    std::nth_element(samples.begin(), samples.begin() + num_samples,
-        samples.end(), sample_scale_compare);
-    float const sample_max_scale = samples[num_samples]->scale * 2.0f;
+    std::nth_element(scales.begin(), scales.begin() + num_samples,
+        scales.end());
+    float const sample_max_scale = scales[num_samples] * 2.0f;
     //float const sample_max_scale = std::numeric_limits<float>::max();
 
-    /* Evaluate implicit function as the sum of basis functions. */
-    double total_ifn = 0.0;
-    double total_weight = 0.0;
-    double total_scale = 0.0f;
-    math::Vec3d total_color(0.0f);
-    double total_color_weight = 0.0;
+    /*
+     * Evaluate implicit function as the sum of basis functions. The basis
+     * function is the Gaussian derivative, weighted with the weighting
+     * function, see basis_kernel.h. The samples are copied to a structure
+     * of arrays and evaluated with a vectorized kernel.
+     */
+    SampleBatch& batch = workspace->batch;
+    batch.clear();
+    BasisSums sums;
+    if (this->saturation_threshold <= 0.0f)
+    {
+        for (std::size_t i = 0; i < samples.size(); ++i)
+            if (samples[i]->scale <= sample_max_scale)
+                batch.add_sample(*samples[i], voxel_pos);
+        evaluate_basis_functions(&batch, &sums);
+    }
+    else
+    {
+        /*
+         * Early termination: Evaluate the samples finest scale first in
+         * chunks of a few vector widths, and stop once the voxel has
+         * accumulated enough confidence.
+         */
+        std::size_t num_candidates = 0;
+        for (std::size_t i = 0; i < samples.size(); ++i)
+            if (samples[i]->scale <= sample_max_scale)
+                samples[num_candidates++] = samples[i];
+        std::sort(samples.begin(), samples.begin() + num_candidates,
+            sample_scale_compare);
 
-    for (std::size_t i = 0; i < samples.size(); ++i)
+        std::size_t const chunk_size = 4 * SampleBatch::PADDING;
+        std::size_t num_evaluated = 0;
+        while (num_evaluated < num_candidates
+            && sums.weight < this->saturation_threshold)
+        {
+            std::size_t const chunk_end = std::min(num_candidates,
+                num_evaluated + chunk_size);
+            batch.clear();
+            for (std::size_t i = num_evaluated; i < chunk_end; ++i)
+                batch.add_sample(*samples[i], voxel_pos);
+            evaluate_basis_functions(&batch, &sums);
+            num_evaluated = chunk_end;
+        }
+        *num_skipped = num_candidates - num_evaluated;
+    }
+
+    /* Store voxel in the map. */
+    VoxelData data;
+    data.value = sums.ifn / sums.weight;
+    data.conf = sums.weight;
+    data.scale = sums.scale / sums.color_weight;
+    data.color = sums.color / sums.color_weight;
+    return data;
+}
+
+void
+IsoOctree::report_progress (std::size_t* num_done)
+{
+    std::size_t const voxels_done = __atomic_add_fetch(
+        &this->num_voxels_done, *num_done, __ATOMIC_RELAXED);
+    *num_done = 0;
+
+    /* Only the master thread reports the progress. */
+#ifdef _OPENMP
+    if (omp_get_thread_num() != 0)
+        return;
+#endif
+    this->progress->on_progress(voxels_done, this->voxels.size());
+
+    if (!this->checkpoint_filename.empty()
+        && this->checkpoint_timer.get_elapsed() >= this->checkpoint_interval)
     {
-        Sample const& sample = *samples[i];
-        if (sample.scale > sample_max_scale)
+        this->write_checkpoint();
+        this->checkpoint_timer.reset();
+    }
+}
+
+void
+IsoOctree::begin_update (void)
+{
+    /* Voxel indices of a different root refer to different positions. */
+    if (this->previous_root_center != this->get_root_node_center()
+        || this->previous_root_size != this->get_root_node_size())
+    {
+        std::cout << "Octree root changed, reusing none of "
+            << this->voxels.size() << " voxels." << std::endl;
+        return;
+    }
+
+    if (this->voxel_states.empty())
+        this->voxel_states.resize(this->voxels.size(), VOXEL_PENDING);
+
+    /* Mark the voxels influenced by the new samples. */
+    std::vector<uint8_t> affected(this->voxels.size(), 0);
+#pragma omp parallel
+    {
+        Workspace workspace;
+#pragma omp for schedule(dynamic, 64)
+        for (std::size_t i = 0; i < this->update_samples.size(); ++i)
+        {
+            this->influenced_voxels(this->update_samples[i], &workspace);
+            std::vector<std::size_t> const& ids = workspace.voxel_ids;
+            for (std::size_t j = 0; j < ids.size(); ++j)
+                __atomic_store_n(&affected[ids[j]], 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    /*
+     * Reuse the previous data of all voxels that are not influenced by
+     * the new samples. Voxels of new leafs are not in the previous voxels.
+     * Both voxel lists are sorted, and are merged in one pass.
+     */
+    std::size_t num_reused = 0;
+    std::size_t num_affected = 0;
+    VoxelVector::const_iterator prev = this->previous_voxels.begin();
+    for (std::size_t i = 0; i < this->voxels.size(); ++i)
+    {
+        num_affected += affected[i];
+        while (prev != this->previous_voxels.end()
+            && prev->first < this->voxels[i].first)
+            ++prev;
+        if (prev == this->previous_voxels.end()
+            || prev->first.index != this->voxels[i].first.index
+            || affected[i] || this->voxel_states[i] != VOXEL_PENDING)
             continue;
+        this->voxels[i].second = prev->second;
+        this->voxel_states[i] = VOXEL_REUSED;
+        num_reused += 1;
+    }
+    this->num_voxels_done += num_reused;
+    this->num_reused_voxels = num_reused;
 
-        math::Vec3f const tpos = transform_position(voxel_pos, sample);
+    std::cout << "Reusing " << num_reused << " of " << this->voxels.size()
+        << " voxels, " << num_affected << " voxels are influenced by "
+        << this->update_samples.size() << " new samples." << std::endl;
+}
 
-        /* Evaluate basis fucntion. */
-        double const value = gaussian_derivative(sample.scale, tpos);
-        //double const value = linear_ramp(sample, voxel_pos);
+#define FSSR_CHECKPOINT_FILE_ID "FSSR_CHECKPOINT\n"
 
-        /* Evaluate weight function. */
-        double const weight = weighting_function(sample.scale, tpos) * sample.confidence;
-        //double const weight = weighting_function_mpu(sample.scale, tpos) * sample.confidence;
+void
+IsoOctree::begin_checkpoint (void)
+{
+    this->voxel_states.clear();
+    this->voxel_states.resize(this->voxels.size(), VOXEL_PENDING);
+    this->checkpoint_timer.reset();
+    this->checkpoint_error.clear();
 
-        /* Incrementally update. */
-        total_ifn += value * weight;
-        total_weight += weight;
+    /* Voxels depend on the saturation threshold, which is stored exactly. */
+    std::ostringstream hierarchy;
+    this->write_hierarchy(hierarchy);
+    std::ostringstream threshold;
+    threshold << std::setprecision(9) << this->saturation_threshold;
+    std::string const header = FSSR_CHECKPOINT_FILE_ID
+        + util::string::get(hierarchy.str().size()) + "\n"
+        + hierarchy.str() + "\n"
+        + util::string::get(this->voxels.size()) + "\n"
+        + threshold.str() + "\n";
 
-        double const color_weight = gaussian_normalized(sample.scale / 5.0f, tpos) * sample.confidence;
-        total_scale += sample.scale * color_weight;
-        total_color += sample.color * color_weight;
-        total_color_weight += color_weight;
+    /*
+     * Resume from an existing checkpoint only if it was written for the
+     * same octree hierarchy and saturation threshold. Voxels are appended
+     * as records, and a record that was not completely written is ignored.
+     */
+    if (this->checkpoint_resume)
+    {
+        std::ifstream in(this->checkpoint_filename.c_str(),
+            std::ios::binary);
+        std::string file_header(header.size(), '\0');
+        if (in.read(&file_header[0], file_header.size())
+            && file_header == header)
+        {
+            std::size_t num_resumed = 0;
+            VoxelIndex index;
+            VoxelData data;
+            while (read_voxel(in, &index, &data))
+            {
+                VoxelVector::iterator iter = std::lower_bound(
+                    this->voxels.begin(), this->voxels.end(), index,
+                    VoxelIndexCompare());
+                if (iter == this->voxels.end() || iter->first.index
+                    != index.index)
+                    throw std::runtime_error("Invalid checkpoint voxel");
+                std::size_t const voxel_id = iter - this->voxels.begin();
+                if (this->voxel_states[voxel_id] != VOXEL_PENDING)
+                    continue;
+                iter->second = data;
+                this->voxel_states[voxel_id] = VOXEL_CHECKPOINTED;
+                num_resumed += 1;
+            }
+            in.close();
+
+            /* Drop a partial record at the end of the file. */
+            this->num_voxels_done = num_resumed;
+            this->write_checkpoint_file(header);
+            std::cout << "Resumed " << num_resumed << " of "
+                << this->voxels.size() << " voxels from checkpoint."
+                << std::endl;
+            return;
+        }
+        std::cout << "Checkpoint does not match the octree or settings, "
+            << "starting over." << std::endl;
     }
 
-    /* Store voxel in the map. */
-    VoxelData data;
-    data.value = total_ifn / total_weight;
-    data.conf = total_weight;
-    data.scale = total_scale / total_color_weight;
-    data.color = total_color / total_color_weight;
-    return data;
+    this->write_checkpoint_file(header);
+}
+
+void
+IsoOctree::write_checkpoint_file (std::string const& header)
+{
+    std::ofstream out(this->checkpoint_filename.c_str(), std::ios::binary);
+    if (!out)
+        throw std::runtime_error(::strerror(errno));
+    out << header;
+    for (std::size_t i = 0; i < this->voxels.size(); ++i)
+        if (this->voxel_states[i] == VOXEL_CHECKPOINTED)
+            write_voxel(out, this->voxels[i].first, this->voxels[i].second);
+    out.close();
+    if (!out)
+        throw std::runtime_error("Error writing checkpoint");
 }
 
 void
-IsoOctree::print_progress (std::size_t voxels_done, std::size_t voxels_total)
+IsoOctree::write_checkpoint (void)
 {
-    static std::size_t last_voxels_done = 0;
-    static util::WallTimer timer;
-    static unsigned int last_elapsed = 0;
+    /*
+     * This is called within the sampling parallel regions and must not
+     * throw. The first error is kept and raised after sampling, and no
+     * further checkpoints are written.
+     */
+    if (!this->checkpoint_error.empty())
+        return;
+
+    /* Append all voxels that have been evaluated since the last time. */
+    std::ofstream out(this->checkpoint_filename.c_str(),
+        std::ios::binary | std::ios::app);
+    if (!out)
+    {
+        this->checkpoint_error = ::strerror(errno);
+        return;
+    }
+    std::vector<std::size_t> written;
+    for (std::size_t i = 0; i < this->voxels.size(); ++i)
+    {
+        if (__atomic_load_n(&this->voxel_states[i], __ATOMIC_ACQUIRE)
+            != VOXEL_DONE)
+            continue;
+        write_voxel(out, this->voxels[i].first, this->voxels[i].second);
+        written.push_back(i);
+    }
+    out.close();
+    if (!out)
+    {
+        this->checkpoint_error = "Error writing checkpoint";
+        return;
+    }
+
+    /* Voxels are only checkpointed once they are on disk. */
+    for (std::size_t i = 0; i < written.size(); ++i)
+        this->voxel_states[written[i]] = VOXEL_CHECKPOINTED;
+}
 
+/* ---------------------------------------------------------------- */
+
+SamplingProgress::~SamplingProgress (void)
+{
+}
+
+ConsoleProgress::ConsoleProgress (void)
+    : last_voxels_done(0)
+    , last_elapsed(0)
+    , finished(false)
+{
+}
+
+void
+ConsoleProgress::on_progress (std::size_t voxels_done,
+    std::size_t voxels_total)
+{
     /* Make sure we don't call timer.get_elapsed() too often. */
-    if (voxels_done != voxels_total && voxels_done - last_voxels_done < 1000)
+    if (this->finished)
+        return;
+    if (voxels_done != voxels_total
+        && voxels_done - this->last_voxels_done < 1000)
         return;
-    last_voxels_done = voxels_done;
+    this->last_voxels_done = voxels_done;
 
     /* Make sure we don't print the progress too often, every 100ms. */
-    unsigned int elapsed = timer.get_elapsed();
-    if (voxels_done != voxels_total && elapsed - last_elapsed < 100)
+    unsigned int elapsed = this->timer.get_elapsed();
+    if (voxels_done != voxels_total && elapsed - this->last_elapsed < 100)
         return;
-    last_elapsed = elapsed;
+    this->last_elapsed = elapsed;
 
     /* Compute percentage and nice elapsed and ETA strings. */
     unsigned int elapsed_mins = elapsed / (1000 * 60);
@@ -199,6 +1342,12 @@ IsoOctree::print_progress (std::size_t voxels_done, std::size_t voxels_total)
         << remaining_mins << ":"
         << util::string::get_filled(remaining_secs, 2, '0') << ")..."
         << std::flush;
+
+    if (voxels_done == voxels_total)
+    {
+        std::cout << std::endl;
+        this->finished = true;
+    }
 }
 
 #define FSSR_OCTREE_FILE_ID "FSSR_OCTREE\n"
@@ -210,37 +1359,338 @@ IsoOctree::write_to_file (std::string const& filename) const
     if (!out)
         throw std::runtime_error(::strerror(errno));
 
-    /* Write file identifier. */
-    out << FSSR_OCTREE_FILE_ID;
+    /* The header is written again once the section offsets are known. */
+    OctreeFileHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.file_id, FSSR_OCTREE_CONTAINER_ID,
+        sizeof(header.file_id));
+    header.version = FSSR_OCTREE_CONTAINER_VERSION;
+    header.header_size = sizeof(header);
+    header.num_voxels = this->voxels.size();
+    header.tile_level = this->tile_level;
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
 
-    /* Write the octree hierarchy. */
-    this->write_hierarchy(out);
+    /* Order the voxels by tile, and by index within the tiles. */
+    std::vector<std::pair<uint64_t, std::size_t> > order;
+    order.resize(this->voxels.size());
+#pragma omp parallel for schedule(static)
+    for (std::size_t i = 0; i < this->voxels.size(); ++i)
+        order[i] = std::make_pair(get_tile_key(this->voxels[i].first,
+            this->tile_level), i);
+    if (this->tile_level > 0)
+        radix_sort(&order, TileKey(), 3 * this->tile_level);
 
-    /* Write header: Number of voxels. */
-    out << "\n" << this->voxels.size() << "\n";
+    /* Write the octree hierarchy down to the tile level. */
+    write_padding(out);
+    header.hierarchy_offset = out.tellp();
+    this->write_hierarchy(out, true, this->tile_level);
+    header.hierarchy_size = static_cast<std::size_t>(out.tellp())
+        - header.hierarchy_offset;
 
-    /* Write all voxels. */
-    for (std::size_t i = 0; i < this->voxels.size(); ++i)
+    /*
+     * Tiles are formed by the voxels and by the nodes on the tile level.
+     * The hierarchies of the tile nodes follow the top hierarchy.
+     */
+    std::vector<uint64_t> node_keys;
+    this->collect_tile_nodes(this->get_iterator_for_root(), &node_keys);
+    std::vector<OctreeFileTile> tiles;
+    for (std::size_t v = 0, n = 0;
+        v < order.size() || n < node_keys.size();)
     {
-        VoxelIndex const& index = this->voxels[i].first;
-        VoxelData const& data = this->voxels[i].second;
-        out.write(reinterpret_cast<char const*>(&index.index),
-            sizeof(index.index));
-        out.write(reinterpret_cast<char const*>(&data.value),
-            sizeof(data.value));
-        out.write(reinterpret_cast<char const*>(&data.conf),
-            sizeof(data.conf));
-        out.write(reinterpret_cast<char const*>(&data.scale),
-            sizeof(data.scale));
-        out.write(reinterpret_cast<char const*>(*data.color),
-            3 * sizeof(float));
+        OctreeFileTile tile;
+        std::memset(&tile, 0, sizeof(tile));
+        tile.key = std::numeric_limits<uint64_t>::max();
+        if (v < order.size())
+            tile.key = order[v].first;
+        if (n < node_keys.size())
+            tile.key = std::min(tile.key, node_keys[n]);
+
+        tile.first_voxel = v;
+        while (v < order.size() && order[v].first == tile.key)
+            v += 1;
+        tile.num_voxels = v - tile.first_voxel;
+
+        if (n < node_keys.size() && node_keys[n] == tile.key)
+        {
+            NodePath path;
+            path.path = tile.key;
+            path.level = this->tile_level;
+            tile.hierarchy_offset = out.tellp();
+            this->write_subtree_hierarchy(out, path);
+            tile.hierarchy_size = static_cast<std::size_t>(out.tellp())
+                - tile.hierarchy_offset;
+            n += 1;
+        }
+        tiles.push_back(tile);
     }
+
+    /*
+     * Write the voxels as compressed blocks, or the voxel indices and the
+     * voxel data as separate arrays.
+     */
+    write_padding(out);
+    if (this->compression_level > 0)
+        this->write_voxel_blocks(out, order, &tiles, &header);
+    else
+    {
+        header.index_offset = out.tellp();
+        std::vector<VoxelIndex> indices;
+        indices.reserve(VOXEL_WRITE_BLOCK_SIZE);
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            indices.push_back(this->voxels[order[i].second].first);
+            if (indices.size() < VOXEL_WRITE_BLOCK_SIZE
+                && i + 1 < order.size())
+                continue;
+            out.write(reinterpret_cast<char const*>(&indices[0]),
+                indices.size() * sizeof(VoxelIndex));
+            indices.clear();
+        }
+
+        write_padding(out);
+        header.data_offset = out.tellp();
+        std::vector<VoxelData> data;
+        data.reserve(VOXEL_WRITE_BLOCK_SIZE);
+        for (std::size_t i = 0; i < order.size(); ++i)
+        {
+            data.push_back(this->voxels[order[i].second].second);
+            if (data.size() < VOXEL_WRITE_BLOCK_SIZE
+                && i + 1 < order.size())
+                continue;
+            out.write(reinterpret_cast<char const*>(&data[0]),
+                data.size() * sizeof(VoxelData));
+            data.clear();
+        }
+    }
+
+    /* Write the tile table. */
+    write_padding(out);
+    header.num_tiles = tiles.size();
+    header.tile_table_offset = out.tellp();
+    if (!tiles.empty())
+        out.write(reinterpret_cast<char const*>(&tiles[0]),
+            tiles.size() * sizeof(OctreeFileTile));
+
+    out.seekp(0);
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
     out.close();
+    if (!out)
+        throw std::runtime_error("Error writing octree file");
+}
+
+void
+IsoOctree::collect_tile_nodes (Iterator const& iter,
+    std::vector<uint64_t>* keys) const
+{
+    if (iter.node == NULL)
+        return;
+    if (iter.node_path.level == this->tile_level)
+    {
+        keys->push_back(iter.node_path.path);
+        return;
+    }
+    for (int i = 0; i < 8; ++i)
+        if (iter.node->has_child(i))
+            this->collect_tile_nodes(iter.descend(i), keys);
+}
+
+void
+IsoOctree::write_voxel_blocks (std::ostream& out,
+    std::vector<std::pair<uint64_t, std::size_t> > const& order,
+    std::vector<OctreeFileTile>* tiles, OctreeFileHeader* header) const
+{
+    /* Blocks do not span tiles, such that tiles can be decoded alone. */
+    std::size_t const block_size = FSSR_OCTREE_CONTAINER_BLOCK_SIZE;
+    std::vector<std::size_t> block_begins;
+    for (std::size_t i = 0; i < tiles->size(); ++i)
+    {
+        OctreeFileTile& tile = tiles->at(i);
+        tile.first_block = block_begins.size();
+        for (std::size_t j = 0; j < tile.num_voxels; j += block_size)
+            block_begins.push_back(tile.first_voxel + j);
+        tile.num_blocks = block_begins.size() - tile.first_block;
+    }
+    block_begins.push_back(order.size());
+
+    std::size_t const num_blocks = block_begins.size() - 1;
+    header->encoding = OCTREE_ENCODING_BLOCKS;
+    header->block_size = block_size;
+    header->num_blocks = num_blocks;
+
+    /* The block table is written again once the offsets are known. */
+    std::vector<uint64_t> table(num_blocks + 1, 0);
+    header->block_table_offset = out.tellp();
+    out.write(reinterpret_cast<char const*>(&table[0]),
+        table.size() * sizeof(uint64_t));
+
+    /* Blocks are encoded in parallel in batches and written in order. */
+    std::size_t batch_size = 4;
+#ifdef _OPENMP
+    batch_size *= omp_get_max_threads();
+#endif
+    std::vector<std::vector<char> > buffers(batch_size);
+    std::string error;
+    for (std::size_t first = 0; first < num_blocks; first += batch_size)
+    {
+        std::size_t const last = std::min(num_blocks, first + batch_size);
+#pragma omp parallel
+        {
+            std::vector<VoxelIndex> indices;
+            std::vector<VoxelData> data;
+#pragma omp for schedule(dynamic)
+            for (std::size_t i = first; i < last; ++i)
+            {
+                indices.clear();
+                data.clear();
+                for (std::size_t j = block_begins[i];
+                    j < block_begins[i + 1]; ++j)
+                {
+                    std::size_t const voxel_id = order[j].second;
+                    indices.push_back(this->voxels[voxel_id].first);
+                    data.push_back(this->voxels[voxel_id].second);
+                }
+                try
+                {
+                    encode_voxel_block(&indices[0], &data[0],
+                        indices.size(), this->compression_level,
+                        &buffers[i - first]);
+                }
+                catch (std::exception& e)
+                {
+#pragma omp critical
+                    if (error.empty())
+                        error = e.what();
+                }
+            }
+        }
+        if (!error.empty())
+            throw std::runtime_error(error);
+
+        for (std::size_t i = first; i < last; ++i)
+        {
+            table[i] = out.tellp();
+            out.write(&buffers[i - first][0], buffers[i - first].size());
+        }
+    }
+    table[num_blocks] = out.tellp();
+
+    out.seekp(header->block_table_offset);
+    out.write(reinterpret_cast<char const*>(&table[0]),
+        table.size() * sizeof(uint64_t));
+    out.seekp(0, std::ios::end);
+}
+
+void
+IsoOctree::read_tiles (MappedOctreeFile const& file,
+    std::vector<std::size_t> const& tiles)
+{
+    /*
+     * Offsets of the voxels of the tiles. The voxels are sorted within
+     * tiles, but not across tiles. With several tiles, the voxels are
+     * decoded to a temporary vector and merged.
+     */
+    std::vector<std::size_t> offsets(tiles.size() + 1, 0);
+    for (std::size_t i = 0; i < tiles.size(); ++i)
+        offsets[i + 1] = offsets[i] + file.get_tile(tiles[i]).num_voxels;
+    VoxelVector tile_voxels;
+    VoxelVector& decoded = tiles.size() > 1 ? tile_voxels : this->voxels;
+    this->voxels.clear();
+    decoded.resize(offsets.back());
+
+    /* Tiles are decoded in parallel, the first error is kept. */
+    std::string error;
+#pragma omp parallel
+    {
+        std::vector<VoxelIndex> indices;
+        std::vector<VoxelData> data;
+#pragma omp for schedule(dynamic)
+        for (std::size_t i = 0; i < tiles.size(); ++i)
+        {
+            std::size_t const num_voxels = offsets[i + 1] - offsets[i];
+            if (num_voxels == 0)
+                continue;
+            indices.resize(num_voxels);
+            data.resize(num_voxels);
+            try
+            {
+                file.decode_tile(tiles[i], &indices[0], &data[0]);
+            }
+            catch (std::exception& e)
+            {
+#pragma omp critical
+                if (error.empty())
+                    error = e.what();
+                continue;
+            }
+            for (std::size_t j = 0; j < num_voxels; ++j)
+            {
+                decoded[offsets[i] + j].first = indices[j];
+                decoded[offsets[i] + j].second = data[j];
+            }
+        }
+    }
+    if (!error.empty())
+        throw std::runtime_error(error);
+
+    if (tiles.size() > 1)
+        merge_voxel_runs(tile_voxels, offsets, &this->voxels);
+}
+
+void
+IsoOctree::read_from_file (std::string const& filename,
+    math::Vec3d const& aabb_min, math::Vec3d const& aabb_max)
+{
+    if (!MappedOctreeFile::is_container(filename))
+    {
+        this->read_from_file(filename);
+        return;
+    }
+
+    MappedOctreeFile file;
+    file.map(filename);
+    file.read_top_hierarchy(this);
+    std::vector<std::size_t> tiles;
+    file.find_tiles(*this, aabb_min, aabb_max, 0, &tiles);
+    std::vector<uint64_t> keys;
+    for (std::size_t i = 0; i < tiles.size(); ++i)
+    {
+        file.read_tile_hierarchy(tiles[i], this);
+        keys.push_back(file.get_tile(tiles[i]).key);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    /*
+     * The voxels on the upper faces of the region belong to the adjacent
+     * tiles. These tiles are read as well, but only the voxels at the
+     * corners of the region tiles are kept. Leaves of the other tiles
+     * lack corner values, which excludes them from surface extraction.
+     */
+    file.find_tiles(*this, aabb_min, aabb_max, 1, &tiles);
+    this->read_tiles(file, tiles);
+    int const tile_level = file.get_tile_level();
+    std::size_t num_kept = 0;
+    for (std::size_t i = 0; i < this->voxels.size(); ++i)
+        if (is_tile_corner(this->voxels[i].first, tile_level, keys))
+            this->voxels[num_kept++] = this->voxels[i];
+    this->voxels.resize(num_kept);
 }
 
 void
 IsoOctree::read_from_file (std::string const& filename)
 {
+    if (MappedOctreeFile::is_container(filename))
+    {
+        MappedOctreeFile file;
+        file.map(filename);
+        std::vector<std::size_t> tiles(file.get_num_tiles());
+        for (std::size_t i = 0; i < tiles.size(); ++i)
+            tiles[i] = i;
+        file.read_hierarchy(this);
+        this->read_tiles(file, tiles);
+        return;
+    }
+
+    /* Legacy format with the voxels stored as records. */
     std::ifstream in(filename.c_str(), std::ios::binary);
     if (!in)
         throw std::runtime_error(::strerror(errno));
@@ -264,17 +1714,7 @@ IsoOctree::read_from_file (std::string const& filename)
     this->voxels.clear();
     this->voxels.resize(num_voxels);
     for (std::size_t i = 0; i < num_voxels; ++i)
-    {
-        VoxelIndex index;
-        VoxelData data;
-        in.read(reinterpret_cast<char*>(&index.index), sizeof(index.index));
-        in.read(reinterpret_cast<char*>(&data.value), sizeof(data.value));
-        in.read(reinterpret_cast<char*>(&data.conf), sizeof(data.conf));
-        in.read(reinterpret_cast<char*>(&data.scale), sizeof(data.scale));
-        in.read(reinterpret_cast<char*>(*data.color), 3 * sizeof(float));
-        this->voxels[i].first = index;
-        this->voxels[i].second = data;
-    }
+        read_voxel(in, &this->voxels[i].first, &this->voxels[i].second);
     in.close();
 }
 
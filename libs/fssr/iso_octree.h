@@ -6,14 +6,53 @@
 #ifndef FSSR_ISO_OCTREE_HEADER
 #define FSSR_ISO_OCTREE_HEADER
 
+#include <ostream>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
+#include "util/timer.h"
 #include "fssr/defines.h"
+#include "fssr/sample.h"
+#include "fssr/basis_kernel.h"
 #include "fssr/voxel.h"
 #include "fssr/octree.h"
+#include "fssr/octree_file.h"
 
 FSSR_NAMESPACE_BEGIN
 
+/**
+ * Interface for progress reports while the implicit function is sampled.
+ * The callback is invoked from a single thread only, and a final time
+ * with all voxels done when sampling is complete.
+ */
+class SamplingProgress
+{
+public:
+    virtual ~SamplingProgress (void);
+    virtual void on_progress (std::size_t voxels_done,
+        std::size_t voxels_total) = 0;
+};
+
+/**
+ * Progress reporter that prints the progress and an ETA to the console.
+ * This is the default if no other progress callback is set.
+ */
+class ConsoleProgress : public SamplingProgress
+{
+public:
+    ConsoleProgress (void);
+    void on_progress (std::size_t voxels_done, std::size_t voxels_total);
+
+private:
+    util::WallTimer timer;
+    std::size_t last_voxels_done;
+    unsigned int last_elapsed;
+    bool finished;
+};
+
+/* --------------------------------------------------------------------- */
+
 /**
  * Given an octree with samples, this class generates the actual implicit
  * function by querying function values at the octree primal vertices of
@@ -26,6 +65,41 @@ class IsoOctree : public Octree
 public:
     typedef std::vector<std::pair<VoxelIndex, VoxelData> > VoxelVector;
 
+    /** Strategies for sampling the implicit function at the voxels. */
+    enum SamplingEngine
+    {
+        /** Every voxel queries its samples from the root. */
+        SAMPLING_VOXELS,
+        /** Voxels of small subtrees share one conservative query. */
+        SAMPLING_BRICKS,
+        /** Samples are scattered to the voxels they influence. */
+        SAMPLING_SCATTER,
+        /** Selects bricks or scatter depending on the octree. */
+        SAMPLING_AUTO
+    };
+
+    /**
+     * Scratch buffers for sampling the implicit function. One workspace
+     * is created per thread and reused for all voxels of that thread. The
+     * buffers keep their capacity, so once they have grown to the largest
+     * query, sampling a voxel does not allocate memory.
+     */
+    struct Workspace
+    {
+        /** Candidate samples returned by the influence query. */
+        std::vector<Sample const*> samples;
+        /** Candidate samples shared by all voxels of a brick. */
+        std::vector<Sample const*> brick_samples;
+        /** Leaf nodes influenced by a sample. */
+        std::vector<Iterator> nodes;
+        /** Voxels influenced by a sample. */
+        std::vector<std::size_t> voxel_ids;
+        /** Scratch for selecting the maximum scale with nth_element. */
+        std::vector<float> scales;
+        /** Structure of arrays input for the basis function kernels. */
+        SampleBatch batch;
+    };
+
 public:
     IsoOctree (void);
 
@@ -44,23 +118,166 @@ public:
      */
     int get_max_level (void) const;
 
+    /**
+     * Enables early termination of the implicit function evaluation.
+     * Samples are then evaluated finest scale first, and evaluation stops
+     * once the sum of the weights (the confidence of the voxel) reaches
+     * the threshold. The remaining samples are skipped. A threshold of
+     * zero (the default) disables early termination.
+     */
+    void set_saturation_threshold (float threshold);
+
+    /** Returns the number of samples skipped by early termination. */
+    std::size_t get_num_skipped_samples (void) const;
+
+    /**
+     * Sets the strategy for sampling the implicit function. The brick
+     * engine groups the voxels of subtrees with few leaves and runs a
+     * single influence query for the bounding box of each group. The
+     * scatter engine queries the voxels influenced by every sample
+     * instead, which is faster if there are fewer samples than voxels.
+     * The default selects between these two. All engines produce the
+     * same voxels.
+     */
+    void set_sampling_engine (SamplingEngine engine);
+
+    /**
+     * Sets the progress callback for sampling the implicit function. The
+     * callback is not owned by the octree. If no callback is set (NULL),
+     * the progress is printed to the console.
+     */
+    void set_progress_callback (SamplingProgress* progress);
+
+    /**
+     * Enables checkpointing while the voxels are computed. Evaluated voxels
+     * are appended to the checkpoint file every 'interval' milliseconds,
+     * together with the octree hierarchy. If 'resume' is set and the file
+     * contains a checkpoint for the same hierarchy and saturation
+     * threshold, the voxels from the checkpoint are restored and only the
+     * missing voxels are evaluated. If writing the checkpoint fails,
+     * computing the voxels throws. An empty file name disables
+     * checkpointing (the default).
+     */
+    void set_checkpoint (std::string const& filename,
+        std::size_t interval, bool resume);
+
+    /**
+     * Prepares an incremental update of previously computed voxels. The
+     * octree must contain all samples, i.e. the previous samples and the
+     * new samples, which are passed here again. The next computation
+     * reuses the previous voxels that are not influenced by any of the
+     * new samples, and evaluates the remaining voxels, including all
+     * voxels of leafs created by the new samples.
+     *
+     * Voxel indices are relative to the octree root. If the root of the
+     * previous octree differs, e.g. because the new samples expanded the
+     * root, no voxels are reused and all voxels are evaluated.
+     */
+    void set_update (IsoOctree const& previous,
+        std::vector<Sample> const& new_samples);
+
+    /** Returns the number of voxels reused by the last computation. */
+    std::size_t get_num_reused_voxels (void) const;
+    /** Returns the number of voxels evaluated by the last computation. */
+    std::size_t get_num_evaluated_voxels (void) const;
+
     /** Returns the map of computed voxels. */
     VoxelVector const& get_voxels (void) const;
     /** Cleas the octree and voxels. */
     void clear (void);
 
-    /** Writes the voxel data and octree hierarchy to file. */
+    /**
+     * Sets the compression level of the voxels written to file, from 1
+     * (fastest) to 9 (smallest). Level 0 writes uncompressed voxel arrays,
+     * which can be accessed mapped (the default).
+     */
+    void set_compression_level (int level);
+    /**
+     * Sets the octree level of the spatial tiles in the written file, from
+     * 0 (a single tile) to FSSR_OCTREE_CONTAINER_MAX_TILE_LEVEL. Regions
+     * of the octree can be loaded by tile. The default level is 4.
+     */
+    void set_tile_level (int level);
+
+    /**
+     * Writes the voxel data and octree hierarchy to file. The file is a
+     * binary container, see MappedOctreeFile.
+     */
     void write_to_file (std::string const& filename) const;
-    /** Reads the voxel data and octree hierarchy from file. */
+    /**
+     * Reads the voxel data and octree hierarchy from file. Both binary
+     * containers and files in the legacy format can be read.
+     */
     void read_from_file (std::string const& filename);
+    /**
+     * Reads the region of the octree that intersects the bounding box from
+     * file. Only the tiles of the region are read from binary containers,
+     * and the voxels on the upper faces of the region from the adjacent
+     * tiles. The nodes of other tiles remain leaves without voxels at
+     * their corners. Legacy files are read completely.
+     */
+    void read_from_file (std::string const& filename,
+        math::Vec3d const& aabb_min, math::Vec3d const& aabb_max);
+
+private:
+    struct BrickTasks;
 
 private:
     void compute_all_voxels (void);
-    VoxelData sample_ifn (math::Vec3d const& voxel_pos);
-    void print_progress (std::size_t voxels_done, std::size_t voxels_total);
+    void collect_subtrees (Iterator const& iter,
+        std::vector<Iterator>* subtrees) const;
+    void sample_voxels (std::size_t* num_skipped, std::size_t* max_skipped);
+    void sample_bricks (std::size_t* num_skipped, std::size_t* max_skipped);
+    void sample_scatter (std::size_t* num_skipped, std::size_t* max_skipped);
+    void sample_brick_tasks (BrickTasks* tasks, std::size_t first,
+        std::size_t last);
+    void sample_brick (BrickTasks* tasks, std::size_t brick_id,
+        std::size_t thread_id);
+    void influenced_voxels (Sample const& sample, Workspace* workspace);
+    std::size_t collect_bricks (Iterator const& iter,
+        std::vector<Iterator>* bricks) const;
+    std::size_t assign_brick_voxels (Iterator const& iter,
+        uint32_t brick_id, uint32_t* voxel_bricks) const;
+    VoxelData sample_ifn (math::Vec3d const& voxel_pos,
+        Workspace* workspace, std::size_t* num_skipped);
+    VoxelData evaluate_samples (math::Vec3d const& voxel_pos,
+        Workspace* workspace, std::size_t* num_skipped);
+    void report_progress (std::size_t* num_done);
+    void begin_checkpoint (void);
+    void begin_update (void);
+    void collect_tile_nodes (Iterator const& iter,
+        std::vector<uint64_t>* keys) const;
+    void write_voxel_blocks (std::ostream& out,
+        std::vector<std::pair<uint64_t, std::size_t> > const& order,
+        std::vector<OctreeFileTile>* tiles, OctreeFileHeader* header) const;
+    void read_tiles (MappedOctreeFile const& file,
+        std::vector<std::size_t> const& tiles);
+    void write_checkpoint (void);
+    void write_checkpoint_file (std::string const& header);
+    bool is_voxel_pending (std::size_t voxel_id) const;
+    void set_voxel_done (std::size_t voxel_id);
 
 private:
     int max_level;
+    float saturation_threshold;
+    SamplingEngine sampling_engine;
+    SamplingProgress* progress;
+    std::size_t num_voxels_done;
+    std::string checkpoint_filename;
+    std::size_t checkpoint_interval;
+    bool checkpoint_resume;
+    util::WallTimer checkpoint_timer;
+    std::string checkpoint_error;
+    std::vector<uint8_t> voxel_states;
+    VoxelVector previous_voxels;
+    math::Vec3d previous_root_center;
+    double previous_root_size;
+    std::vector<Sample> update_samples;
+    int compression_level;
+    int tile_level;
+    std::size_t num_skipped_samples;
+    std::size_t num_reused_voxels;
+    std::size_t num_evaluated_voxels;
     VoxelVector voxels;
 };
 
@@ -88,6 +305,24 @@ IsoOctree::clear (void)
     this->Octree::clear();
     this->voxels.clear();
     this->max_level = 19;
+    this->saturation_threshold = 0.0f;
+    this->sampling_engine = SAMPLING_AUTO;
+    this->progress = NULL;
+    this->num_voxels_done = 0;
+    this->num_skipped_samples = 0;
+    this->num_reused_voxels = 0;
+    this->num_evaluated_voxels = 0;
+    this->checkpoint_filename.clear();
+    this->checkpoint_interval = 0;
+    this->checkpoint_resume = false;
+    this->checkpoint_error.clear();
+    this->voxel_states.clear();
+    this->previous_voxels.clear();
+    this->previous_root_center = math::Vec3d(0.0);
+    this->previous_root_size = 0.0;
+    this->update_samples.clear();
+    this->compression_level = 0;
+    this->tile_level = 4;
 }
 
 inline void
@@ -102,6 +337,77 @@ IsoOctree::get_max_level (void) const
     return this->max_level;
 }
 
+inline void
+IsoOctree::set_saturation_threshold (float threshold)
+{
+    this->saturation_threshold = threshold;
+}
+
+inline std::size_t
+IsoOctree::get_num_skipped_samples (void) const
+{
+    return this->num_skipped_samples;
+}
+
+inline void
+IsoOctree::set_sampling_engine (SamplingEngine engine)
+{
+    this->sampling_engine = engine;
+}
+
+inline void
+IsoOctree::set_progress_callback (SamplingProgress* progress)
+{
+    this->progress = progress;
+}
+
+inline void
+IsoOctree::set_checkpoint (std::string const& filename,
+    std::size_t interval, bool resume)
+{
+    this->checkpoint_filename = filename;
+    this->checkpoint_interval = interval;
+    this->checkpoint_resume = resume;
+}
+
+inline void
+IsoOctree::set_compression_level (int level)
+{
+    if (level < 0 || level > 9)
+        throw std::invalid_argument("Invalid compression level");
+    this->compression_level = level;
+}
+
+inline void
+IsoOctree::set_tile_level (int level)
+{
+    if (level < 0 || level > FSSR_OCTREE_CONTAINER_MAX_TILE_LEVEL)
+        throw std::invalid_argument("Invalid tile level");
+    this->tile_level = level;
+}
+
+inline void
+IsoOctree::set_update (IsoOctree const& previous,
+    std::vector<Sample> const& new_samples)
+{
+    this->previous_voxels = previous.get_voxels();
+    this->previous_root_center = previous.get_root_node_center();
+    this->previous_root_size = previous.get_root_node_size();
+    this->update_samples = new_samples;
+}
+
+inline std::size_t
+IsoOctree::get_num_reused_voxels (void) const
+{
+    return this->num_reused_voxels;
+}
+
+inline std::size_t
+IsoOctree::get_num_evaluated_voxels (void) const
+{
+    return this->num_evaluated_voxels;
+}
+
 FSSR_NAMESPACE_END
 
 #endif /* FSSR_ISO_OCTREE_HEADER */
@@ -3,16 +3,98 @@
  * Written by Simon Fuhrmann.
  */
 
+#include <cmath>
+#include <limits>
 #include <list>
 #include <iostream>
 #include <algorithm>
+#include <stdexcept>
 
 #include "util/timer.h"
 #include "mve/mesh_io.h"
+#include "fssr/radix_sort.h"
 #include "fssr/octree.h"
 
 FSSR_NAMESPACE_BEGIN
 
+namespace
+{
+    /*
+     * The bulk construction sorts samples by a 64 bit key which contains
+     * the node path (3 bits per level, shifted to the maximum level) in the
+     * upper bits and the node level in the lowest 5 bits. In this order,
+     * nodes appear in depth-first order and parents appear before children.
+     */
+    int const BULK_MAX_LEVEL = 19;
+    int const BULK_LEVEL_BITS = 5;
+    /* Subtrees at this level are constructed in parallel. */
+    int const BULK_SPLIT_LEVEL = 2;
+
+    typedef std::pair<uint64_t, std::size_t> SampleKey;
+
+    struct SampleKeyFunc
+    {
+        uint64_t operator() (SampleKey const& key) const
+        {
+            return key.first;
+        }
+    };
+
+    inline int
+    sample_key_level (uint64_t key)
+    {
+        return static_cast<int>(key & ((1 << BULK_LEVEL_BITS) - 1));
+    }
+
+    /* Returns the octant of the node at the given level on the path. */
+    inline int
+    sample_key_octant (uint64_t key, int level)
+    {
+        return static_cast<int>((key >> (BULK_LEVEL_BITS
+            + 3 * (BULK_MAX_LEVEL - level))) & 7);
+    }
+
+    struct SampleKeyLevelCompare
+    {
+        bool operator() (SampleKey const& key) const
+        {
+            return sample_key_level(key.first) < BULK_SPLIT_LEVEL;
+        }
+    };
+
+    /* The octree root while inserting the samples from 'first_sample'. */
+    struct BulkRoot
+    {
+        std::size_t first_sample;
+        math::Vec3d center;
+        double size;
+    };
+
+    struct BulkRootCompare
+    {
+        bool operator() (std::size_t sample, BulkRoot const& root) const
+        {
+            return sample < root.first_sample;
+        }
+    };
+
+    /* Returns the squared distance of the point to the box. */
+    inline double
+    aabb_square_distance (math::Vec3d const& aabb_min,
+        math::Vec3d const& aabb_max, math::Vec3d const& pos)
+    {
+        double dist = 0.0;
+        for (int i = 0; i < 3; ++i)
+        {
+            if (pos[i] < aabb_min[i])
+                dist += MATH_POW2(aabb_min[i] - pos[i]);
+            else if (pos[i] > aabb_max[i])
+                dist += MATH_POW2(pos[i] - aabb_max[i]);
+        }
+        return dist;
+    }
+}
+
 Octree::NodePath
 Octree::NodePath::descend (int const octant) const
 {
@@ -75,15 +157,17 @@ Octree::Iterator::init (Octree const* octree)
     this->node = octree->get_root_node();
     this->node_geom = octree->get_node_geom_for_root();
     this->node_path = octree->get_node_path_for_root();
+    this->octree = octree;
 }
 
 Octree::Iterator
 Octree::Iterator::descend (int const octant) const
 {
     Iterator iter;
-    iter.node = this->node->children[octant];
+    iter.node = this->octree->get_child(this->node, octant);
     iter.node_geom = this->node_geom.descend(octant);
     iter.node_path = this->node_path.descend(octant);
+    iter.octree = this->octree;
     return iter;
 }
 
@@ -92,6 +176,21 @@ Octree::Iterator::descend (int const octant) const
 void
 Octree::clear (void)
 {
+    this->arena.clear();
+    this->samples.clear();
+    this->sample_links.clear();
+    this->samples_packed = false;
+    for (std::size_t i = 0; i < this->log_samples.size(); ++i)
+    {
+        delete [] this->log_samples[i];
+        delete [] this->log_links[i];
+    }
+    std::vector<Sample*>().swap(this->log_samples);
+    std::vector<uint32_t*>().swap(this->log_links);
+    this->concurrent_insertion = false;
+    this->log_size = 0;
+    this->log_overflow = false;
+    this->num_rejected_samples = 0;
     this->num_samples = 0;
     this->num_nodes = 0;
     this->root = NULL;
@@ -99,13 +198,137 @@ Octree::clear (void)
     this->root_center = math::Vec3d(0.0);
 }
 
+void
+Octree::NodeArena::allocate_chunk (Cursor* cursor)
+{
+    uint32_t const chunk_blocks = (1u << FSSR_NODE_ARENA_CHUNK_BITS) / 8;
+    Node* chunk = new Node[8 * chunk_blocks];
+
+#pragma omp critical(fssr_node_arena)
+    {
+        /* The chunk table is allocated once to keep lookups lock-free. */
+        if (this->chunks.empty())
+            this->chunks.resize(std::size_t(1)
+                << (32 - FSSR_NODE_ARENA_CHUNK_BITS), NULL);
+        if (this->num_chunks == this->chunks.size())
+        {
+            delete [] chunk;
+            throw std::runtime_error("Octree node index overflow");
+        }
+
+        cursor->next_block = this->num_chunks * chunk_blocks;
+        cursor->end_block = cursor->next_block + chunk_blocks;
+        this->chunks[this->num_chunks] = chunk;
+        this->num_chunks += 1;
+    }
+
+    /* Block 0 is reserved. */
+    if (cursor->next_block == 0)
+        cursor->next_block = 1;
+}
+
+uint32_t
+Octree::NodeArena::allocate_block_concurrent (void)
+{
+    while (true)
+    {
+        uint64_t state = __atomic_load_n(&this->shared_cursor,
+            __ATOMIC_ACQUIRE);
+        uint32_t const next_block = static_cast<uint32_t>(state);
+        uint32_t const end_block = static_cast<uint32_t>(state >> 32);
+        if (next_block < end_block)
+        {
+            if (__atomic_compare_exchange_n(&this->shared_cursor, &state,
+                state + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                return next_block;
+            continue;
+        }
+
+        /* The shared cursor is exhausted, one thread reserves a chunk. */
+#pragma omp critical(fssr_node_arena_shared)
+        if (__atomic_load_n(&this->shared_cursor, __ATOMIC_ACQUIRE) == state)
+        {
+            Cursor chunk;
+            this->allocate_chunk(&chunk);
+            __atomic_store_n(&this->shared_cursor,
+                (static_cast<uint64_t>(chunk.end_block) << 32)
+                | chunk.next_block, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+Octree::NodeArena::Cursor
+Octree::NodeArena::acquire_cursor (void)
+{
+    Cursor cursor;
+#pragma omp critical(fssr_node_arena)
+    if (!this->free_cursors.empty())
+    {
+        cursor = this->free_cursors.back();
+        this->free_cursors.pop_back();
+    }
+    return cursor;
+}
+
+void
+Octree::NodeArena::release_cursor (Cursor const& cursor)
+{
+    if (cursor.next_block == cursor.end_block)
+        return;
+#pragma omp critical(fssr_node_arena)
+    this->free_cursors.push_back(cursor);
+}
+
+void
+Octree::NodeArena::clear (void)
+{
+    for (std::size_t i = 0; i < this->num_chunks; ++i)
+        delete [] this->chunks[i];
+    this->chunks.clear();
+    this->num_chunks = 0;
+    this->cursor = Cursor();
+    this->free_cursors.clear();
+    this->shared_cursor = 0;
+}
+
+/* ---------------------------------------------------------------- */
+
+void
+Octree::init_root (math::Vec3d const& aabb_min,
+    math::Vec3d const& aabb_max, double max_scale)
+{
+    if (this->root != NULL)
+        throw std::runtime_error("Octree root already initialized");
+    if (max_scale <= 0.0)
+        throw std::invalid_argument("Invalid maximum sample scale");
+
+    /*
+     * The root size is the largest scale, doubled until the bounding box
+     * fits. This ensures that no sample requires root expansion, and
+     * samples with the largest scale are inserted at a node of equal size.
+     */
+    this->root = this->arena.get_node(8 * this->arena.allocate_block());
+    this->root_center = (aabb_min + aabb_max) / 2.0;
+    this->root_size = max_scale;
+    this->num_nodes = 1;
+    while (!this->is_inside_octree(aabb_min)
+        || !this->is_inside_octree(aabb_max))
+        this->root_size *= 2.0;
+}
+
 void
 Octree::insert_sample (Sample const& s)
 {
+    if (this->concurrent_insertion)
+    {
+        this->insert_sample_concurrent(s);
+        return;
+    }
+
     if (this->root == NULL)
     {
         //std::cout << "INFO: Creating octree root node." << std::endl;
-        this->root = new Node();
+        this->root = this->arena.get_node(8 * this->arena.allocate_block());
         this->root_center = s.pos;
         this->root_size = s.scale;
         this->num_nodes = 1;
@@ -122,16 +345,375 @@ Octree::insert_sample (Sample const& s)
         return;
     }
 
-    node->samples.push_back(s);
+    if (this->samples.size() >= std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Octree sample index overflow");
+    this->unpack_samples();
+    this->samples.push_back(s);
+    this->sample_links.push_back(0);
+    this->add_sample_to_node(node, this->samples.size() - 1);
     this->num_samples += 1;
 }
 
+void
+Octree::set_concurrent_insertion (bool enable)
+{
+    if (enable == this->concurrent_insertion)
+        return;
+
+    if (enable)
+    {
+        if (this->root == NULL)
+            throw std::runtime_error("Concurrent insertion requires a root");
+        this->unpack_samples();
+        this->log_samples.resize(std::size_t(1)
+            << (32 - FSSR_OCTREE_LOG_CHUNK_BITS), NULL);
+        this->log_links.resize(this->log_samples.size(), NULL);
+        this->log_size = 0;
+        this->log_overflow = false;
+        this->num_rejected_samples = 0;
+        this->concurrent_insertion = true;
+        return;
+    }
+
+    /* Move the logged samples to the sample array. */
+    std::size_t const chunk_size = std::size_t(1) << FSSR_OCTREE_LOG_CHUNK_BITS;
+    std::size_t const first_index = this->samples.size();
+    this->samples.resize(first_index + this->log_size);
+    this->sample_links.resize(first_index + this->log_size);
+    for (std::size_t i = 0; i < this->log_samples.size()
+        && this->log_samples[i] != NULL; ++i)
+    {
+        std::size_t const begin = i * chunk_size;
+        std::size_t const end = std::min<std::size_t>(begin + chunk_size,
+            this->log_size);
+        std::copy(this->log_samples[i], this->log_samples[i] + end - begin,
+            this->samples.begin() + first_index + begin);
+        std::copy(this->log_links[i], this->log_links[i] + end - begin,
+            this->sample_links.begin() + first_index + begin);
+        delete [] this->log_samples[i];
+        delete [] this->log_links[i];
+    }
+    std::vector<Sample*>().swap(this->log_samples);
+    std::vector<uint32_t*>().swap(this->log_links);
+    this->log_size = 0;
+    this->concurrent_insertion = false;
+    if (this->log_overflow)
+        throw std::runtime_error("Octree sample index overflow");
+}
+
+bool
+Octree::insert_sample_concurrent (Sample const& s)
+{
+    /* Producer threads must not throw, rejected samples are counted. */
+    if (!this->is_inside_octree(s.pos) || s.scale >= this->root_size * 2.0)
+    {
+        __atomic_fetch_add(&this->num_rejected_samples, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    /* Same descend as in find_node_descend(). */
+    Node* node = this->root;
+    NodeGeom node_geom = this->get_node_geom_for_root();
+    while (node_geom.size > s.scale)
+    {
+        int octant = 0;
+        for (int i = 0; i < 3; ++i)
+            if (s.pos[i] > node_geom.center[i])
+                octant |= (1 << i);
+        node = this->create_child_concurrent(node, octant);
+        node_geom = node_geom.descend(octant);
+    }
+
+    /* Append the sample to the log. */
+    std::size_t const chunk_size = std::size_t(1) << FSSR_OCTREE_LOG_CHUNK_BITS;
+    /* The log slot is only claimed if the sample index does not overflow. */
+    uint32_t log_index = __atomic_load_n(&this->log_size, __ATOMIC_RELAXED);
+    do
+    {
+        if (this->samples.size() + log_index
+            >= std::numeric_limits<uint32_t>::max())
+        {
+            __atomic_store_n(&this->log_overflow, true, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&this->num_rejected_samples, 1,
+                __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    while (!__atomic_compare_exchange_n(&this->log_size, &log_index,
+        log_index + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    std::size_t const index = this->samples.size() + log_index;
+    std::size_t const chunk = log_index >> FSSR_OCTREE_LOG_CHUNK_BITS;
+    if (__atomic_load_n(&this->log_links[chunk], __ATOMIC_ACQUIRE) == NULL)
+    {
+#pragma omp critical(fssr_octree_log)
+        if (this->log_links[chunk] == NULL)
+        {
+            this->log_samples[chunk] = new Sample[chunk_size];
+            __atomic_store_n(&this->log_links[chunk],
+                new uint32_t[chunk_size], __ATOMIC_RELEASE);
+        }
+    }
+    std::size_t const offset = log_index & (chunk_size - 1);
+    this->log_samples[chunk][offset] = s;
+
+    /* Push the sample to the front of the chain of the node. */
+    uint32_t head = __atomic_load_n(&node->first_sample, __ATOMIC_RELAXED);
+    do
+        this->log_links[chunk][offset] = head;
+    while (!__atomic_compare_exchange_n(&node->first_sample, &head,
+        static_cast<uint32_t>(index), true,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&node->num_samples, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&this->num_samples, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+Octree::Node*
+Octree::create_child_concurrent (Node* node, int octant)
+{
+    uint32_t first_child = __atomic_load_n(&node->first_child,
+        __ATOMIC_ACQUIRE);
+    if (first_child == 0)
+    {
+        /* If another thread wins, the allocated block remains unused. */
+        uint32_t const block = this->arena.allocate_block_concurrent();
+        if (__atomic_compare_exchange_n(&node->first_child, &first_child,
+            block, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            first_child = block;
+    }
+
+    uint8_t const bit = 1 << octant;
+    if (!(__atomic_load_n(&node->child_mask, __ATOMIC_RELAXED) & bit)
+        && !(__atomic_fetch_or(&node->child_mask, bit, __ATOMIC_RELAXED)
+        & bit))
+        __atomic_fetch_add(&this->num_nodes, 1, __ATOMIC_RELAXED);
+
+    return this->arena.get_node(first_child * 8 + octant);
+}
+
 void
 Octree::insert_samples (PointSet const& pset)
 {
-    PointSet::SampleList const& samples = pset.get_samples();
-    for (std::size_t i = 0; i < samples.size(); i++)
-        this->insert_sample(samples[i]);
+    std::size_t const num_samples = pset.get_num_samples();
+    if (this->concurrent_insertion)
+    {
+        for (std::size_t i = 0; i < num_samples; i++)
+        {
+            Sample sample;
+            if (pset.get_sample(i, &sample))
+                this->insert_sample_concurrent(sample);
+        }
+        return;
+    }
+
+    /*
+     * Expand the root exactly as incremental insertion would. This is
+     * order-dependent and cheap, because no nodes are traversed. The
+     * root at the time each sample is inserted is recorded.
+     */
+    std::vector<BulkRoot> roots;
+    for (std::size_t i = 0; i < num_samples; i++)
+    {
+        Sample sample;
+        if (!pset.get_sample(i, &sample))
+            continue;
+
+        if (this->root == NULL)
+        {
+            this->root = this->arena.get_node(8
+                * this->arena.allocate_block());
+            this->root_center = sample.pos;
+            this->root_size = sample.scale;
+            this->num_nodes = 1;
+        }
+
+        while (!this->is_inside_octree(sample.pos))
+            this->expand_root_for_point(sample.pos);
+        if (sample.scale >= this->root_size * 2.0)
+            this->find_node_expand(sample);
+
+        if (roots.empty() || roots.back().size != this->root_size)
+        {
+            BulkRoot root;
+            root.first_sample = i;
+            root.center = this->root_center;
+            root.size = this->root_size;
+            roots.push_back(root);
+        }
+    }
+
+    /* Compute the key of the target node for every sample in parallel. */
+    std::vector<SampleKey> keys(num_samples);
+    bool level_overflow = false;
+    NodeGeom const root_geom = this->get_node_geom_for_root();
+#pragma omp parallel for reduction(||:level_overflow)
+    for (std::size_t i = 0; i < num_samples; i++)
+    {
+        keys[i].second = i;
+        keys[i].first = ~static_cast<uint64_t>(0);
+
+        Sample sample;
+        if (!pset.get_sample(i, &sample))
+            continue;
+
+        /*
+         * Same descend as in find_node_descend(). Incremental insertion
+         * places a sample in the root at its time of insertion, which
+         * matters for samples on the faces of this root. Thus, the
+         * descend follows the center of this root until it is reached.
+         */
+        BulkRoot const& insert_root = *(std::upper_bound(roots.begin(),
+            roots.end(), i, BulkRootCompare()) - 1);
+        math::Vec3d const sample_pos(sample.pos);
+        NodeGeom node_geom = root_geom;
+        uint64_t path = 0;
+        int level = 0;
+        while (node_geom.size > sample.scale && level < BULK_MAX_LEVEL)
+        {
+            math::Vec3d const& pos = node_geom.size > insert_root.size
+                ? insert_root.center : sample_pos;
+            int octant = 0;
+            for (int j = 0; j < 3; ++j)
+                if (pos[j] > node_geom.center[j])
+                    octant |= (1 << j);
+            path = (path << 3) | octant;
+            node_geom = node_geom.descend(octant);
+            level += 1;
+        }
+        if (node_geom.size > sample.scale)
+            level_overflow = true;
+
+        keys[i].first = (path << (BULK_LEVEL_BITS
+            + 3 * (BULK_MAX_LEVEL - level))) | level;
+    }
+
+    /* Very deep octrees are not supported, fall back to single inserts. */
+    if (level_overflow)
+    {
+        std::cout << "Octree too deep for bulk insertion, "
+            << "inserting samples one by one." << std::endl;
+        for (std::size_t i = 0; i < num_samples; i++)
+        {
+            Sample sample;
+            if (pset.get_sample(i, &sample))
+                this->insert_sample(sample);
+        }
+        return;
+    }
+
+    /* Sort keys and remove the invalid samples at the end. */
+    radix_sort(&keys, SampleKeyFunc());
+    while (!keys.empty() && keys.back().first == ~static_cast<uint64_t>(0))
+        keys.pop_back();
+    this->num_samples += keys.size();
+
+    /*
+     * Samples above the split level are inserted first. The remaining
+     * samples are grouped by the subtrees at the split level, which are
+     * created upfront and then populated in parallel.
+     */
+    std::vector<SampleKey>::iterator split_iter = std::stable_partition(
+        keys.begin(), keys.end(), SampleKeyLevelCompare());
+    std::size_t const num_upper = split_iter - keys.begin();
+    this->unpack_samples();
+    std::size_t const first_index = this->samples.size();
+    if (first_index + keys.size() > std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("Octree sample index overflow");
+    this->samples.resize(first_index + keys.size());
+    this->sample_links.resize(first_index + keys.size());
+    this->num_nodes += this->insert_sorted_samples(pset, this->root, 0,
+        keys.empty() ? NULL : &keys[0], num_upper, first_index, NULL);
+
+    std::vector<std::size_t> group_offsets;
+    std::vector<Node*> group_nodes;
+    for (std::size_t i = num_upper; i < keys.size(); ++i)
+    {
+        uint64_t const group_mask = ~static_cast<uint64_t>(0)
+            << (BULK_LEVEL_BITS + 3 * (BULK_MAX_LEVEL - BULK_SPLIT_LEVEL));
+        if (i > num_upper && (keys[i].first & group_mask)
+            == (keys[i - 1].first & group_mask))
+            continue;
+
+        Node* node = this->root;
+        for (int level = 1; level <= BULK_SPLIT_LEVEL; ++level)
+        {
+            int const octant = sample_key_octant(keys[i].first, level);
+            if (!node->has_child(octant))
+                this->num_nodes += 1;
+            node = this->create_child(node, octant);
+        }
+        group_offsets.push_back(i);
+        group_nodes.push_back(node);
+    }
+    group_offsets.push_back(keys.size());
+
+    /*
+     * Every thread allocates from its own cursor. The remaining blocks
+     * are returned to the arena and used by the next bulk insertion.
+     */
+    std::size_t num_new_nodes = 0;
+#pragma omp parallel reduction(+:num_new_nodes)
+    {
+        NodeArena::Cursor cursor = this->arena.acquire_cursor();
+#pragma omp for schedule(dynamic)
+        for (std::size_t i = 0; i < group_nodes.size(); ++i)
+        {
+            num_new_nodes += this->insert_sorted_samples(pset,
+                group_nodes[i], BULK_SPLIT_LEVEL, &keys[group_offsets[i]],
+                group_offsets[i + 1] - group_offsets[i],
+                first_index + group_offsets[i], &cursor);
+        }
+        this->arena.release_cursor(cursor);
+    }
+    this->num_nodes += num_new_nodes;
+}
+
+std::size_t
+Octree::insert_sorted_samples (PointSet const& pset, Node* node, int level,
+    std::pair<uint64_t, std::size_t> const* keys, std::size_t num_keys,
+    std::size_t first_index, NodeArena::Cursor* cursor)
+{
+    /* The current path from the given node to the last target node. */
+    Node* path[BULK_MAX_LEVEL + 1];
+    path[level] = node;
+    int path_level = level;
+
+    std::size_t num_new_nodes = 0;
+    for (std::size_t i = 0; i < num_keys; ++i)
+    {
+        uint64_t const key = keys[i].first;
+        int const key_level = sample_key_level(key);
+
+        /* Find the deepest common node and descend to the target node. */
+        if (i > 0 && key != keys[i - 1].first)
+        {
+            int common_level = level;
+            while (common_level < std::min(path_level, key_level)
+                && sample_key_octant(key, common_level + 1)
+                == sample_key_octant(keys[i - 1].first, common_level + 1))
+                common_level += 1;
+            path_level = common_level;
+        }
+
+        if (i == 0 || key != keys[i - 1].first)
+        {
+            for (; path_level < key_level; ++path_level)
+            {
+                Node* parent = path[path_level];
+                int const octant = sample_key_octant(key, path_level + 1);
+                if (!parent->has_child(octant))
+                    num_new_nodes += 1;
+                path[path_level + 1] = this->create_child(parent, octant,
+                    cursor);
+            }
+        }
+
+        std::size_t const index = first_index + i;
+        pset.get_sample(keys[i].second, &this->samples[index]);
+        this->add_sample_to_node(path[key_level], index);
+    }
+
+    return num_new_nodes;
 }
 
 bool
@@ -162,12 +744,133 @@ Octree::expand_root_for_point (math::Vec3d const& pos)
         }
     this->root_size *= 2.0;
 
-    Node* new_root = new Node();
-    new_root->children[root_octant] = this->root;
+    /* Move the old root into the child block of the new root. */
+    Node* new_root = this->arena.get_node(8 * this->arena.allocate_block());
+    *this->create_child(new_root, root_octant) = *this->root;
+    *this->root = Node();
     this->root = new_root;
     this->num_nodes += 1;
 }
 
+Octree::Node*
+Octree::create_child (Node* node, int octant, NodeArena::Cursor* cursor)
+{
+    if (node->is_leaf())
+    {
+        node->first_child = (cursor == NULL)
+            ? this->arena.allocate_block()
+            : this->arena.allocate_block(cursor);
+    }
+    node->child_mask |= (1 << octant);
+    return this->arena.get_node(node->first_child * 8 + octant);
+}
+
+void
+Octree::finalize (void)
+{
+    if (this->samples_packed)
+        return;
+
+    /* Assign sample ranges to nodes in depth-first order. */
+    std::vector<Node*> nodes;
+    this->get_nodes_depth_first(&nodes);
+    std::vector<uint32_t> offsets(nodes.size());
+    uint32_t num_packed = 0;
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        offsets[i] = num_packed;
+        num_packed += nodes[i]->num_samples;
+    }
+
+    /* Copy the samples of every node, restoring the insertion order. */
+    std::vector<Sample> packed(num_packed);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        Node* node = nodes[i];
+        uint32_t index = node->first_sample;
+        for (uint32_t j = node->num_samples; j > 0; --j)
+        {
+            packed[offsets[i] + j - 1] = this->samples[index];
+            index = this->sample_links[index];
+        }
+        node->first_sample = offsets[i];
+    }
+
+    std::swap(this->samples, packed);
+    std::vector<uint32_t>().swap(this->sample_links);
+    this->samples_packed = true;
+}
+
+void
+Octree::unpack_samples (void)
+{
+    if (!this->samples_packed)
+        return;
+
+    /* Chain the sample ranges and point each node to its latest sample. */
+    std::vector<Node*> nodes;
+    this->get_nodes_depth_first(&nodes);
+    this->sample_links.resize(this->samples.size());
+    for (std::size_t i = 0; i < nodes.size(); ++i)
+    {
+        Node* node = nodes[i];
+        for (uint32_t j = 1; j < node->num_samples; ++j)
+            this->sample_links[node->first_sample + j]
+                = node->first_sample + j - 1;
+        if (node->num_samples > 0)
+            node->first_sample += node->num_samples - 1;
+    }
+    this->samples_packed = false;
+}
+
+void
+Octree::get_nodes_depth_first (std::vector<Node*>* result)
+{
+    result->clear();
+    if (this->root == NULL)
+        return;
+    result->reserve(this->num_nodes);
+
+    std::vector<Node*> stack(1, this->root);
+    while (!stack.empty())
+    {
+        Node* node = stack.back();
+        stack.pop_back();
+        result->push_back(node);
+        for (int i = 7; i >= 0; --i)
+            if (node->has_child(i))
+                stack.push_back(this->get_child(node, i));
+    }
+}
+
+void
+Octree::get_node_samples (Node const* node,
+    std::vector<Sample const*>* result) const
+{
+    if (this->samples_packed)
+    {
+        for (uint32_t i = 0; i < node->num_samples; ++i)
+            result->push_back(&this->samples[node->first_sample + i]);
+        return;
+    }
+
+    uint32_t index = node->first_sample;
+    for (uint32_t i = 0; i < node->num_samples; ++i)
+    {
+        result->push_back(&this->samples[index]);
+        index = this->sample_links[index];
+    }
+}
+
+void
+Octree::add_sample_to_node (Node* node, uint32_t index)
+{
+    this->sample_links[index] = node->first_sample;
+    node->first_sample = index;
+    node->num_samples += 1;
+}
+
 Octree::Node*
 Octree::find_node_for_sample (Sample const& sample)
 {
@@ -209,13 +912,10 @@ Octree::find_node_descend (Sample const& sample, Node* node,
         if (sample.pos[i] > node_geom.center[i])
             octant |= (1 << i);
 
-    if (node->children[octant] == NULL)
-    {
-        node->children[octant] = new Node();
+    if (!node->has_child(octant))
         this->num_nodes += 1;
-    }
 
-    return this->find_node_descend(sample, node->children[octant],
+    return this->find_node_descend(sample, this->create_child(node, octant),
         node_geom.descend(octant));
 }
 
@@ -249,7 +949,7 @@ Octree::get_num_levels (Node const* node) const
     int max_level = 0;
     for (int i = 0; i < 8; ++i)
         max_level = std::max(max_level,
-            this->get_num_levels(node->children[i]));
+            this->get_num_levels(this->get_child(node, i)));
     return max_level + 1;
 }
 
@@ -261,9 +961,10 @@ Octree::get_points_per_level (std::vector<std::size_t>* stats,
         return;
     if (stats->size() <= level)
         stats->resize(level + 1, 0);
-    stats->at(level) += node->samples.size();
+    stats->at(level) += node->num_samples;
     for (int i = 0; i < 8; ++i)
-        this->get_points_per_level(stats, node->children[i], level + 1);
+        this->get_points_per_level(stats, this->get_child(node, i),
+            level + 1);
 }
 
 void
@@ -292,24 +993,96 @@ Octree::influence_query (math::Vec3d const& pos, double factor,
         return;
 
     /* Node could not be ruled out. Test all samples. */
-    for (std::size_t i = 0; i < node->samples.size(); ++i)
+    if (this->samples_packed)
     {
-        Sample const& s = node->samples[i];
-        if ((pos - s.pos).square_norm() > MATH_POW2(factor * s.scale))
-            continue;
-        result->push_back(&s);
+        for (uint32_t i = 0; i < node->num_samples; ++i)
+        {
+            Sample const& s = this->samples[node->first_sample + i];
+            if ((pos - s.pos).square_norm() > MATH_POW2(factor * s.scale))
+                continue;
+            result->push_back(&s);
+        }
+    }
+    else
+    {
+        uint32_t index = node->first_sample;
+        for (uint32_t i = 0; i < node->num_samples; ++i)
+        {
+            Sample const& s = this->samples[index];
+            index = this->sample_links[index];
+            if ((pos - s.pos).square_norm() > MATH_POW2(factor * s.scale))
+                continue;
+            result->push_back(&s);
+        }
     }
 
     /* Descend into octree. */
     for (int i = 0; i < 8; ++i)
     {
-        if (node->children[i] == NULL)
+        if (!node->has_child(i))
             continue;
-        this->influence_query(pos, factor, result, node->children[i],
+        this->influence_query(pos, factor, result, this->get_child(node, i),
             node_geom.descend(i));
     }
 }
 
+void
+Octree::influence_query (math::Vec3d const& aabb_min,
+    math::Vec3d const& aabb_max, double factor,
+    std::vector<Sample const*>* result,
+    Node const* node, NodeGeom const& node_geom) const
+{
+    if (node == NULL)
+        return;
+
+    /*
+     * Same strategy as the point query. The distance from the node center
+     * to the box is a lower bound for the distance to any point in the
+     * box, thus the node is only skipped if it would be skipped for all
+     * points in the box.
+     */
+    double const min_distance = std::sqrt(aabb_square_distance(aabb_min,
+        aabb_max, node_geom.center)) - MATH_SQRT3 * node_geom.size / 2.0;
+    double const max_scale = node_geom.size * 2.0;
+    if (min_distance > max_scale * factor)
+        return;
+
+    /* Node could not be ruled out. Test all samples against the box. */
+    if (this->samples_packed)
+    {
+        for (uint32_t i = 0; i < node->num_samples; ++i)
+        {
+            Sample const& s = this->samples[node->first_sample + i];
+            if (aabb_square_distance(aabb_min, aabb_max, s.pos)
+                > MATH_POW2(factor * s.scale))
+                continue;
+            result->push_back(&s);
+        }
+    }
+    else
+    {
+        uint32_t index = node->first_sample;
+        for (uint32_t i = 0; i < node->num_samples; ++i)
+        {
+            Sample const& s = this->samples[index];
+            index = this->sample_links[index];
+            if (aabb_square_distance(aabb_min, aabb_max, s.pos)
+                > MATH_POW2(factor * s.scale))
+                continue;
+            result->push_back(&s);
+        }
+    }
+
+    /* Descend into octree. */
+    for (int i = 0; i < 8; ++i)
+    {
+        if (!node->has_child(i))
+            continue;
+        this->influence_query(aabb_min, aabb_max, factor, result,
+            this->get_child(node, i), node_geom.descend(i));
+    }
+}
+
 void
 Octree::influenced_query (Sample const& sample, double factor,
     std::vector<Iterator>* result, Iterator const& iter)
@@ -328,17 +1101,15 @@ Octree::influenced_query (Sample const& sample, double factor,
         return;
 
     /* Descend into octree. */
-    bool is_leaf = true;
     for (int i = 0; i < 8; ++i)
     {
-        if (iter.node->children[i] == NULL)
+        if (!iter.node->has_child(i))
             continue;
-        is_leaf = false;
         this->influenced_query(sample, factor, result, iter.descend(i));
     }
 
     /* Only leafs are considered. */
-    if (!is_leaf)
+    if (!iter.node->is_leaf())
         return;
 
     /* Add this node to the result set. */
@@ -348,24 +1119,19 @@ Octree::influenced_query (Sample const& sample, double factor,
 void
 Octree::make_regular_octree (Node* node)
 {
-    bool is_leaf = true;
-    for (int i = 0; i < 8 && is_leaf; ++i)
-        if (node->children[i] != NULL)
-            is_leaf = false;
-
-    if (is_leaf)
+    if (node->is_leaf())
         return;
 
     for (int i = 0; i < 8; ++i)
     {
-        if (node->children[i] == NULL)
+        if (!node->has_child(i))
         {
-            node->children[i] = new Node();
+            this->create_child(node, i);
             this->num_nodes += 1;
         }
         else
         {
-            this->make_regular_octree(node->children[i]);
+            this->make_regular_octree(this->get_child(node, i));
         }
     }
 }
@@ -383,21 +1149,16 @@ Octree::refine_octree (void)
         Node* node = queue.front();
         queue.pop_front();
 
-        bool is_leaf = true;
-        for (int i = 0; i < 8 && is_leaf; ++i)
-            if (node->children[i] != NULL)
-                is_leaf = false;
-
-        if (is_leaf)
-            for (int i = 0; i < 8; ++i)
-            {
-                node->children[i] = new Node();
-                this->num_nodes += 1;
-            }
+        if (node->is_leaf())
+        {
+            node->first_child = this->arena.allocate_block();
+            node->child_mask = 0xff;
+            this->num_nodes += 8;
+        }
         else
             for (int i = 0; i < 8; ++i)
-                if (node->children[i] != NULL)
-                    queue.push_back(node->children[i]);
+                if (node->has_child(i))
+                    queue.push_back(this->get_child(node, i));
     }
 }
 
@@ -417,18 +1178,20 @@ Octree::remove_low_res_samples (int min_level)
         queue.pop_front();
         if (level > min_level)
             continue;
-        removed_samples += node->samples.size();
-        node->samples.clear();
+        removed_samples += node->num_samples;
+        node->num_samples = 0;
         for (int i = 0; i < 8; ++i)
-            if (node->children[i] != NULL && level < min_level)
-                queue.push_back(std::make_pair(node->children[i], level + 1));
+            if (node->has_child(i) && level < min_level)
+                queue.push_back(std::make_pair(this->get_child(node, i),
+                    level + 1));
     }
 
     std::cout << "Removed " << removed_samples << " samples." << std::endl;
 }
 
 void
-Octree::write_hierarchy (std::ostream& out, bool with_meta) const
+Octree::write_hierarchy (std::ostream& out, bool with_meta,
+    int max_level) const
 {
     if (with_meta)
     {
@@ -440,28 +1203,79 @@ Octree::write_hierarchy (std::ostream& out, bool with_meta) const
             sizeof(double));
     }
 
-    std::list<Octree::Node const*> queue;
-    queue.push_back(this->root);
-    while (!queue.empty())
+    this->write_packed_hierarchy(out, this->root, max_level);
+}
+
+void
+Octree::write_subtree_hierarchy (std::ostream& out,
+    NodePath const& path) const
+{
+    Node const* node = this->root;
+    for (int l = path.level - 1; l >= 0 && node != NULL; --l)
+        node = this->get_child(node, (path.path >> (3 * l)) & 7);
+    if (node == NULL)
+        throw std::invalid_argument("Invalid node path");
+    this->write_packed_hierarchy(out, node, -1);
+}
+
+void
+Octree::read_subtree_hierarchy (std::istream& in, NodePath const& path)
+{
+    Node* node = this->root;
+    for (int l = path.level - 1; l >= 0 && node != NULL; --l)
+        node = this->get_child(node, (path.path >> (3 * l)) & 7);
+    if (node == NULL || !node->is_leaf())
+        throw std::invalid_argument("Invalid node path");
+    if (in.peek() != FSSR_OCTREE_PACKED_HIERARCHY_ID)
+        throw std::runtime_error("Invalid octree hierarchy");
+    this->read_packed_hierarchy(in, node);
+}
+
+void
+Octree::write_packed_hierarchy (std::ostream& out, Node const* root,
+    int max_level) const
+{
+    /*
+     * The packed hierarchy stores the child mask of every node in
+     * breadth-first order. The masks are collected level by level and
+     * written in one buffer. Nodes on the maximum level are leaves.
+     */
+    std::vector<uint8_t> masks;
+    std::vector<Octree::Node const*> level;
+    std::vector<Octree::Node const*> next_level;
+    if (root != NULL)
+        level.push_back(root);
+    for (int depth = 0; !level.empty(); ++depth)
     {
-        Octree::Node const* node = queue.front();
-        queue.pop_front();
-        out << (node == NULL ? "0" : "1");
-        if (node == NULL)
-            continue;
-        for (int i = 0; i < 8; ++i)
-            queue.push_back(node->children[i]);
+        next_level.clear();
+        for (std::size_t i = 0; i < level.size(); ++i)
+        {
+            Octree::Node const* node = level[i];
+            if (depth == max_level)
+            {
+                masks.push_back(0);
+                continue;
+            }
+            masks.push_back(node->child_mask);
+            for (int j = 0; j < 8; ++j)
+                if (node->has_child(j))
+                    next_level.push_back(this->get_child(node, j));
+        }
+        std::swap(level, next_level);
     }
+
+    uint64_t const num_masks = masks.size();
+    out.put(FSSR_OCTREE_PACKED_HIERARCHY_ID);
+    out.write(reinterpret_cast<char const*>(&num_masks), sizeof(uint64_t));
+    if (!masks.empty())
+        out.write(reinterpret_cast<char const*>(&masks[0]), masks.size());
 }
 
 void
 Octree::read_hierarchy (std::istream& in, bool with_meta)
 {
     /* Clear octree. */
-    delete this->root;
-    this->root = NULL;
-    this->num_nodes = 0;
-    this->num_samples = 0;
+    this->clear();
 
     if (with_meta)
     {
@@ -473,13 +1287,20 @@ Octree::read_hierarchy (std::istream& in, bool with_meta)
             sizeof(double));
     }
 
+    if (in.peek() == FSSR_OCTREE_PACKED_HIERARCHY_ID)
+    {
+        this->read_packed_hierarchy(in, NULL);
+        return;
+    }
+
+    /* Legacy hierarchy with one character for every child slot. */
     std::list<Octree::Node*> queue;
 
     char byte;
     in >> byte;
     if (byte == '1')
     {
-        this->root = new Octree::Node();
+        this->root = this->arena.get_node(8 * this->arena.allocate_block());
         queue.push_back(this->root);
     }
 
@@ -491,14 +1312,55 @@ Octree::read_hierarchy (std::istream& in, bool with_meta)
         {
             in >> byte;
             if (byte == '1')
-            {
-                node->children[i] = new Octree::Node();
-                queue.push_back(node->children[i]);
-            }
+                queue.push_back(this->create_child(node, i));
         }
     }
 }
 
+void
+Octree::read_packed_hierarchy (std::istream& in, Node* node)
+{
+    in.ignore(1);
+    uint64_t num_masks = 0;
+    in.read(reinterpret_cast<char*>(&num_masks), sizeof(uint64_t));
+    std::vector<uint8_t> masks(num_masks);
+    if (num_masks > 0)
+        in.read(reinterpret_cast<char*>(&masks[0]), num_masks);
+    if (!in)
+        throw std::runtime_error("Truncated octree hierarchy");
+    if (num_masks == 0 && node == NULL)
+        return;
+
+    /* Without a node, the hierarchy is read into a new root. */
+    std::vector<Octree::Node*> level;
+    std::vector<Octree::Node*> next_level;
+    if (node == NULL)
+        node = this->root = this->arena.get_node(
+            8 * this->arena.allocate_block());
+    level.push_back(node);
+    std::size_t num_read = 0;
+    while (!level.empty())
+    {
+        if (num_read + level.size() > masks.size())
+            throw std::runtime_error("Invalid octree hierarchy");
+        next_level.clear();
+        for (std::size_t i = 0; i < level.size(); ++i)
+        {
+            uint8_t const mask = masks[num_read++];
+            for (int j = 0; j < 8; ++j)
+                if (mask & (1 << j))
+                    next_level.push_back(this->create_child(level[i], j));
+        }
+        std::swap(level, next_level);
+    }
+    if (num_read != masks.size())
+        throw std::runtime_error("Invalid octree hierarchy");
+    if (node == this->root)
+        this->num_nodes = num_read;
+    else
+        this->num_nodes += num_read - 1;
+}
+
 void
 Octree::octree_to_mesh (mve::TriangleMesh::Ptr mesh,
     Node const* node, NodeGeom const& node_geom)
@@ -510,10 +1372,11 @@ Octree::octree_to_mesh (mve::TriangleMesh::Ptr mesh,
     bool is_leaf = true;
     for (int i = 0; i < 8; ++i)
     {
-        if (node->children[i] == NULL)
+        if (!node->has_child(i))
             continue;
         is_leaf = false;
-        this->octree_to_mesh(mesh, node->children[i], node_geom.descend(i));
+        this->octree_to_mesh(mesh, this->get_child(node, i),
+            node_geom.descend(i));
     }
 
     if (!is_leaf)
@@ -564,12 +1427,22 @@ Octree::child_center_for_octant (math::Vec3d const& old_center,
     return new_center;
 }
 
+std::size_t
+Octree::get_memory_usage (void) const
+{
+    return this->arena.get_memory_usage()
+        + this->samples.capacity() * sizeof(Sample)
+        + this->sample_links.capacity() * sizeof(uint32_t);
+}
+
 void
 Octree::print_stats (std::ostream& out)
 {
     out << "Octree contains " << this->get_num_samples()
         << " samples in " << this->get_num_nodes() << " nodes on "
         << this->get_num_levels() << " levels." << std::endl;
+    out << "Memory usage: " << this->get_memory_usage() / (1 << 20)
+        << " MB for nodes and samples." << std::endl;
 
     std::vector<std::size_t> octree_stats;
     this->get_points_per_level(&octree_stats);
@@ -7,6 +7,7 @@
 #define FSSR_OCTREE_HEADER
 
 #include <stdint.h>  // TODO: Use <cstdint> once C++11 is standard.
+#include <algorithm>
 #include <vector>
 #include <string>
 
@@ -16,23 +17,104 @@
 #include "fssr/sample.h"
 #include "fssr/pointset.h"
 
+/* Number of index bits for nodes within one chunk of the node arena. */
+#define FSSR_NODE_ARENA_CHUNK_BITS 14
+/* Number of index bits for samples within one chunk of the insertion log. */
+#define FSSR_OCTREE_LOG_CHUNK_BITS 16
+/* Marker byte of the packed hierarchy, the legacy one starts with 0 or 1. */
+#define FSSR_OCTREE_PACKED_HIERARCHY_ID 'P'
+
 FSSR_NAMESPACE_BEGIN
 
 class Octree
 {
 public:
     /**
-     * Simple recursive octree node that stores samples in a vector.
+     * Compact octree node without pointers. The eight children of a node
+     * are allocated as one contiguous block of siblings in the node arena,
+     * and the node stores the index of this block and a bit mask of the
+     * existing children. The samples of a node are stored in the global
+     * sample array of the octree. After Octree::finalize(), the samples of
+     * a node are the contiguous range starting at 'first_sample'. Before,
+     * 'first_sample' is the index of the most recently inserted sample, and
+     * older samples are chained through the sample links. Use
+     * Octree::get_child() to access the children.
      */
     struct Node
     {
     public:
         Node (void);
-        virtual ~Node (void);
+        bool is_leaf (void) const;
+        bool has_child (int octant) const;
 
     public:
-        Node* children[8];
-        std::vector<Sample> samples;
+        /* Index of the block of children, only valid with children. */
+        uint32_t first_child;
+        /* Index of the first (or latest) sample, only valid with samples. */
+        uint32_t first_sample;
+        uint32_t num_samples;
+        /* Bit 'i' is set if child 'i' exists. */
+        uint8_t child_mask;
+    };
+
+    /**
+     * Allocates nodes in blocks of eight siblings from large chunks of
+     * memory and maps 32 bit node indices to nodes. Nodes are never freed
+     * individually, all nodes are destroyed at once when the arena is
+     * cleared. Blocks are allocated through cursors which reserve whole
+     * chunks; using one cursor per thread allows parallel allocation.
+     * Cursors are acquired from and released to the arena, which keeps
+     * the remaining blocks of released cursors for later use.
+     * Block 0 is never allocated, so index 0 can be used as "no block".
+     */
+    class NodeArena
+    {
+    public:
+        /** Range of blocks reserved for exclusive use by one thread. */
+        struct Cursor
+        {
+            Cursor (void);
+            uint32_t next_block;
+            uint32_t end_block;
+        };
+
+    public:
+        NodeArena (void);
+        ~NodeArena (void);
+
+        /** Returns the node with the given index. */
+        Node* get_node (uint32_t index);
+        Node const* get_node (uint32_t index) const;
+        /** Returns the index of a new block using the default cursor. */
+        uint32_t allocate_block (void);
+        /** Returns the index of a new block using the given cursor. */
+        uint32_t allocate_block (Cursor* cursor);
+        /** Returns the index of a new block. This is thread-safe. */
+        uint32_t allocate_block_concurrent (void);
+        /** Returns a released cursor, or an empty one. Thread-safe. */
+        Cursor acquire_cursor (void);
+        /** Keeps the remaining blocks of the cursor. Thread-safe. */
+        void release_cursor (Cursor const& cursor);
+        /** Destroys all nodes allocated from the arena. */
+        void clear (void);
+        /** Returns the amount of memory allocated for nodes in bytes. */
+        std::size_t get_memory_usage (void) const;
+
+    private:
+        /* Not copyable. */
+        NodeArena (NodeArena const& other);
+        NodeArena& operator= (NodeArena const& other);
+
+        void allocate_chunk (Cursor* cursor);
+
+    private:
+        std::vector<Node*> chunks;
+        std::size_t num_chunks;
+        Cursor cursor;
+        /* Released cursors with remaining blocks. */
+        std::vector<Cursor> free_cursors;
+        /* Shared cursor, next block in the low and end in the high bits. */
+        uint64_t shared_cursor;
     };
 
     /**
@@ -79,6 +161,7 @@ public:
         Octree::Node const* node;
         Octree::NodeGeom node_geom;
         Octree::NodePath node_path;
+        Octree const* octree;
 
         Iterator (void);
         Iterator (Octree const* octree);
@@ -91,6 +174,16 @@ public:
     virtual ~Octree (void);
     void clear (void);
 
+    /**
+     * Initializes the root node of an empty octree from the bounding box
+     * of the samples and the largest sample scale. The root is allocated
+     * once at its final size, i.e. inserting samples within the bounding
+     * box never expands the root, and the root does not depend on the
+     * order of insertion. Calling this function is optional.
+     */
+    void init_root (math::Vec3d const& aabb_min,
+        math::Vec3d const& aabb_max, double max_scale);
+
     /**
      * Inserts a single sample into the Octree.
      * The scale information is used to determine the level based on the
@@ -100,18 +193,54 @@ public:
     void insert_sample (Sample const& s);
 
     /**
-     * Inserts all samples from the point set into the octree.
+     * Enables or disables concurrent insertion. While enabled,
+     * insert_sample() is thread-safe and can be called from several
+     * producer threads. Nodes and samples are added without locks, only
+     * the allocation of a new node or sample chunk takes a short lock.
+     * No other function may be called until concurrent insertion is
+     * disabled again. The root must be initialized with init_root()
+     * before, and because the root cannot be expanded, samples outside
+     * the root or with too large scale are rejected and counted, see
+     * get_num_rejected_samples(). If the sample index overflows, the
+     * remaining samples are rejected and disabling concurrent insertion
+     * throws. The order of samples within a node is unspecified.
+     */
+    void set_concurrent_insertion (bool enable);
+
+    /**
+     * Inserts all samples from the point set into the octree. The result
+     * is identical to inserting the samples one by one, but the octree is
+     * built in bulk: The target node of every sample is computed in
+     * parallel, samples are sorted in depth-first node order, and subtrees
+     * are populated in parallel from the sorted runs of samples. With
+     * concurrent insertion enabled, samples are inserted one by one.
      */
     void insert_samples (PointSet const& pset);
 
+    /**
+     * Packs the samples of all nodes into one contiguous array, ordered by
+     * node in depth-first traversal order. Queries then stream through the
+     * samples of a node. Inserting samples afterwards is supported, but
+     * undoes the packing until the octree is finalized again.
+     */
+    void finalize (void);
+
+    /** Returns true if the samples are packed, see finalize(). */
+    bool is_finalized (void) const;
+
     /** Returns the number of samples in the octree. */
     std::size_t get_num_samples (void) const;
+    /** Returns the number of samples rejected by concurrent insertion. */
+    std::size_t get_num_rejected_samples (void) const;
 
     /**
      * Returns the number of nodes in the octree.
      */
     std::size_t get_num_nodes (void) const;
 
+    /** Returns the memory allocated for nodes and samples in bytes. */
+    std::size_t get_memory_usage (void) const;
+
     /**
      * Returns the number of levels (WARNING: traverses whole tree).
      * For an empty octree (without any nodes), this returns 0. For
@@ -129,6 +258,24 @@ public:
     /** Returns the root node (read-only). */
     Node const* get_root_node (void) const;
 
+    /** Returns the child of the node, or NULL if the child does not exist. */
+    Node const* get_child (Node const* node, int octant) const;
+
+    /**
+     * Returns the sample storage. If the octree is finalized, the samples
+     * of a node are at indices first_sample to first_sample + num_samples,
+     * and the ranges are in depth-first node order. This is the order in
+     * which the influence queries return samples.
+     */
+    std::vector<Sample> const& get_samples (void) const;
+
+    /**
+     * Appends the samples of the node. Samples are in insertion order if
+     * the octree is finalized, and most recently inserted first otherwise.
+     */
+    void get_node_samples (Node const* node,
+        std::vector<Sample const*>* result) const;
+
     /** Returns the center of the root node. */
     math::Vec3d const& get_root_node_center (void) const;
 
@@ -151,6 +298,16 @@ public:
     void influence_query (math::Vec3d const& pos, double factor,
         std::vector<Sample const*>* result) const;
 
+    /**
+     * Queries all samples that influence any point in the given axis
+     * aligned box. The result is conservative and contains all samples
+     * returned by the point query for any point in the box, in the same
+     * order as the point query returns them.
+     */
+    void influence_query (math::Vec3d const& aabb_min,
+        math::Vec3d const& aabb_max, double factor,
+        std::vector<Sample const*>* result) const;
+
     /**
      * Queries all nodes that are influenced by the given sample.
      * The result is an approximation, i.e. some nodes may not actually
@@ -178,12 +335,25 @@ public:
     /**
      * Writes the octree hierarchy to stream.
      * This does NOT write the sample data, just the hierarchy.
+     * The hierarchy is packed as one child mask byte per node in
+     * breadth-first order, preceded by a marker byte and the node count.
+     * If 'max_level' is not negative, nodes on this level are written
+     * as leaves, and their subtrees can be written separately.
      */
-    void write_hierarchy (std::ostream& out, bool with_meta = true) const;
+    void write_hierarchy (std::ostream& out, bool with_meta = true,
+        int max_level = -1) const;
+
+    /** Writes the packed hierarchy of the subtree rooted at the node. */
+    void write_subtree_hierarchy (std::ostream& out,
+        NodePath const& path) const;
+
+    /** Reads the packed hierarchy of a subtree into the leaf node. */
+    void read_subtree_hierarchy (std::istream& in, NodePath const& path);
 
     /**
      * Reads the hierarchy from stream and builds the octree.
      * This des NOT read the sample data, just the hierarchy.
+     * Both the packed and the legacy ASCII hierarchy can be read.
      */
     void read_hierarchy (std::istream& in, bool with_meta = true);
 
@@ -199,6 +369,14 @@ public:
 
 private:
     /* Octree functions. */
+    Node* get_child (Node* node, int octant);
+    Node* create_child (Node* node, int octant,
+        NodeArena::Cursor* cursor = NULL);
+    void add_sample_to_node (Node* node, uint32_t index);
+    bool insert_sample_concurrent (Sample const& s);
+    Node* create_child_concurrent (Node* node, int octant);
+    void unpack_samples (void);
+    void get_nodes_depth_first (std::vector<Node*>* result);
     bool is_inside_octree (math::Vec3d const& pos);
     void expand_root_for_point (math::Vec3d const& pos);
     Node* find_node_for_sample (Sample const& sample);
@@ -207,15 +385,26 @@ private:
     Node* find_node_descend (Sample const& sample, Node* node,
         NodeGeom const& node_geom);
     Node* find_node_expand (Sample const& sample);
+    std::size_t insert_sorted_samples (PointSet const& pset, Node* node,
+        int level, std::pair<uint64_t, std::size_t> const* keys,
+        std::size_t num_keys, std::size_t first_index,
+        NodeArena::Cursor* cursor);
     int get_num_levels (Node const* node) const;
     void get_points_per_level (std::vector<std::size_t>* stats,
         Node const* node, std::size_t level) const;
     void influence_query (math::Vec3d const& pos, double factor,
         std::vector<Sample const*>* result,
         Node const* node, NodeGeom const& node_geom) const;
+    void influence_query (math::Vec3d const& aabb_min,
+        math::Vec3d const& aabb_max, double factor,
+        std::vector<Sample const*>* result,
+        Node const* node, NodeGeom const& node_geom) const;
     void influenced_query (Sample const& sample, double factor,
         std::vector<Iterator>* result, Iterator const& iter);
     void make_regular_octree (Node* node);
+    void write_packed_hierarchy (std::ostream& out, Node const* root,
+        int max_level) const;
+    void read_packed_hierarchy (std::istream& in, Node* node);
 
     /* Debugging functions. */
     void octree_to_mesh (mve::TriangleMesh::Ptr mesh,
@@ -227,6 +416,26 @@ private:
     /* The number of nodes in the octree (inner nodes plus leafs). */
     std::size_t num_nodes;
 
+    /* The arena that owns all nodes. */
+    NodeArena arena;
+
+    /* All samples, the samples of a node are chained through the links. */
+    std::vector<Sample> samples;
+    std::vector<uint32_t> sample_links;
+    /* Samples are packed per node and no links are used. */
+    bool samples_packed;
+
+    /*
+     * Samples inserted concurrently are appended to chunks with stable
+     * addresses and moved to the sample array when insertion is done.
+     */
+    bool concurrent_insertion;
+    std::vector<Sample*> log_samples;
+    std::vector<uint32_t*> log_links;
+    uint32_t log_size;
+    bool log_overflow;
+    std::size_t num_rejected_samples;
+
     /* The root node with its center and side length. */
     Node* root;
     math::Vec3d root_center;
@@ -237,15 +446,80 @@ private:
 
 inline
 Octree::Node::Node (void)
+    : first_child(0)
+    , first_sample(0)
+    , num_samples(0)
+    , child_mask(0)
+{
+}
+
+inline bool
+Octree::Node::is_leaf (void) const
+{
+    return this->child_mask == 0;
+}
+
+inline bool
+Octree::Node::has_child (int octant) const
 {
-    std::fill(this->children, this->children + 8, (Octree::Node*)NULL);
+    return this->child_mask & (1 << octant);
 }
 
+/* ---------------------------------------------------------------- */
+
 inline
-Octree::Node::~Node (void)
+Octree::NodeArena::Cursor::Cursor (void)
+    : next_block(0)
+    , end_block(0)
 {
-    for (int i = 0; i < 8; ++i)
-        delete this->children[i];
+}
+
+inline
+Octree::NodeArena::NodeArena (void)
+    : num_chunks(0)
+    , shared_cursor(0)
+{
+}
+
+inline
+Octree::NodeArena::~NodeArena (void)
+{
+    this->clear();
+}
+
+inline Octree::Node*
+Octree::NodeArena::get_node (uint32_t index)
+{
+    return this->chunks[index >> FSSR_NODE_ARENA_CHUNK_BITS]
+        + (index & ((1u << FSSR_NODE_ARENA_CHUNK_BITS) - 1));
+}
+
+inline Octree::Node const*
+Octree::NodeArena::get_node (uint32_t index) const
+{
+    return this->chunks[index >> FSSR_NODE_ARENA_CHUNK_BITS]
+        + (index & ((1u << FSSR_NODE_ARENA_CHUNK_BITS) - 1));
+}
+
+inline uint32_t
+Octree::NodeArena::allocate_block (void)
+{
+    return this->allocate_block(&this->cursor);
+}
+
+inline uint32_t
+Octree::NodeArena::allocate_block (Cursor* cursor)
+{
+    if (cursor->next_block == cursor->end_block)
+        this->allocate_chunk(cursor);
+    return cursor->next_block++;
+}
+
+inline std::size_t
+Octree::NodeArena::get_memory_usage (void) const
+{
+    return this->num_chunks * sizeof(Node)
+        * (std::size_t(1) << FSSR_NODE_ARENA_CHUNK_BITS);
 }
 
 /* ---------------------------------------------------------------- */
@@ -288,7 +562,13 @@ Octree::Octree (void)
 inline
 Octree::~Octree (void)
 {
-    delete this->root;
+    this->clear();
+}
+
+inline bool
+Octree::is_finalized (void) const
+{
+    return this->samples_packed;
 }
 
 inline std::size_t
@@ -297,6 +577,12 @@ Octree::get_num_samples (void) const
     return this->num_samples;
 }
 
+inline std::size_t
+Octree::get_num_rejected_samples (void) const
+{
+    return this->num_rejected_samples;
+}
+
 inline std::size_t
 Octree::get_num_nodes (void) const
 {
@@ -322,6 +608,12 @@ Octree::get_root_node (void) const
     return this->root;
 }
 
+inline std::vector<Sample> const&
+Octree::get_samples (void) const
+{
+    return this->samples;
+}
+
 inline math::Vec3d const&
 Octree::get_root_node_center (void) const
 {
@@ -343,6 +635,16 @@ Octree::influence_query (math::Vec3d const& pos, double factor,
         this->get_node_geom_for_root());
 }
 
+inline void
+Octree::influence_query (math::Vec3d const& aabb_min,
+    math::Vec3d const& aabb_max, double factor,
+    std::vector<Sample const*>* result) const
+{
+    result->resize(0);
+    this->influence_query(aabb_min, aabb_max, factor, result, this->root,
+        this->get_node_geom_for_root());
+}
+
 inline void
 Octree::influenced_query (Sample const& sample, double factor,
     std::vector<Iterator>* result)
@@ -358,6 +660,22 @@ Octree::make_regular_octree (void)
     this->make_regular_octree(this->root);
 }
 
+inline Octree::Node const*
+Octree::get_child (Node const* node, int octant) const
+{
+    if (!node->has_child(octant))
+        return NULL;
+    return this->arena.get_node(node->first_child * 8 + octant);
+}
+
+inline Octree::Node*
+Octree::get_child (Node* node, int octant)
+{
+    if (!node->has_child(octant))
+        return NULL;
+    return this->arena.get_node(node->first_child * 8 + octant);
+}
+
 inline Octree::NodeGeom
 Octree::get_node_geom_for_root (void) const
 {
@@ -0,0 +1,517 @@
+/*
+ * This file is part of the Floating Scale Surface Reconstruction software.
+ * Written by Simon Fuhrmann.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <stdexcept>
+#include <streambuf>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "fssr/octree_file.h"
+
+FSSR_NAMESPACE_BEGIN
+
+namespace
+{
+    /* Stream buffer to read from memory without copying it. */
+    class MemoryBuffer : public std::streambuf
+    {
+    public:
+        MemoryBuffer (char const* data, std::size_t size)
+        {
+            char* begin = const_cast<char*>(data);
+            this->setg(begin, begin, begin + size);
+        }
+    };
+
+    /* Voxels are stored as arrays of the in-memory layout. */
+    typedef char VoxelIndexSizeCheck[sizeof(VoxelIndex)
+        == sizeof(uint64_t) ? 1 : -1];
+    typedef char VoxelDataSizeCheck[sizeof(VoxelData)
+        == 6 * sizeof(float) ? 1 : -1];
+
+    /* Size of a block record header: Voxel count and payload size. */
+    std::size_t const BLOCK_HEADER_SIZE = 2 * sizeof(uint32_t);
+
+    /* Number of float channels per voxel. */
+    int const NUM_CHANNELS = 6;
+
+    bool
+    is_valid_range (uint64_t offset, uint64_t size, std::size_t file_size)
+    {
+        return offset <= file_size && size <= file_size - offset;
+    }
+
+    bool
+    is_valid_section (uint64_t offset, uint64_t size, std::size_t file_size)
+    {
+        return offset % FSSR_OCTREE_CONTAINER_ALIGNMENT == 0
+            && is_valid_range(offset, size, file_size);
+    }
+
+    /* Extracts the tile coordinate on the axis from the tile key. */
+    int
+    get_tile_coord (uint64_t key, int tile_level, int axis)
+    {
+        int coord = 0;
+        for (int l = 0; l < tile_level; ++l)
+            coord |= static_cast<int>((key >> (3 * l + axis)) & 1) << l;
+        return coord;
+    }
+
+    float*
+    get_channel (VoxelData* data, int channel)
+    {
+        switch (channel)
+        {
+            case 0: return &data->value;
+            case 1: return &data->conf;
+            case 2: return &data->scale;
+            default: return &data->color[channel - 3];
+        }
+    }
+
+    float const*
+    get_channel (VoxelData const* data, int channel)
+    {
+        return get_channel(const_cast<VoxelData*>(data), channel);
+    }
+
+    void
+    put_varint (uint64_t value, std::vector<unsigned char>* out)
+    {
+        while (value >= 0x80)
+        {
+            out->push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+        out->push_back(static_cast<unsigned char>(value));
+    }
+
+    bool
+    get_varint (unsigned char const** ptr, unsigned char const* end,
+        uint64_t* value)
+    {
+        *value = 0;
+        for (int shift = 0; shift < 64 && *ptr < end; shift += 7)
+        {
+            unsigned char const byte = *(*ptr)++;
+            *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return true;
+        }
+        return false;
+    }
+}
+
+uint64_t
+get_tile_key (VoxelIndex const& index, int tile_level)
+{
+    uint32_t const max_coord = (1u << tile_level) - 1;
+    uint32_t const coords[3] = {
+        std::min(index.get_offset_x() >> (20 - tile_level), max_coord),
+        std::min(index.get_offset_y() >> (20 - tile_level), max_coord),
+        std::min(index.get_offset_z() >> (20 - tile_level), max_coord) };
+
+    uint64_t key = 0;
+    for (int l = tile_level - 1; l >= 0; --l)
+    {
+        key <<= 3;
+        for (int i = 0; i < 3; ++i)
+            key |= static_cast<uint64_t>((coords[i] >> l) & 1) << i;
+    }
+    return key;
+}
+
+void
+encode_voxel_block (VoxelIndex const* indices, VoxelData const* data,
+    std::size_t num_voxels, int level, std::vector<char>* buffer)
+{
+    if (level < 1 || level > 9)
+        throw std::invalid_argument("Invalid compression level");
+
+    /* Delta-code the indices, unsorted indices wrap around. */
+    std::vector<unsigned char> payload;
+    payload.reserve(num_voxels * (3 + NUM_CHANNELS * sizeof(float)));
+    uint64_t previous = 0;
+    for (std::size_t i = 0; i < num_voxels; ++i)
+    {
+        put_varint(indices[i].index - previous, &payload);
+        previous = indices[i].index;
+    }
+
+    /* Byte-shuffle the channels to group the similar high bytes. */
+    std::size_t const offset = payload.size();
+    payload.resize(offset + num_voxels * NUM_CHANNELS * sizeof(float));
+    for (int c = 0; c < NUM_CHANNELS; ++c)
+        for (std::size_t i = 0; i < num_voxels; ++i)
+        {
+            unsigned char bytes[sizeof(float)];
+            std::memcpy(bytes, get_channel(data + i, c), sizeof(float));
+            for (std::size_t b = 0; b < sizeof(float); ++b)
+                payload[offset + (c * sizeof(float) + b) * num_voxels + i]
+                    = bytes[b];
+        }
+
+    uLongf size = ::compressBound(payload.size());
+    buffer->resize(BLOCK_HEADER_SIZE + size);
+    if (::compress2(reinterpret_cast<Bytef*>(&(*buffer)[BLOCK_HEADER_SIZE]),
+        &size, payload.empty() ? NULL : &payload[0], payload.size(), level)
+        != Z_OK)
+        throw std::runtime_error("Error compressing voxel block");
+    buffer->resize(BLOCK_HEADER_SIZE + size);
+
+    uint32_t const block_header[2] = { static_cast<uint32_t>(num_voxels),
+        static_cast<uint32_t>(payload.size()) };
+    std::memcpy(&(*buffer)[0], block_header, BLOCK_HEADER_SIZE);
+}
+
+bool
+MappedOctreeFile::is_container (std::string const& filename)
+{
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    if (!in)
+        throw std::runtime_error(::strerror(errno));
+
+    std::size_t const file_id_size = std::strlen(FSSR_OCTREE_CONTAINER_ID);
+    char file_id[sizeof(FSSR_OCTREE_CONTAINER_ID)];
+    in.read(file_id, file_id_size);
+    return in.good() && std::memcmp(file_id, FSSR_OCTREE_CONTAINER_ID,
+        file_id_size) == 0;
+}
+
+void
+MappedOctreeFile::map (std::string const& filename)
+{
+    this->close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(::strerror(errno));
+
+    struct stat stats;
+    if (::fstat(fd, &stats) < 0)
+    {
+        ::close(fd);
+        throw std::runtime_error(::strerror(errno));
+    }
+
+    std::size_t const file_size = stats.st_size;
+    if (file_size < sizeof(OctreeFileHeader))
+    {
+        ::close(fd);
+        throw std::runtime_error("Unexpected end of octree file");
+    }
+
+    void* ptr = ::mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error(::strerror(errno));
+    this->mapped_file = static_cast<char*>(ptr);
+    this->mapped_size = file_size;
+
+    /* Validate the header and the sections before exposing any data. */
+    OctreeFileHeader& header = this->header;
+    std::memcpy(&header, this->mapped_file, sizeof(header));
+    std::size_t const file_id_size = std::strlen(FSSR_OCTREE_CONTAINER_ID);
+    if (std::memcmp(header.file_id, FSSR_OCTREE_CONTAINER_ID, file_id_size))
+    {
+        this->close();
+        throw std::runtime_error("Invalid file indentifier");
+    }
+    if (header.version != FSSR_OCTREE_CONTAINER_VERSION)
+    {
+        this->close();
+        throw std::runtime_error("Unsupported octree file version");
+    }
+    if (header.header_size < sizeof(header)
+        || header.header_size > file_size)
+    {
+        this->close();
+        throw std::runtime_error("Invalid octree file header");
+    }
+
+    bool valid = is_valid_section(header.hierarchy_offset,
+        header.hierarchy_size, file_size);
+    if (header.encoding == OCTREE_ENCODING_ARRAYS)
+    {
+        uint64_t const max_voxels = file_size / sizeof(VoxelData);
+        valid = valid && header.num_voxels <= max_voxels
+            && is_valid_section(header.index_offset,
+                header.num_voxels * sizeof(VoxelIndex), file_size)
+            && is_valid_section(header.data_offset,
+                header.num_voxels * sizeof(VoxelData), file_size);
+    }
+    else if (header.encoding == OCTREE_ENCODING_BLOCKS)
+    {
+        uint64_t const max_blocks = file_size / sizeof(uint64_t);
+        valid = valid && header.block_size > 0
+            && header.num_blocks < max_blocks
+            && is_valid_section(header.block_table_offset,
+                (header.num_blocks + 1) * sizeof(uint64_t), file_size);
+    }
+    else
+        valid = false;
+
+    uint64_t const max_tiles = file_size / sizeof(OctreeFileTile);
+    valid = valid
+        && header.tile_level <= FSSR_OCTREE_CONTAINER_MAX_TILE_LEVEL
+        && header.num_tiles <= max_tiles
+        && is_valid_section(header.tile_table_offset,
+            header.num_tiles * sizeof(OctreeFileTile), file_size);
+    if (valid)
+    {
+        OctreeFileTile const* table = reinterpret_cast<OctreeFileTile
+            const*>(this->mapped_file + header.tile_table_offset);
+        this->tiles.assign(table, table + header.num_tiles);
+    }
+
+    /* The tiles must partition the voxels and blocks in key order. */
+    uint64_t const max_key = uint64_t(1) << (3 * header.tile_level);
+    uint64_t num_voxels = 0;
+    uint64_t num_blocks = 0;
+    for (std::size_t i = 0; valid && i < this->tiles.size(); ++i)
+    {
+        OctreeFileTile const& tile = this->tiles[i];
+        uint64_t const tile_blocks = (header.encoding
+            == OCTREE_ENCODING_ARRAYS) ? 0 : (tile.num_voxels
+            + header.block_size - 1) / header.block_size;
+        valid = tile.key < max_key
+            && (i == 0 || this->tiles[i - 1].key < tile.key)
+            && tile.first_voxel == num_voxels
+            && tile.num_voxels <= header.num_voxels - num_voxels
+            && tile.first_block == num_blocks
+            && tile.num_blocks == tile_blocks
+            && is_valid_range(tile.hierarchy_offset, tile.hierarchy_size,
+                file_size);
+        num_voxels += tile.num_voxels;
+        num_blocks += tile.num_blocks;
+        for (uint64_t j = 0; valid && j < tile.num_blocks; ++j)
+            this->block_begins.push_back(tile.first_voxel
+                + j * header.block_size);
+    }
+    this->block_begins.push_back(num_voxels);
+    valid = valid && num_voxels == header.num_voxels
+        && num_blocks == header.num_blocks;
+
+    if (!valid)
+    {
+        this->close();
+        throw std::runtime_error("Invalid or truncated octree file");
+    }
+}
+
+void
+MappedOctreeFile::close (void)
+{
+    if (this->mapped_file != NULL)
+        ::munmap(this->mapped_file, this->mapped_size);
+    this->mapped_file = NULL;
+    this->mapped_size = 0;
+    std::memset(&this->header, 0, sizeof(this->header));
+    this->tiles.clear();
+    this->block_begins.clear();
+}
+
+void
+MappedOctreeFile::read_hierarchy (Octree* octree) const
+{
+    this->read_top_hierarchy(octree);
+    for (std::size_t i = 0; i < this->tiles.size(); ++i)
+        this->read_tile_hierarchy(i, octree);
+}
+
+void
+MappedOctreeFile::read_tile_hierarchy (std::size_t tile,
+    Octree* octree) const
+{
+    OctreeFileTile const& entry = this->tiles[tile];
+    if (entry.hierarchy_size == 0)
+        return;
+
+    Octree::NodePath path;
+    path.path = entry.key;
+    path.level = this->header.tile_level;
+    MemoryBuffer buffer(this->mapped_file + entry.hierarchy_offset,
+        entry.hierarchy_size);
+    std::istream in(&buffer);
+    octree->read_subtree_hierarchy(in, path);
+    if (!in)
+        throw std::runtime_error("Invalid octree hierarchy");
+}
+
+void
+MappedOctreeFile::find_tiles (Octree const& octree,
+    math::Vec3d const& aabb_min, math::Vec3d const& aabb_max, int border,
+    std::vector<std::size_t>* tiles) const
+{
+    tiles->clear();
+
+    /* Range of tile coordinates, extended by the border on each side. */
+    int const max_coord = (1 << this->header.tile_level) - 1;
+    double const tile_size = octree.get_root_node_size()
+        / (1 << this->header.tile_level);
+    math::Vec3d const root_min = octree.get_root_node_center()
+        - octree.get_root_node_size() / 2.0;
+    int range[3][2];
+    for (int i = 0; i < 3; ++i)
+    {
+        double const lower = (aabb_min[i] - root_min[i]) / tile_size
+            - border;
+        double const upper = (aabb_max[i] - root_min[i]) / tile_size
+            + border;
+        if (aabb_min[i] > aabb_max[i] || upper < 0.0
+            || lower >= max_coord + 1.0)
+            return;
+        range[i][0] = std::max(0, static_cast<int>(std::floor(lower)));
+        range[i][1] = std::min(max_coord, static_cast<int>(std::floor(upper)));
+    }
+
+    for (std::size_t i = 0; i < this->tiles.size(); ++i)
+    {
+        bool inside = true;
+        for (int j = 0; inside && j < 3; ++j)
+        {
+            int const coord = get_tile_coord(this->tiles[i].key,
+                this->header.tile_level, j);
+            inside = coord >= range[j][0] && coord <= range[j][1];
+        }
+        if (inside)
+            tiles->push_back(i);
+    }
+}
+
+void
+MappedOctreeFile::decode_tile (std::size_t tile, VoxelIndex* indices,
+    VoxelData* data) const
+{
+    OctreeFileTile const& entry = this->tiles[tile];
+    if (!this->is_compressed())
+    {
+        std::copy(this->get_voxel_indices() + entry.first_voxel,
+            this->get_voxel_indices() + entry.first_voxel + entry.num_voxels,
+            indices);
+        std::copy(this->get_voxel_data() + entry.first_voxel,
+            this->get_voxel_data() + entry.first_voxel + entry.num_voxels,
+            data);
+        return;
+    }
+
+    for (std::size_t i = 0; i < entry.num_blocks; ++i)
+    {
+        std::size_t const block = entry.first_block + i;
+        std::size_t const offset = this->get_block_begin(block)
+            - entry.first_voxel;
+        this->decode_block(block, indices + offset, data + offset);
+    }
+}
+
+void
+MappedOctreeFile::read_top_hierarchy (Octree* octree) const
+{
+    MemoryBuffer buffer(this->mapped_file + this->header.hierarchy_offset,
+        this->header.hierarchy_size);
+    std::istream in(&buffer);
+    octree->read_hierarchy(in);
+    if (!in)
+        throw std::runtime_error("Invalid octree hierarchy");
+}
+
+void
+MappedOctreeFile::decode_block (std::size_t block, VoxelIndex* indices,
+    VoxelData* data) const
+{
+    uint64_t const* table = reinterpret_cast<uint64_t const*>(
+        this->mapped_file + this->header.block_table_offset);
+    uint64_t const begin = table[block];
+    uint64_t const end = table[block + 1];
+    if (begin > end || end > this->mapped_size
+        || end - begin < BLOCK_HEADER_SIZE)
+        throw std::runtime_error("Invalid voxel block");
+
+    uint32_t block_header[2];
+    std::memcpy(block_header, this->mapped_file + begin, BLOCK_HEADER_SIZE);
+    std::size_t const num_voxels = block_header[0];
+    std::size_t const min_payload_size = num_voxels
+        * (1 + NUM_CHANNELS * sizeof(float));
+    if (num_voxels != this->get_block_begin(block + 1)
+        - this->get_block_begin(block)
+        || block_header[1] < min_payload_size)
+        throw std::runtime_error("Invalid voxel block");
+
+    std::vector<unsigned char> payload(block_header[1]);
+    uLongf size = payload.size();
+    if (::uncompress(&payload[0], &size, reinterpret_cast<Bytef const*>(
+        this->mapped_file + begin + BLOCK_HEADER_SIZE),
+        end - begin - BLOCK_HEADER_SIZE) != Z_OK || size != payload.size())
+        throw std::runtime_error("Corrupt voxel block");
+
+    unsigned char const* ptr = &payload[0];
+    unsigned char const* ptr_end = ptr + payload.size();
+    uint64_t index = 0;
+    for (std::size_t i = 0; i < num_voxels; ++i)
+    {
+        uint64_t delta;
+        if (!get_varint(&ptr, ptr_end, &delta))
+            throw std::runtime_error("Corrupt voxel block");
+        index += delta;
+        indices[i].index = index;
+    }
+
+    if (static_cast<std::size_t>(ptr_end - ptr)
+        != num_voxels * NUM_CHANNELS * sizeof(float))
+        throw std::runtime_error("Corrupt voxel block");
+    for (int c = 0; c < NUM_CHANNELS; ++c)
+        for (std::size_t i = 0; i < num_voxels; ++i)
+        {
+            unsigned char bytes[sizeof(float)];
+            for (std::size_t b = 0; b < sizeof(float); ++b)
+                bytes[b] = ptr[(c * sizeof(float) + b) * num_voxels + i];
+            std::memcpy(get_channel(data + i, c), bytes, sizeof(float));
+        }
+}
+
+void
+MappedOctreeFile::decode_voxels (VoxelIndex* indices, VoxelData* data) const
+{
+    if (!this->is_compressed())
+    {
+        std::copy(this->get_voxel_indices(), this->get_voxel_indices()
+            + this->get_num_voxels(), indices);
+        std::copy(this->get_voxel_data(), this->get_voxel_data()
+            + this->get_num_voxels(), data);
+        return;
+    }
+
+    /* Exceptions cannot leave the parallel region, the first is kept. */
+    std::string error;
+#pragma omp parallel for schedule(dynamic)
+    for (std::size_t i = 0; i < this->get_num_blocks(); ++i)
+    {
+        std::size_t const first = this->get_block_begin(i);
+        try
+        {
+            this->decode_block(i, indices + first, data + first);
+        }
+        catch (std::exception& e)
+        {
+#pragma omp critical
+            if (error.empty())
+                error = e.what();
+        }
+    }
+    if (!error.empty())
+        throw std::runtime_error(error);
+}
+
+FSSR_NAMESPACE_END
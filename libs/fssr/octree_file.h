@@ -0,0 +1,292 @@
+/*
+ * This file is part of the Floating Scale Surface Reconstruction software.
+ * Written by Simon Fuhrmann.
+ */
+
+#ifndef FSSR_OCTREE_FILE_HEADER
+#define FSSR_OCTREE_FILE_HEADER
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdint.h>  // TODO: Use <cstdint> once C++11 is standard.
+
+#include "math/vector.h"
+#include "fssr/defines.h"
+#include "fssr/octree.h"
+#include "fssr/voxel.h"
+
+/* File identifier of the binary octree container. */
+#define FSSR_OCTREE_CONTAINER_ID "FSSR_OCTREE_BIN\n"
+/* Version of the binary octree container, the legacy format is 1. */
+#define FSSR_OCTREE_CONTAINER_VERSION 2
+/* Alignment of the sections in the binary octree container. */
+#define FSSR_OCTREE_CONTAINER_ALIGNMENT 64
+/* Number of voxels per block of the compressed voxel encoding. */
+#define FSSR_OCTREE_CONTAINER_BLOCK_SIZE 65536
+/* Maximum octree level of the spatial tiles. */
+#define FSSR_OCTREE_CONTAINER_MAX_TILE_LEVEL 10
+
+FSSR_NAMESPACE_BEGIN
+
+/** Encodings of the voxels in the binary octree container. */
+enum OctreeFileEncoding
+{
+    /* Arrays of voxel indices and voxel data, can be accessed mapped. */
+    OCTREE_ENCODING_ARRAYS = 0,
+    /* Independently compressed blocks of voxels. */
+    OCTREE_ENCODING_BLOCKS = 1
+};
+
+/**
+ * Header of the binary octree container. The header is followed by the
+ * sections at the given offsets: The octree hierarchy, as written by
+ * Octree::write_hierarchy(), the voxels and the tile table. All sections
+ * are aligned to FSSR_OCTREE_CONTAINER_ALIGNMENT bytes, all values are
+ * stored in native byte order.
+ *
+ * The octree is split into spatial tiles, which are the subtrees at
+ * 'tile_level'. The hierarchy section holds the octree down to the tile
+ * level, with the tile nodes as leaves. The hierarchies of the subtrees
+ * and the voxels are stored per tile, see OctreeFileTile, such that
+ * regions of the octree can be loaded without reading the other tiles.
+ * Voxels belong to the tile that contains them, voxels on the border of
+ * two tiles belong to the tile with the larger coordinate.
+ *
+ * With the array encoding, the voxels are stored as array of voxel
+ * indices (uint64_t) and array of voxel data (six floats per voxel).
+ *
+ * With the block encoding, the voxels are split into blocks of
+ * 'block_size' voxels, which are compressed independently. The block
+ * table holds the file offsets of all blocks and the end offset of the
+ * last block. Each block starts with the number of voxels and the size
+ * of the uncompressed payload (two uint32_t), followed by the payload
+ * compressed with zlib. The payload stores the voxel indices as varint
+ * deltas to the previous index, followed by the six float channels,
+ * each byte-shuffled, i.e. all first bytes, then all second bytes, etc.
+ */
+struct OctreeFileHeader
+{
+    char file_id[16];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t hierarchy_offset;
+    uint64_t hierarchy_size;
+    uint64_t num_voxels;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    uint32_t encoding;
+    uint32_t block_size;
+    uint64_t num_blocks;
+    uint64_t block_table_offset;
+    uint64_t num_tiles;
+    uint64_t tile_table_offset;
+    uint32_t tile_level;
+    uint32_t reserved;
+};
+
+/**
+ * Entry of the tile table. The tiles are sorted by key, which is the node
+ * path of the tile node. The voxels of a tile are contiguous and sorted
+ * by index, and with the block encoding stored in their own blocks. The
+ * hierarchy of a tile is the packed hierarchy of the tile node, and is
+ * empty if the tile contains voxels but no node.
+ */
+struct OctreeFileTile
+{
+    uint64_t key;
+    uint64_t hierarchy_offset;
+    uint64_t hierarchy_size;
+    uint64_t first_voxel;
+    uint64_t num_voxels;
+    uint64_t first_block;
+    uint64_t num_blocks;
+};
+
+/** Returns the key of the tile on the tile level containing the voxel. */
+uint64_t
+get_tile_key (VoxelIndex const& index, int tile_level);
+
+/**
+ * Encodes a block of voxels, sorted by index, for the block encoding.
+ * The compression level ranges from 1 (fastest) to 9 (smallest).
+ * The encoded block is stored in the buffer. This function is thread-safe.
+ */
+void
+encode_voxel_block (VoxelIndex const* indices, VoxelData const* data,
+    std::size_t num_voxels, int level, std::vector<char>* buffer);
+
+/**
+ * Read-only memory mapping of a binary octree container. With the array
+ * encoding, the voxel index and data arrays are accessed directly in the
+ * mapped file, the voxels are not parsed or copied. Compressed voxels
+ * are decoded on request. The octree hierarchy is read on request.
+ */
+class MappedOctreeFile
+{
+public:
+    MappedOctreeFile (void);
+    ~MappedOctreeFile (void);
+
+    /** Returns true if the file is a binary octree container. */
+    static bool is_container (std::string const& filename);
+
+    /** Maps the file into memory and validates header and sections. */
+    void map (std::string const& filename);
+    /** Unmaps the file. */
+    void close (void);
+    /** Returns true if a file is mapped. */
+    bool is_mapped (void) const;
+
+    /** Builds the octree hierarchy of all tiles stored in the file. */
+    void read_hierarchy (Octree* octree) const;
+    /** Builds the octree hierarchy down to the tile level. */
+    void read_top_hierarchy (Octree* octree) const;
+    /** Adds the hierarchy of the tile to the octree. */
+    void read_tile_hierarchy (std::size_t tile, Octree* octree) const;
+
+    /** Returns the octree level of the tiles. */
+    int get_tile_level (void) const;
+    /** Returns the number of tiles. */
+    std::size_t get_num_tiles (void) const;
+    /** Returns the tile table entry. */
+    OctreeFileTile const& get_tile (std::size_t tile) const;
+    /**
+     * Finds the tiles that intersect the bounding box, plus a border of
+     * the given number of tiles. The octree must contain the top hierarchy.
+     */
+    void find_tiles (Octree const& octree, math::Vec3d const& aabb_min,
+        math::Vec3d const& aabb_max, int border,
+        std::vector<std::size_t>* tiles) const;
+    /**
+     * Decodes or copies the voxels of the tile into the arrays, which must
+     * hold the voxels of the tile. This function is thread-safe.
+     */
+    void decode_tile (std::size_t tile, VoxelIndex* indices,
+        VoxelData* data) const;
+    /** Returns the number of voxels in the file. */
+    std::size_t get_num_voxels (void) const;
+    /** Returns true if the voxels are stored in compressed blocks. */
+    bool is_compressed (void) const;
+
+    /**
+     * Returns the array of voxel indices, sorted by index within tiles.
+     * This is only available for uncompressed files.
+     */
+    VoxelIndex const* get_voxel_indices (void) const;
+    /**
+     * Returns the array of voxel data, in the order of the indices.
+     * This is only available for uncompressed files.
+     */
+    VoxelData const* get_voxel_data (void) const;
+
+    /** Returns the number of compressed voxel blocks. */
+    std::size_t get_num_blocks (void) const;
+    /** Returns the index of the first voxel in the block. */
+    std::size_t get_block_begin (std::size_t block) const;
+    /**
+     * Decodes the voxels of a compressed block into the arrays, which
+     * must hold the voxels of the block. This function is thread-safe.
+     */
+    void decode_block (std::size_t block, VoxelIndex* indices,
+        VoxelData* data) const;
+    /**
+     * Decodes or copies all voxels into the arrays. Compressed blocks are
+     * decoded in parallel.
+     */
+    void decode_voxels (VoxelIndex* indices, VoxelData* data) const;
+
+private:
+    /* Not copyable. */
+    MappedOctreeFile (MappedOctreeFile const& other);
+    MappedOctreeFile& operator= (MappedOctreeFile const& other);
+
+private:
+    char* mapped_file;
+    std::size_t mapped_size;
+    OctreeFileHeader header;
+    std::vector<OctreeFileTile> tiles;
+    std::vector<uint64_t> block_begins;
+};
+
+/* ------------------------- Implementation ---------------------------- */
+
+inline
+MappedOctreeFile::MappedOctreeFile (void)
+    : mapped_file(NULL)
+    , mapped_size(0)
+{
+    std::memset(&this->header, 0, sizeof(this->header));
+}
+
+inline
+MappedOctreeFile::~MappedOctreeFile (void)
+{
+    this->close();
+}
+
+inline bool
+MappedOctreeFile::is_mapped (void) const
+{
+    return this->mapped_file != NULL;
+}
+
+inline std::size_t
+MappedOctreeFile::get_num_voxels (void) const
+{
+    return this->header.num_voxels;
+}
+
+inline bool
+MappedOctreeFile::is_compressed (void) const
+{
+    return this->header.encoding == OCTREE_ENCODING_BLOCKS;
+}
+
+inline std::size_t
+MappedOctreeFile::get_num_blocks (void) const
+{
+    return this->header.num_blocks;
+}
+
+inline std::size_t
+MappedOctreeFile::get_block_begin (std::size_t block) const
+{
+    return this->block_begins[block];
+}
+
+inline int
+MappedOctreeFile::get_tile_level (void) const
+{
+    return this->header.tile_level;
+}
+
+inline std::size_t
+MappedOctreeFile::get_num_tiles (void) const
+{
+    return this->tiles.size();
+}
+
+inline OctreeFileTile const&
+MappedOctreeFile::get_tile (std::size_t tile) const
+{
+    return this->tiles[tile];
+}
+
+inline VoxelIndex const*
+MappedOctreeFile::get_voxel_indices (void) const
+{
+    return reinterpret_cast<VoxelIndex const*>(this->mapped_file
+        + this->header.index_offset);
+}
+
+inline VoxelData const*
+MappedOctreeFile::get_voxel_data (void) const
+{
+    return reinterpret_cast<VoxelData const*>(this->mapped_file
+        + this->header.data_offset);
+}
+
+FSSR_NAMESPACE_END
+
+#endif /* FSSR_OCTREE_FILE_HEADER */
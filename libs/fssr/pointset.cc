@@ -3,99 +3,240 @@
  * Written by Simon Fuhrmann.
  */
 
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
 
-#include "mve/mesh_io_ply.h"
+#include "math/defines.h"
+#include "fssr/sample_io.h"
 #include "fssr/pointset.h"
 
+/* Number of vertices decoded at once while reading. */
+#define FSSR_POINTSET_CHUNK_SIZE (1 << 16)
+
 FSSR_NAMESPACE_BEGIN
 
-void
-PointSet::read_from_file (std::string const& filename)
+namespace
 {
-    /* Load or generate point set. */
-    mve::TriangleMesh::Ptr mesh = mve::geom::load_ply_mesh(filename);
-
-    mve::TriangleMesh::VertexList const& verts = mesh->get_vertices();
-    if (verts.empty())
-        throw std::invalid_argument("Point set is empty!");
-
-    mve::TriangleMesh::NormalList const& vnormals = mesh->get_vertex_normals();
-    if (!mesh->has_vertex_normals())
-        throw std::invalid_argument("Vertex normals missing!");
-
-    mve::TriangleMesh::ValueList const& vvalues = mesh->get_vertex_values();
-    if (!mesh->has_vertex_values())
-        throw std::invalid_argument("Vertex scale missing!");
-
-    mve::TriangleMesh::ConfidenceList& vconfs = mesh->get_vertex_confidences();
-    if (!mesh->has_vertex_confidences())
-        vconfs.resize(verts.size(), 1.0f);
-
-    mve::TriangleMesh::ColorList& vcolors = mesh->get_vertex_colors();
-    if (!mesh->has_vertex_colors())
-        vcolors.resize(verts.size(), math::Vec4f(-1.0f));
-
-    std::size_t num_skipped_zero_normal = 0;
-    std::size_t num_unnormalized_normals = 0;
-    std::size_t num_skipped_invalid_confidence = 0;
-    std::size_t num_skipped_invalid_scale = 0;
-    this->samples.reserve(verts.size());
-    for (std::size_t i = 0; i < verts.size(); i += (1 + this->num_skip))
+    enum SampleStatus
     {
-        Sample s;
-        s.pos = verts[i];
-        s.normal = vnormals[i];
-        s.scale = vvalues[i] * this->scale_factor;
-        s.confidence = vconfs[i];
-        s.color = math::Vec3f(*vcolors[i]);
-
-        if (s.scale <= 0.0f)
+        SAMPLE_VALID,
+        SAMPLE_NORMALIZED,
+        SAMPLE_INVALID_SCALE,
+        SAMPLE_INVALID_CONFIDENCE,
+        SAMPLE_ZERO_NORMAL
+    };
+
+    /* Applies the scale factor and validates the sample. */
+    SampleStatus
+    prepare_sample (Sample* s, float scale_factor)
+    {
+        s->scale *= scale_factor;
+        if (s->scale <= 0.0f)
+            return SAMPLE_INVALID_SCALE;
+        if (s->confidence <= 0.0f)
+            return SAMPLE_INVALID_CONFIDENCE;
+        if (s->normal.square_norm() == 0.0f)
+            return SAMPLE_ZERO_NORMAL;
+        if (!MATH_EPSILON_EQ(1.0f, s->normal.square_norm(), 1e-5f))
         {
-            num_skipped_invalid_scale += 1;
-            continue;
+            s->normal.normalize();
+            return SAMPLE_NORMALIZED;
         }
+        return SAMPLE_VALID;
+    }
 
-        if (s.confidence <= 0.0f)
+    void
+    print_warnings (std::size_t num_skipped_invalid_scale,
+        std::size_t num_skipped_invalid_confidence,
+        std::size_t num_skipped_zero_normal,
+        std::size_t num_unnormalized_normals)
+    {
+        if (num_skipped_invalid_scale > 0)
         {
-            num_skipped_invalid_confidence += 1;
-            continue;
+            std::cout << "WARNING: Skipped " << num_skipped_invalid_scale
+                << " samples with invalid scale." << std::endl;
         }
-
-        if (s.normal.square_norm() == 0.0f)
+        if (num_skipped_invalid_confidence > 0)
         {
-            num_skipped_zero_normal += 1;
-            continue;
+            std::cout << "WARNING: Skipped " << num_skipped_invalid_confidence
+                << " samples with zero confidence." << std::endl;
         }
-
-        if (!MATH_EPSILON_EQ(1.0f, s.normal.square_norm(), 1e-5f))
+        if (num_skipped_zero_normal > 0)
+        {
+            std::cout << "WARNING: Skipped " << num_skipped_zero_normal
+                << " samples with zero-length normal." << std::endl;
+        }
+        if (num_unnormalized_normals > 0)
         {
-            s.normal.normalize();
-            num_unnormalized_normals += 1;
+            std::cout << "WARNING: Normalized " << num_unnormalized_normals
+                << " normals with non-unit length." << std::endl;
         }
+    }
 
-        this->samples.push_back(s);
+    void
+    check_attributes (SampleReader const& reader)
+    {
+        if (reader.get_num_vertices() == 0)
+            throw std::invalid_argument("Point set is empty!");
+        if (!reader.has_normals())
+            throw std::invalid_argument("Vertex normals missing!");
+        if (!reader.has_scale())
+            throw std::invalid_argument("Vertex scale missing!");
     }
+}
 
-    if (num_skipped_invalid_scale > 0)
+void
+PointSet::read_from_file (std::string const& filename)
+{
+    std::size_t num_skipped_zero_normal = 0;
+    std::size_t num_unnormalized_normals = 0;
+    std::size_t num_skipped_invalid_confidence = 0;
+    std::size_t num_skipped_invalid_scale = 0;
+
+    /*
+     * In memory-mapped mode, samples are decoded on demand. The samples
+     * are validated once in parallel to report invalid samples.
+     */
+    if (this->memory_mapped)
     {
-        std::cout << "WARNING: Skipped " << num_skipped_invalid_scale
-            << " samples with invalid scale." << std::endl;
+        this->mapped_reader.map(filename);
+        check_attributes(this->mapped_reader);
+
+        std::size_t const num_samples = this->get_num_samples();
+#pragma omp parallel for reduction(+:num_skipped_zero_normal, \
+    num_unnormalized_normals, num_skipped_invalid_confidence, \
+    num_skipped_invalid_scale)
+        for (std::size_t i = 0; i < num_samples; ++i)
+        {
+            Sample s;
+            this->mapped_reader.get_sample(i * (1 + this->num_skip), &s);
+            switch (prepare_sample(&s, this->scale_factor))
+            {
+                case SAMPLE_INVALID_SCALE:
+                    num_skipped_invalid_scale += 1;
+                    break;
+                case SAMPLE_INVALID_CONFIDENCE:
+                    num_skipped_invalid_confidence += 1;
+                    break;
+                case SAMPLE_ZERO_NORMAL:
+                    num_skipped_zero_normal += 1;
+                    break;
+                case SAMPLE_NORMALIZED:
+                    num_unnormalized_normals += 1;
+                    break;
+                default:
+                    break;
+            }
+        }
+        print_warnings(num_skipped_invalid_scale,
+            num_skipped_invalid_confidence, num_skipped_zero_normal,
+            num_unnormalized_normals);
+        return;
     }
-    if (num_skipped_invalid_confidence > 0)
+
+    /* Open the file and check for the required attributes. */
+    SampleReader reader;
+    reader.open(filename);
+    check_attributes(reader);
+
+    /* Reserve memory for all samples such that only one copy is kept. */
+    std::size_t const stride = 1 + this->num_skip;
+    std::size_t const num_vertices = reader.get_num_vertices();
+    this->samples.reserve(this->samples.size()
+        + (num_vertices + stride - 1) / stride);
+
+    /* Decode chunks of samples and validate them in place. */
+    std::size_t num_valid = this->samples.size();
+    while (reader.read_samples(FSSR_POINTSET_CHUNK_SIZE, stride,
+        &this->samples) > 0)
     {
-        std::cout << "WARNING: Skipped " << num_skipped_invalid_confidence
-            << " samples with zero confidence." << std::endl;
+        for (std::size_t i = num_valid; i < this->samples.size(); ++i)
+        {
+            Sample s = this->samples[i];
+            switch (prepare_sample(&s, this->scale_factor))
+            {
+                case SAMPLE_INVALID_SCALE:
+                    num_skipped_invalid_scale += 1;
+                    continue;
+                case SAMPLE_INVALID_CONFIDENCE:
+                    num_skipped_invalid_confidence += 1;
+                    continue;
+                case SAMPLE_ZERO_NORMAL:
+                    num_skipped_zero_normal += 1;
+                    continue;
+                case SAMPLE_NORMALIZED:
+                    num_unnormalized_normals += 1;
+                    break;
+                default:
+                    break;
+            }
+
+            this->samples[num_valid] = s;
+            num_valid += 1;
+        }
+        this->samples.resize(num_valid);
     }
-    if (num_skipped_zero_normal > 0)
+    reader.close();
+    print_warnings(num_skipped_invalid_scale,
+        num_skipped_invalid_confidence, num_skipped_zero_normal,
+        num_unnormalized_normals);
+}
+
+bool
+PointSet::get_sample (std::size_t index, Sample* sample) const
+{
+    if (!this->mapped_reader.is_mapped())
     {
-        std::cout << "WARNING: Skipped " << num_skipped_zero_normal
-            << " samples with zero-length normal." << std::endl;
+        *sample = this->samples[index];
+        return true;
     }
-    if (num_unnormalized_normals > 0)
+
+    this->mapped_reader.get_sample(index * (1 + this->num_skip), sample);
+    SampleStatus const status = prepare_sample(sample, this->scale_factor);
+    return status == SAMPLE_VALID || status == SAMPLE_NORMALIZED;
+}
+
+void
+PointSet::compute_bounds (math::Vec3d* aabb_min, math::Vec3d* aabb_max,
+    double* max_scale) const
+{
+    *aabb_min = math::Vec3d(std::numeric_limits<double>::max());
+    *aabb_max = math::Vec3d(-std::numeric_limits<double>::max());
+    *max_scale = 0.0;
+
+    std::size_t const num_samples = this->get_num_samples();
+#pragma omp parallel
     {
-        std::cout << "WARNING: Normalized " << num_unnormalized_normals
-            << " normals with non-unit length." << std::endl;
+        math::Vec3d local_min(std::numeric_limits<double>::max());
+        math::Vec3d local_max(-std::numeric_limits<double>::max());
+        double local_max_scale = 0.0;
+
+#pragma omp for
+        for (std::size_t i = 0; i < num_samples; ++i)
+        {
+            Sample sample;
+            if (!this->get_sample(i, &sample))
+                continue;
+            for (int j = 0; j < 3; ++j)
+            {
+                local_min[j] = std::min(local_min[j],
+                    static_cast<double>(sample.pos[j]));
+                local_max[j] = std::max(local_max[j],
+                    static_cast<double>(sample.pos[j]));
+            }
+            local_max_scale = std::max(local_max_scale,
+                static_cast<double>(sample.scale));
+        }
+
+#pragma omp critical
+        for (int j = 0; j < 3; ++j)
+        {
+            (*aabb_min)[j] = std::min((*aabb_min)[j], local_min[j]);
+            (*aabb_max)[j] = std::max((*aabb_max)[j], local_max[j]);
+            *max_scale = std::max(*max_scale, local_max_scale);
+        }
     }
 }
 
@@ -6,16 +6,27 @@
 #ifndef FSSR_POINTSET_HEADER
 #define FSSR_POINTSET_HEADER
 
+#include <stdexcept>
 #include <string>
 #include <vector>
 
+#include "math/vector.h"
 #include "fssr/defines.h"
 #include "fssr/sample.h"
+#include "fssr/sample_io.h"
 
 FSSR_NAMESPACE_BEGIN
 
 /**
  * Reads a point set from file and converts it to samples.
+ *
+ * In memory-mapped mode, binary little endian PLY files are mapped instead
+ * of read and no samples are stored in the sample list. Samples are then
+ * decoded and validated on demand using get_sample(). The samples are
+ * validated once while reading to report invalid samples, which are then
+ * skipped by get_sample().
+ *
+ * The point set is not copyable, because it owns the mapped file.
  */
 class PointSet
 {
@@ -32,22 +43,56 @@ public:
     void set_scale_factor (float factor);
     /** Sets how many samples are skipped, defaults to 0. */
     void set_skip_samples (int num_skip);
+    /** Sets whether the input file is memory-mapped, defaults to false. */
+    void set_memory_mapped (bool enable);
 
     /** Reads the input file. Options need to be set before calling this. */
     void read_from_file (std::string const& filename);
 
-    /* Returns the list of samples. */
+    /**
+     * Returns the list of samples. Throws in memory-mapped mode, where no
+     * samples are stored, use get_sample() instead.
+     */
     SampleList const& get_samples (void) const;
-    /* Returns the list of samples. */
+    /** Returns the list of samples, see above. */
     SampleList& get_samples (void);
 
+    /** Returns true if the samples are accessed through a mapped file. */
+    bool is_memory_mapped (void) const;
+    /**
+     * Returns the number of samples available through get_sample().
+     * In memory-mapped mode this includes invalid samples.
+     */
+    std::size_t get_num_samples (void) const;
+    /**
+     * Retrieves the sample with the given index. Returns false if the
+     * sample is invalid, which only happens in memory-mapped mode.
+     * This function is thread-safe.
+     */
+    bool get_sample (std::size_t index, Sample* sample) const;
+
+    /**
+     * Computes the bounding box of all valid samples and the largest
+     * sample scale. This can be used to initialize the octree root.
+     * The bounding box is empty (min > max) if there are no samples.
+     */
+    void compute_bounds (math::Vec3d* aabb_min, math::Vec3d* aabb_max,
+        double* max_scale) const;
+
     /** Reset to defaults and release points. */
     void clear (void);
 
+private:
+    /* Not copyable. */
+    PointSet (PointSet const& other);
+    PointSet& operator= (PointSet const& other);
+
 private:
     float scale_factor;
     int num_skip;
+    bool memory_mapped;
     SampleList samples;
+    SampleReader mapped_reader;
 };
 
 /* ---------------------------------------------------------------- */
@@ -77,15 +122,25 @@ PointSet::set_skip_samples (int num_skip)
     this->num_skip = num_skip;
 }
 
+inline void
+PointSet::set_memory_mapped (bool enable)
+{
+    this->memory_mapped = enable;
+}
+
 inline PointSet::SampleList const&
 PointSet::get_samples (void) const
 {
+    if (this->mapped_reader.is_mapped())
+        throw std::runtime_error("No sample list in memory-mapped mode");
     return this->samples;
 }
 
 inline PointSet::SampleList&
 PointSet::get_samples (void)
 {
+    if (this->mapped_reader.is_mapped())
+        throw std::runtime_error("No sample list in memory-mapped mode");
     return this->samples;
 }
 
@@ -94,7 +149,24 @@ PointSet::clear (void)
 {
     this->scale_factor = 1.0f;
     this->num_skip = 0;
+    this->memory_mapped = false;
     this->samples.clear();
+    this->mapped_reader.close();
+}
+
+inline bool
+PointSet::is_memory_mapped (void) const
+{
+    return this->mapped_reader.is_mapped();
+}
+
+inline std::size_t
+PointSet::get_num_samples (void) const
+{
+    if (!this->mapped_reader.is_mapped())
+        return this->samples.size();
+    std::size_t const stride = 1 + this->num_skip;
+    return (this->mapped_reader.get_num_vertices() + stride - 1) / stride;
 }
 
 FSSR_NAMESPACE_END
@@ -0,0 +1,151 @@
+/*
+ * This file is part of the Floating Scale Surface Reconstruction software.
+ * Written by Simon Fuhrmann.
+ */
+
+#ifndef FSSR_RADIX_SORT_HEADER
+#define FSSR_RADIX_SORT_HEADER
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>  // TODO: Use <cstdint> once C++11 is standard.
+
+#include "fssr/defines.h"
+
+FSSR_NAMESPACE_BEGIN
+
+/**
+ * Stable parallel LSD radix sort of the values according to an unsigned
+ * 64 bit key. The key is obtained from each value using the key functor,
+ * and only the lowest 'key_bits' bits of the key are considered. The values
+ * are processed in blocks, histograms and scattering run in parallel.
+ * Passes where all keys share the same digit are skipped.
+ */
+template <typename T, typename KeyFunc>
+void
+radix_sort (std::vector<T>* values, KeyFunc const& key_func,
+    int key_bits = 64);
+
+/**
+ * Removes consecutive duplicates from the values in parallel, similar to
+ * std::unique followed by erase. The values are compared with operator==.
+ * Blocks of values are compacted in parallel after computing the output
+ * offset of every block.
+ */
+template <typename T>
+void
+parallel_unique (std::vector<T>* values);
+
+FSSR_NAMESPACE_END
+
+/* ------------------------- Implementation ---------------------------- */
+
+FSSR_NAMESPACE_BEGIN
+
+template <typename T, typename KeyFunc>
+void
+radix_sort (std::vector<T>* values, KeyFunc const& key_func, int key_bits)
+{
+    std::size_t const num = values->size();
+    if (num < 2)
+        return;
+
+    std::size_t const num_blocks = std::min<std::size_t>(64, num / 4096 + 1);
+    std::size_t const block_size = (num + num_blocks - 1) / num_blocks;
+    std::vector<std::size_t> histograms(num_blocks * 256);
+    std::vector<T> temp(num);
+    T* src = &(*values)[0];
+    T* dst = &temp[0];
+
+    for (int shift = 0; shift < key_bits; shift += 8)
+    {
+        /* Count digits per block. */
+        std::fill(histograms.begin(), histograms.end(), 0);
+#pragma omp parallel for
+        for (std::size_t b = 0; b < num_blocks; ++b)
+        {
+            std::size_t* hist = &histograms[b * 256];
+            std::size_t const end = std::min(num, (b + 1) * block_size);
+            for (std::size_t i = b * block_size; i < end; ++i)
+                hist[(key_func(src[i]) >> shift) & 0xff] += 1;
+        }
+
+        /* Convert counts to offsets, digit-major and block-minor. */
+        bool trivial_pass = false;
+        std::size_t offset = 0;
+        for (int d = 0; d < 256; ++d)
+        {
+            std::size_t digit_count = 0;
+            for (std::size_t b = 0; b < num_blocks; ++b)
+            {
+                std::size_t const count = histograms[b * 256 + d];
+                histograms[b * 256 + d] = offset;
+                offset += count;
+                digit_count += count;
+            }
+            if (digit_count == num)
+                trivial_pass = true;
+        }
+        if (trivial_pass)
+            continue;
+
+        /* Scatter values to the destination, which keeps the order stable. */
+#pragma omp parallel for
+        for (std::size_t b = 0; b < num_blocks; ++b)
+        {
+            std::size_t* hist = &histograms[b * 256];
+            std::size_t const end = std::min(num, (b + 1) * block_size);
+            for (std::size_t i = b * block_size; i < end; ++i)
+                dst[hist[(key_func(src[i]) >> shift) & 0xff]++] = src[i];
+        }
+        std::swap(src, dst);
+    }
+
+    if (src != &(*values)[0])
+        values->swap(temp);
+}
+
+template <typename T>
+void
+parallel_unique (std::vector<T>* values)
+{
+    std::size_t const num = values->size();
+    if (num < 2)
+        return;
+
+    std::size_t const num_blocks = std::min<std::size_t>(64, num / 4096 + 1);
+    std::size_t const block_size = (num + num_blocks - 1) / num_blocks;
+    std::vector<std::size_t> offsets(num_blocks + 1, 0);
+    T const* src = &(*values)[0];
+
+    /* Count the values that differ from their predecessor per block. */
+#pragma omp parallel for
+    for (std::size_t b = 0; b < num_blocks; ++b)
+    {
+        std::size_t const end = std::min(num, (b + 1) * block_size);
+        std::size_t count = 0;
+        for (std::size_t i = b * block_size; i < end; ++i)
+            if (i == 0 || !(src[i] == src[i - 1]))
+                count += 1;
+        offsets[b + 1] = count;
+    }
+    for (std::size_t b = 0; b < num_blocks; ++b)
+        offsets[b + 1] += offsets[b];
+
+    /* Copy the unique values of every block to its output offset. */
+    std::vector<T> result(offsets.back());
+#pragma omp parallel for
+    for (std::size_t b = 0; b < num_blocks; ++b)
+    {
+        std::size_t const end = std::min(num, (b + 1) * block_size);
+        std::size_t pos = offsets[b];
+        for (std::size_t i = b * block_size; i < end; ++i)
+            if (i == 0 || !(src[i] == src[i - 1]))
+                result[pos++] = src[i];
+    }
+    values->swap(result);
+}
+
+FSSR_NAMESPACE_END
+
+#endif /* FSSR_RADIX_SORT_HEADER */
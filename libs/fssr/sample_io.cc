@@ -0,0 +1,448 @@
+/*
+ * This file is part of the Floating Scale Surface Reconstruction software.
+ * Written by Simon Fuhrmann.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <stdint.h>  // TODO: Use <cstdint> once C++11 is standard.
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fssr/sample_io.h"
+
+FSSR_NAMESPACE_BEGIN
+
+namespace
+{
+    template <typename T>
+    T
+    read_value (char const* ptr, bool swap)
+    {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, ptr, sizeof(T));
+        if (swap)
+            std::reverse(bytes, bytes + sizeof(T));
+        T value;
+        std::memcpy(&value, bytes, sizeof(T));
+        return value;
+    }
+
+    std::size_t
+    type_size (std::string const& type)
+    {
+        if (type == "char" || type == "uchar"
+            || type == "int8" || type == "uint8")
+            return 1;
+        if (type == "short" || type == "ushort"
+            || type == "int16" || type == "uint16")
+            return 2;
+        if (type == "int" || type == "uint" || type == "float"
+            || type == "int32" || type == "uint32" || type == "float32")
+            return 4;
+        if (type == "double" || type == "float64")
+            return 8;
+        throw std::invalid_argument("Invalid PLY property type: " + type);
+    }
+}
+
+void
+SampleReader::open (std::string const& filename)
+{
+    this->close();
+    this->in.open(filename.c_str(), std::ios::binary);
+    if (!this->in.good())
+        throw std::runtime_error(::strerror(errno));
+    this->parse_header();
+}
+
+void
+SampleReader::map (std::string const& filename)
+{
+    this->open(filename);
+    if (this->format != FORMAT_BINARY_LE)
+        throw std::invalid_argument("Memory mapping requires "
+            "binary little endian PLY files");
+
+    /* The header is parsed, the stream is not needed anymore. */
+    std::size_t const data_offset = this->in.tellg();
+    this->in.close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error(::strerror(errno));
+
+    struct stat stats;
+    if (::fstat(fd, &stats) < 0)
+    {
+        ::close(fd);
+        throw std::runtime_error(::strerror(errno));
+    }
+
+    std::size_t const file_size = stats.st_size;
+    if (file_size < data_offset + this->num_vertices * this->record_size)
+    {
+        ::close(fd);
+        throw std::runtime_error("Unexpected end of PLY file");
+    }
+
+    void* ptr = ::mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+        throw std::runtime_error(::strerror(errno));
+    ::madvise(ptr, file_size, MADV_SEQUENTIAL);
+
+    this->mapped_file = static_cast<char*>(ptr);
+    this->mapped_size = file_size;
+    this->mapped_vertices = this->mapped_file + data_offset;
+}
+
+void
+SampleReader::close (void)
+{
+    if (this->mapped_file != NULL)
+        ::munmap(this->mapped_file, this->mapped_size);
+    this->mapped_file = NULL;
+    this->mapped_size = 0;
+    this->mapped_vertices = NULL;
+
+    if (this->in.is_open())
+        this->in.close();
+    this->in.clear();
+    this->format = FORMAT_ASCII;
+    this->num_vertices = 0;
+    this->next_vertex = 0;
+    this->record_size = 0;
+    this->properties.clear();
+    std::fill(this->attribs, this->attribs + ATTRIB_NUM, -1);
+}
+
+void
+SampleReader::parse_header (void)
+{
+    std::string line;
+    std::getline(this->in, line);
+    if (line != "ply" && line != "ply\r")
+        throw std::invalid_argument("Invalid PLY file signature");
+
+    /* State of the element currently declared in the header. */
+    bool in_vertex_element = false;
+    bool seen_vertex_element = false;
+    std::size_t element_records = 0;
+    std::size_t element_size = 0;
+    bool element_has_list = false;
+
+    /* Data of elements before the vertex element needs to be skipped. */
+    std::size_t skip_records = 0;
+    std::size_t skip_bytes = 0;
+
+    bool header_complete = false;
+    while (!header_complete && std::getline(this->in, line))
+    {
+        std::stringstream ss(line);
+        std::string keyword;
+        ss >> keyword;
+
+        if (keyword.empty() || keyword == "comment" || keyword == "obj_info")
+            continue;
+
+        if (keyword == "format")
+        {
+            std::string format_str;
+            ss >> format_str;
+            if (format_str == "ascii")
+                this->format = FORMAT_ASCII;
+            else if (format_str == "binary_little_endian")
+                this->format = FORMAT_BINARY_LE;
+            else if (format_str == "binary_big_endian")
+                this->format = FORMAT_BINARY_BE;
+            else
+                throw std::invalid_argument("Invalid PLY format: "
+                    + format_str);
+        }
+        else if (keyword == "element" || keyword == "end_header")
+        {
+            if (in_vertex_element)
+                seen_vertex_element = true;
+            else if (!seen_vertex_element && element_records > 0)
+            {
+                if (element_has_list)
+                    throw std::invalid_argument("PLY list elements before "
+                        "the vertex element not supported");
+                skip_records += element_records;
+                skip_bytes += element_records * element_size;
+            }
+
+            in_vertex_element = false;
+            element_records = 0;
+            element_size = 0;
+            element_has_list = false;
+
+            if (keyword == "end_header")
+            {
+                header_complete = true;
+                continue;
+            }
+
+            std::string name;
+            ss >> name >> element_records;
+            if (name == "vertex" && !seen_vertex_element)
+            {
+                in_vertex_element = true;
+                this->num_vertices = element_records;
+            }
+        }
+        else if (keyword == "property")
+        {
+            std::string type, name;
+            ss >> type >> name;
+            if (type == "list")
+            {
+                if (in_vertex_element)
+                    throw std::invalid_argument("PLY list properties "
+                        "for vertices not supported");
+                element_has_list = true;
+                continue;
+            }
+
+            std::size_t const size = type_size(type);
+            if (!in_vertex_element)
+            {
+                element_size += size;
+                continue;
+            }
+
+            Property prop;
+            prop.offset = this->record_size;
+            if (type == "char" || type == "int8")
+                prop.type = TYPE_INT8;
+            else if (type == "uchar" || type == "uint8")
+                prop.type = TYPE_UINT8;
+            else if (type == "short" || type == "int16")
+                prop.type = TYPE_INT16;
+            else if (type == "ushort" || type == "uint16")
+                prop.type = TYPE_UINT16;
+            else if (type == "int" || type == "int32")
+                prop.type = TYPE_INT32;
+            else if (type == "uint" || type == "uint32")
+                prop.type = TYPE_UINT32;
+            else if (type == "float" || type == "float32")
+                prop.type = TYPE_FLOAT32;
+            else
+                prop.type = TYPE_FLOAT64;
+            this->record_size += size;
+
+            int const prop_id = static_cast<int>(this->properties.size());
+            this->properties.push_back(prop);
+
+            if (name == "x")
+                this->attribs[ATTRIB_X] = prop_id;
+            else if (name == "y")
+                this->attribs[ATTRIB_Y] = prop_id;
+            else if (name == "z")
+                this->attribs[ATTRIB_Z] = prop_id;
+            else if (name == "nx")
+                this->attribs[ATTRIB_NX] = prop_id;
+            else if (name == "ny")
+                this->attribs[ATTRIB_NY] = prop_id;
+            else if (name == "nz")
+                this->attribs[ATTRIB_NZ] = prop_id;
+            else if (name == "red" || name == "diffuse_red")
+                this->attribs[ATTRIB_RED] = prop_id;
+            else if (name == "green" || name == "diffuse_green")
+                this->attribs[ATTRIB_GREEN] = prop_id;
+            else if (name == "blue" || name == "diffuse_blue")
+                this->attribs[ATTRIB_BLUE] = prop_id;
+            else if (name == "value")
+                this->attribs[ATTRIB_SCALE] = prop_id;
+            else if (name == "confidence")
+                this->attribs[ATTRIB_CONFIDENCE] = prop_id;
+        }
+        else
+        {
+            throw std::invalid_argument("Invalid PLY header line: " + line);
+        }
+    }
+
+    if (!header_complete)
+        throw std::invalid_argument("Unexpected end of PLY header");
+    if (this->attribs[ATTRIB_X] < 0 || this->attribs[ATTRIB_Y] < 0
+        || this->attribs[ATTRIB_Z] < 0)
+        throw std::invalid_argument("Vertex positions missing!");
+
+    /* Skip the data of elements before the vertex element. */
+    if (this->format == FORMAT_ASCII)
+    {
+        for (std::size_t i = 0; i < skip_records; ++i)
+            std::getline(this->in, line);
+    }
+    else
+    {
+        this->in.seekg(skip_bytes, std::ios::cur);
+    }
+    if (!this->in.good())
+        throw std::runtime_error("Unexpected end of PLY file");
+}
+
+float
+SampleReader::read_binary_value (char const* record, int attrib) const
+{
+    Property const& prop = this->properties[this->attribs[attrib]];
+    char const* ptr = record + prop.offset;
+    bool const swap = (this->format == FORMAT_BINARY_BE);
+    switch (prop.type)
+    {
+        case TYPE_INT8: return static_cast<float>(*ptr);
+        case TYPE_UINT8: return static_cast<float>(
+            static_cast<unsigned char>(*ptr));
+        case TYPE_INT16: return read_value<int16_t>(ptr, swap);
+        case TYPE_UINT16: return read_value<uint16_t>(ptr, swap);
+        case TYPE_INT32: return static_cast<float>(
+            read_value<int32_t>(ptr, swap));
+        case TYPE_UINT32: return static_cast<float>(
+            read_value<uint32_t>(ptr, swap));
+        case TYPE_FLOAT32: return read_value<float>(ptr, swap);
+        case TYPE_FLOAT64: return static_cast<float>(
+            read_value<double>(ptr, swap));
+        default: break;
+    }
+    return 0.0f;
+}
+
+void
+SampleReader::decode_binary (char const* record, Sample* sample) const
+{
+    for (int i = 0; i < 3; ++i)
+        sample->pos[i] = this->read_binary_value(record, ATTRIB_X + i);
+
+    for (int i = 0; i < 3; ++i)
+        sample->normal[i] = this->has_normals()
+            ? this->read_binary_value(record, ATTRIB_NX + i) : 0.0f;
+
+    sample->scale = this->has_scale()
+        ? this->read_binary_value(record, ATTRIB_SCALE) : 0.0f;
+    sample->confidence = this->has_confidences()
+        ? this->read_binary_value(record, ATTRIB_CONFIDENCE) : 1.0f;
+
+    if (this->has_colors())
+    {
+        for (int i = 0; i < 3; ++i)
+            sample->color[i] = this->read_binary_value(record, ATTRIB_RED + i);
+        if (this->properties[this->attribs[ATTRIB_RED]].type == TYPE_UINT8)
+            sample->color /= 255.0f;
+    }
+    else
+    {
+        sample->color = math::Vec3f(-1.0f);
+    }
+}
+
+void
+SampleReader::decode_ascii (std::string const& line, Sample* sample) const
+{
+    float values[ATTRIB_NUM];
+    std::fill(values, values + ATTRIB_NUM, 0.0f);
+    values[ATTRIB_CONFIDENCE] = 1.0f;
+
+    /* Parse the properties in order and pick the known attributes. */
+    char const* ptr = line.c_str();
+    for (std::size_t i = 0; i < this->properties.size(); ++i)
+    {
+        char* end = NULL;
+        float const value = std::strtod(ptr, &end);
+        if (end == ptr)
+            throw std::invalid_argument("Invalid PLY vertex data");
+        ptr = end;
+
+        for (int j = 0; j < ATTRIB_NUM; ++j)
+            if (this->attribs[j] == static_cast<int>(i))
+                values[j] = value;
+    }
+
+    sample->pos = math::Vec3f(values + ATTRIB_X);
+    sample->normal = math::Vec3f(values + ATTRIB_NX);
+    sample->scale = values[ATTRIB_SCALE];
+    sample->confidence = values[ATTRIB_CONFIDENCE];
+
+    if (this->has_colors())
+    {
+        sample->color = math::Vec3f(values + ATTRIB_RED);
+        if (this->properties[this->attribs[ATTRIB_RED]].type == TYPE_UINT8)
+            sample->color /= 255.0f;
+    }
+    else
+    {
+        sample->color = math::Vec3f(-1.0f);
+    }
+}
+
+std::size_t
+SampleReader::read_samples (std::size_t max_vertices, std::size_t stride,
+    std::vector<Sample>* samples)
+{
+    std::size_t const first = this->next_vertex;
+    std::size_t const num = std::min(max_vertices,
+        this->num_vertices - this->next_vertex);
+    if (num == 0)
+        return 0;
+
+    /* Vertex records in the chunk, which are not skipped. */
+    std::size_t const first_selected = (first + stride - 1) / stride * stride;
+    std::size_t const num_selected = first_selected >= first + num
+        ? 0 : (first + num - first_selected - 1) / stride + 1;
+    std::size_t const offset = samples->size();
+    samples->resize(offset + num_selected);
+
+    if (this->format == FORMAT_ASCII)
+    {
+        if (this->lines.size() < num)
+            this->lines.resize(num);
+        for (std::size_t i = 0; i < num; ++i)
+            if (!std::getline(this->in, this->lines[i]))
+                throw std::runtime_error("Unexpected end of PLY file");
+
+        /* Parsing text is expensive, do it in parallel. */
+        bool parse_error = false;
+#pragma omp parallel for
+        for (std::size_t i = 0; i < num_selected; ++i)
+        {
+            std::size_t const line_id = first_selected + i * stride - first;
+            try
+            {
+                this->decode_ascii(this->lines[line_id],
+                    &(*samples)[offset + i]);
+            }
+            catch (std::exception&)
+            {
+                parse_error = true;
+            }
+        }
+        if (parse_error)
+            throw std::invalid_argument("Invalid PLY vertex data");
+    }
+    else
+    {
+        this->buffer.resize(num * this->record_size);
+        this->in.read(&this->buffer[0], this->buffer.size());
+        if (!this->in.good())
+            throw std::runtime_error("Unexpected end of PLY file");
+
+#pragma omp parallel for
+        for (std::size_t i = 0; i < num_selected; ++i)
+        {
+            std::size_t const record_id = first_selected + i * stride - first;
+            this->decode_binary(&this->buffer[record_id * this->record_size],
+                &(*samples)[offset + i]);
+        }
+    }
+
+    this->next_vertex += num;
+    return num;
+}
+
+FSSR_NAMESPACE_END
@@ -0,0 +1,210 @@
+/*
+ * This file is part of the Floating Scale Surface Reconstruction software.
+ * Written by Simon Fuhrmann.
+ */
+
+#ifndef FSSR_SAMPLE_IO_HEADER
+#define FSSR_SAMPLE_IO_HEADER
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "fssr/defines.h"
+#include "fssr/sample.h"
+
+FSSR_NAMESPACE_BEGIN
+
+/**
+ * Streaming reader for samples stored in PLY files. The reader parses the
+ * PLY header and decodes the vertex records chunk-wise directly into
+ * samples, without keeping an intermediate copy of the whole file in
+ * memory. ASCII and binary (little and big endian) files are supported.
+ * Connectivity information following the vertices is ignored.
+ *
+ * Missing confidence values are set to 1, missing colors are set to -1.
+ * Colors stored as bytes are scaled to [0, 1].
+ *
+ * Binary little endian files can alternatively be memory-mapped. In this
+ * case no data is read upfront; samples are decoded on demand from the
+ * mapped vertex records and the page cache does the buffering.
+ */
+class SampleReader
+{
+public:
+    enum Format
+    {
+        FORMAT_ASCII,
+        FORMAT_BINARY_LE,
+        FORMAT_BINARY_BE
+    };
+
+public:
+    SampleReader (void);
+    ~SampleReader (void);
+
+    /** Opens the PLY file and parses the header. */
+    void open (std::string const& filename);
+    /**
+     * Opens a binary little endian PLY file, parses the header and maps
+     * the vertex data into memory. Use get_sample() to access samples.
+     */
+    void map (std::string const& filename);
+    /** Closes (and unmaps) the file. */
+    void close (void);
+    /** Returns true if the vertex data is memory-mapped. */
+    bool is_mapped (void) const;
+
+    /** Returns the data format of the file. */
+    Format get_format (void) const;
+    /** Returns the number of vertices in the file. */
+    std::size_t get_num_vertices (void) const;
+    /** Returns true if the file provides vertex normals. */
+    bool has_normals (void) const;
+    /** Returns true if the file provides the scale ("value" property). */
+    bool has_scale (void) const;
+    /** Returns true if the file provides confidence values. */
+    bool has_confidences (void) const;
+    /** Returns true if the file provides vertex colors. */
+    bool has_colors (void) const;
+
+    /**
+     * Reads the next chunk of at most 'max_vertices' vertex records and
+     * appends every 'stride'-th vertex (counted from the first vertex in
+     * the file) to the sample list. The samples are not validated. Returns
+     * the number of vertex records consumed, which is zero at the end.
+     */
+    std::size_t read_samples (std::size_t max_vertices, std::size_t stride,
+        std::vector<Sample>* samples);
+
+    /**
+     * Decodes the vertex with the given index from the mapped file.
+     * The sample is not validated. This function is thread-safe.
+     */
+    void get_sample (std::size_t index, Sample* sample) const;
+
+private:
+    enum Attribute
+    {
+        ATTRIB_X, ATTRIB_Y, ATTRIB_Z,
+        ATTRIB_NX, ATTRIB_NY, ATTRIB_NZ,
+        ATTRIB_RED, ATTRIB_GREEN, ATTRIB_BLUE,
+        ATTRIB_SCALE, ATTRIB_CONFIDENCE,
+        ATTRIB_NUM
+    };
+
+    enum Type
+    {
+        TYPE_INT8, TYPE_UINT8, TYPE_INT16, TYPE_UINT16,
+        TYPE_INT32, TYPE_UINT32, TYPE_FLOAT32, TYPE_FLOAT64
+    };
+
+    struct Property
+    {
+        Type type;
+        std::size_t offset;
+    };
+
+private:
+    /* Not copyable. */
+    SampleReader (SampleReader const& other);
+    SampleReader& operator= (SampleReader const& other);
+
+    void parse_header (void);
+    float read_binary_value (char const* record, int attrib) const;
+    void decode_binary (char const* record, Sample* sample) const;
+    void decode_ascii (std::string const& line, Sample* sample) const;
+
+private:
+    std::ifstream in;
+    Format format;
+    std::size_t num_vertices;
+    std::size_t next_vertex;
+    std::size_t record_size;
+    std::vector<Property> properties;
+    int attribs[ATTRIB_NUM];
+
+    std::vector<char> buffer;
+    std::vector<std::string> lines;
+
+    char* mapped_file;
+    std::size_t mapped_size;
+    char const* mapped_vertices;
+};
+
+/* ------------------------- Implementation ---------------------------- */
+
+inline
+SampleReader::SampleReader (void)
+    : format(FORMAT_ASCII)
+    , num_vertices(0)
+    , next_vertex(0)
+    , record_size(0)
+    , mapped_file(NULL)
+    , mapped_size(0)
+    , mapped_vertices(NULL)
+{
+    std::fill(this->attribs, this->attribs + ATTRIB_NUM, -1);
+}
+
+inline
+SampleReader::~SampleReader (void)
+{
+    this->close();
+}
+
+inline bool
+SampleReader::is_mapped (void) const
+{
+    return this->mapped_vertices != NULL;
+}
+
+inline void
+SampleReader::get_sample (std::size_t index, Sample* sample) const
+{
+    this->decode_binary(this->mapped_vertices + index * this->record_size,
+        sample);
+}
+
+inline SampleReader::Format
+SampleReader::get_format (void) const
+{
+    return this->format;
+}
+
+inline std::size_t
+SampleReader::get_num_vertices (void) const
+{
+    return this->num_vertices;
+}
+
+inline bool
+SampleReader::has_normals (void) const
+{
+    return this->attribs[ATTRIB_NX] >= 0 && this->attribs[ATTRIB_NY] >= 0
+        && this->attribs[ATTRIB_NZ] >= 0;
+}
+
+inline bool
+SampleReader::has_scale (void) const
+{
+    return this->attribs[ATTRIB_SCALE] >= 0;
+}
+
+inline bool
+SampleReader::has_confidences (void) const
+{
+    return this->attribs[ATTRIB_CONFIDENCE] >= 0;
+}
+
+inline bool
+SampleReader::has_colors (void) const
+{
+    return this->attribs[ATTRIB_RED] >= 0 && this->attribs[ATTRIB_GREEN] >= 0
+        && this->attribs[ATTRIB_BLUE] >= 0;
+}
+
+FSSR_NAMESPACE_END
+
+#endif /* FSSR_SAMPLE_IO_HEADER */
@@ -10,6 +10,22 @@
 
 FSSR_NAMESPACE_BEGIN
 
+namespace
+{
+    /* Spreads the lower 21 bits of the value to every third bit. */
+    uint64_t
+    spread_bits (uint64_t value)
+    {
+        value &= 0x1fffff;
+        value = (value | value << 32) & 0x1f00000000ffffULL;
+        value = (value | value << 16) & 0x1f0000ff0000ffULL;
+        value = (value | value << 8) & 0x100f00f00f00f00fULL;
+        value = (value | value << 4) & 0x10c30c30c30c30c3ULL;
+        value = (value | value << 2) & 0x1249249249249249ULL;
+        return value;
+    }
+}
+
 void
 VoxelIndex::from_path_and_corner (Octree::NodePath const& path, int corner)
 {
@@ -64,6 +80,14 @@ VoxelIndex::get_offset_z (void) const
     return static_cast<uint32_t>((this->index >> 42) & 0x1fffff);
 }
 
+uint64_t
+VoxelIndex::get_morton_code (void) const
+{
+    return spread_bits(this->get_offset_x())
+        | spread_bits(this->get_offset_y()) << 1
+        | spread_bits(this->get_offset_z()) << 2;
+}
+
 /* ---------------------------------------------------------------- */
 
 void
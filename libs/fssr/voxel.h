@@ -38,6 +38,12 @@ public:
     uint32_t get_offset_x (void) const;
     uint32_t get_offset_y (void) const;
     uint32_t get_offset_z (void) const;
+    /**
+     * Returns the 3D Morton code (Z-order) of the voxel, i.e. the bits of
+     * the x, y and z coordinates interleaved. Voxels that are close in the
+     * Morton order are also close in space.
+     */
+    uint64_t get_morton_code (void) const;
     bool operator< (VoxelIndex const& other) const;
 
 public:
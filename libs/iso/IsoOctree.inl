@@ -382,6 +382,11 @@ void IsoOctree<NodeData,Real,VertexData>::getIsoPolygons(
     stdext::hash_map<long long,std::pair<RootInfo,int> > vertexCount;
     std::vector<std::pair<RootInfo,RootInfo> > riEdges;
 
+    // SIMON change: Cubes outside of the loaded region are skipped.
+    for(int i=0;i<Cube::CORNERS;i++)
+        if(cornerValues.find(OctNode<NodeData,Real>::CornerIndex(nIdx,i,maxDepth))==cornerValues.end())
+            return;
+
     /* SIMON: If this is not max level, iterate over faces and get neighbors.
      * If neighbors are finer, get their ISO face edges, otherwise use own.
      */
@@ -584,17 +589,26 @@ void IsoOctree<NodeData,Real,VertexData>::setMCIndex(const Real& isoValue,const
     for(temp=tree.nextLeaf(NULL,nIdx) ; temp ; temp=tree.nextLeaf(temp,nIdx) )
     {
         Real cValues[Cube::CORNERS]; // Implicit function values
+        int cSigns = 0; // Signs of the available corners
         bool skip_cube = false;
 
         for(int i=0;i<Cube::CORNERS;i++)
         {
-            if(cornerValues.find(OctNode<NodeData,Real>::CornerIndex(nIdx,i,maxDepth))==cornerValues.end())
-                fprintf(stderr,"Could not find value in corner value table for %d/%d/%d/%d!\n", nIdx.depth, nIdx.offset[0], nIdx.offset[1], nIdx.offset[2]);
-
-            // SIMON change
-            VertexData data = cornerValues[OctNode<NodeData,Real>::CornerIndex(nIdx,i,maxDepth)];
-            cValues[i] = data.value;
-            //if (data.conf == Real(0))
+            // SIMON change: Cubes with missing corner values are outside
+            // of the loaded region of the octree and are skipped. The signs
+            // of the available corners are still propagated to the parents.
+            typename stdext::hash_map<long long,VertexData>::const_iterator iter
+                = cornerValues.find(OctNode<NodeData,Real>::CornerIndex(nIdx,i,maxDepth));
+            if (iter == cornerValues.end())
+            {
+                skip_cube = true;
+                cValues[i] = isoValue;
+                continue;
+            }
+            cValues[i] = iter->second.value;
+            if (cValues[i] < isoValue)
+                cSigns |= 1 << i;
+            //if (iter->second.conf == Real(0))
             //    skip_cube = true;
         }
 
@@ -608,7 +622,7 @@ void IsoOctree<NodeData,Real,VertexData>::setMCIndex(const Real& isoValue,const
         if(temp->parent)
         {
             int cIndex=int(temp-temp->parent->children);
-            int bitFlag = temp->nodeData.mcIndex & (1<<cIndex);
+            int bitFlag = cSigns & (1<<cIndex);
             if(bitFlag)
             {
                 OctNode<NodeData,Real> *parent,*child;
@@ -8,6 +8,7 @@
 #include "math/vector.h"
 #include "mve/mesh.h"
 #include "fssr/iso_octree.h"
+#include "fssr/octree_file.h"
 
 #include "IsoOctree.h"
 
@@ -25,6 +26,9 @@ class SimonIsoOctree : public IsoOctree<SimonNodeData, float, SimonVertexData>
 {
 public:
     void set_octree (fssr::IsoOctree const& octree);
+    /** Sets the hierarchy and reads the voxels from the mapped file. */
+    void set_octree (fssr::IsoOctree const& octree,
+        fssr::MappedOctreeFile const& file);
     mve::TriangleMesh::Ptr extract_mesh (void);
     void clear (void);
 
@@ -34,7 +38,9 @@ private:
         SimonOctNode::NodeIndex out_node_index,
         int max_level);
 
+    void set_hierarchy (fssr::IsoOctree const& octree);
     void copy_voxel_data (fssr::IsoOctree const& octree);
+    void copy_voxel_data (fssr::MappedOctreeFile const& file);
     long long index_convert (fssr::VoxelIndex const& index) const;
 
 private:
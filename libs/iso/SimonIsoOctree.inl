@@ -40,6 +40,21 @@ SimonIsoOctree::clear (void)
 
 inline void
 SimonIsoOctree::set_octree (fssr::IsoOctree const& octree)
+{
+    this->set_hierarchy(octree);
+    this->copy_voxel_data(octree);
+}
+
+inline void
+SimonIsoOctree::set_octree (fssr::IsoOctree const& octree,
+    fssr::MappedOctreeFile const& file)
+{
+    this->set_hierarchy(octree);
+    this->copy_voxel_data(file);
+}
+
+inline void
+SimonIsoOctree::set_hierarchy (fssr::IsoOctree const& octree)
 {
     this->maxDepth = MAX_DEPTH;
 
@@ -58,9 +73,6 @@ SimonIsoOctree::set_octree (fssr::IsoOctree const& octree)
     SimonOctNode::NodeIndex out_index;
     this->transfer_octree(octree.get_iterator_for_root(),
         &this->tree, out_index, octree.get_max_level());
-
-    // Copy the voxel data to the Kazhdan octree.
-    this->copy_voxel_data(octree);
 }
 
 inline mve::TriangleMesh::Ptr
@@ -120,7 +132,7 @@ SimonIsoOctree::transfer_octree (
         return;
 
     /* Determine whether to descend into octree. */
-    if (in_iter.node->children[0] == NULL)
+    if (in_iter.node->is_leaf())
         return;
 
     out_node->initChildren();
@@ -138,3 +150,26 @@ SimonIsoOctree::copy_voxel_data (fssr::IsoOctree const& isooctree)
         this->cornerValues[voxels[i].first.index] = voxels[i].second;
     }
 }
+
+inline void
+SimonIsoOctree::copy_voxel_data (fssr::MappedOctreeFile const& file)
+{
+    /* Compressed voxels are decoded in parallel upfront. */
+    std::vector<fssr::VoxelIndex> decoded_indices;
+    std::vector<fssr::VoxelData> decoded_data;
+    fssr::VoxelIndex const* indices = file.get_voxel_indices();
+    fssr::VoxelData const* data = file.get_voxel_data();
+    if (file.is_compressed() && file.get_num_voxels() > 0)
+    {
+        decoded_indices.resize(file.get_num_voxels());
+        decoded_data.resize(file.get_num_voxels());
+        file.decode_voxels(&decoded_indices[0], &decoded_data[0]);
+        indices = &decoded_indices[0];
+        data = &decoded_data[0];
+    }
+
+    for (std::size_t i = 0; i < file.get_num_voxels(); i++)
+    {
+        this->cornerValues[indices[i].index] = data[i];
+    }
+}
@@ -7,6 +7,7 @@
 
 #include "util/timer.h"
 #include "fssr/basis_function.h"
+#include "fssr/basis_kernel.h"
 
 TEST(BasisFunctionTest, TestWeightingFunction)
 {
@@ -32,3 +33,80 @@ TEST(BasisFunctionTest, TestMPUWeightingFunction)
         out << x << " " << fssr::weighting_function_mpu(x) << std::endl;
     out.close();
 }
+
+TEST(BasisFunctionTest, TransformPositionMatchesRotation)
+{
+    fssr::Sample sample;
+    sample.pos = math::Vec3f(1.0f, -2.0f, 0.5f);
+    sample.scale = 1.5f;
+    math::Vec3f const normals[4] = {
+        math::Vec3f(1.0f, 0.0f, 0.0f), math::Vec3f(-1.0f, 0.0f, 0.0f),
+        math::Vec3f(0.0f, 0.0f, 1.0f), math::Vec3f(1.0f, 2.0f, -3.0f) };
+
+    for (int i = 0; i < 4; ++i)
+    {
+        sample.normal = normals[i].normalized();
+        math::Matrix3f rot;
+        fssr::rotation_from_normal(sample.normal, &rot);
+        for (float x = -3.0f; x <= 3.0f; x += 0.75f)
+            for (float y = -3.0f; y <= 3.0f; y += 1.5f)
+            {
+                math::Vec3f const pos(x, y, 0.5f * x - y);
+                math::Vec3f const rpos = rot * (pos - sample.pos);
+                math::Vec3f const tpos = fssr::transform_position(pos, sample);
+                EXPECT_NEAR(rpos[0], tpos[0], 1e-5f);
+                EXPECT_NEAR(rpos.norm(), tpos.norm(), 1e-5f);
+                EXPECT_NEAR(fssr::gaussian_derivative(sample.scale, rpos),
+                    fssr::gaussian_derivative(sample.scale, tpos), 1e-5f);
+                EXPECT_NEAR(fssr::weighting_function(sample.scale, rpos),
+                    fssr::weighting_function(sample.scale, tpos), 1e-5f);
+            }
+    }
+}
+
+TEST(BasisFunctionTest, VectorizedKernelsMatchScalar)
+{
+    math::Vec3d const voxel_pos(0.5, -0.25, 1.0);
+    fssr::SampleBatch batch;
+    unsigned int seed = 3;
+    for (int i = 0; i < 1000; ++i)
+    {
+        float values[10];
+        for (int j = 0; j < 10; ++j)
+        {
+            seed = seed * 1103515245u + 12345u;
+            values[j] = static_cast<float>((seed >> 8) % 2000) / 1000.0f;
+        }
+        fssr::Sample sample;
+        sample.pos = math::Vec3f(values[0], values[1], values[2]) * 2.0f;
+        sample.normal = math::Vec3f(values[3] - 1.0f, values[4] - 1.0f,
+            values[5] - 1.0f + 0.01f).normalized();
+        sample.color = math::Vec3f(values[6], values[7], values[8]) / 2.0f;
+        sample.scale = 0.2f + values[9];
+        sample.confidence = 0.5f + values[3] / 4.0f;
+        batch.add_sample(sample, voxel_pos);
+    }
+
+    fssr::BasisSums scalar;
+    fssr::evaluate_basis_functions(&batch, &scalar,
+        fssr::BASIS_KERNEL_SCALAR);
+    EXPECT_GT(scalar.weight, 0.0);
+
+    fssr::BasisKernel const kernels[2] = {
+        fssr::BASIS_KERNEL_AVX2, fssr::BASIS_KERNEL_AVX512 };
+    for (int i = 0; i < 2; ++i)
+    {
+        if (!fssr::basis_kernel_supported(kernels[i]))
+            continue;
+        fssr::BasisSums sums;
+        fssr::evaluate_basis_functions(&batch, &sums, kernels[i]);
+        EXPECT_NEAR(scalar.ifn, sums.ifn, 1e-4 * std::abs(scalar.ifn));
+        EXPECT_NEAR(scalar.weight, sums.weight, 1e-4 * scalar.weight);
+        EXPECT_NEAR(scalar.scale, sums.scale, 1e-4 * scalar.scale);
+        EXPECT_NEAR(scalar.color_weight, sums.color_weight,
+            1e-4 * scalar.color_weight);
+        for (int j = 0; j < 3; ++j)
+            EXPECT_NEAR(scalar.color[j], sums.color[j],
+                1e-4 * scalar.color[j]);
+    }
+}
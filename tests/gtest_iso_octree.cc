@@ -1,11 +1,24 @@
 // Test cases for ISO octree.
 // Written by Simon Fuhrmann.
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <unistd.h>
 #include <gtest/gtest.h>
 
 #include "fssr/iso_octree.h"
+#include "fssr/octree_file.h"
 #include "fssr/sample.h"
+#include "iso/SimonIsoOctree.h"
+#include "iso/MarchingCubes.h"
 
 #if 0
 TEST(IsoOctreeTest, TempTest)
@@ -62,3 +75,624 @@ TEST(IsoOctreeTest, Temp2Test)
     std::cout << index2.index << std::endl;
 }
 #endif
+
+namespace
+{
+    /* Returns a temporary file name that is unique for this process. */
+    std::string
+    temp_filename (std::string const& name)
+    {
+        std::stringstream ss;
+        ss << "/tmp/fssr_test_" << ::getpid() << "_" << name;
+        return ss.str();
+    }
+
+    void
+    make_plane_octree (fssr::IsoOctree* octree)
+    {
+        for (int y = 0; y < 40; ++y)
+            for (int x = 0; x < 40; ++x)
+            {
+                fssr::Sample s;
+                s.pos = math::Vec3f(x * 0.05f - 1.0f, y * 0.05f - 1.0f,
+                    0.01f * ((x + y) % 3));
+                s.normal = math::Vec3f(0.0f, 0.0f, 1.0f);
+                s.color = math::Vec3f(1.0f, 0.5f, 0.25f);
+                s.scale = ((x + y) % 2) ? 0.1f : 0.15f;
+                s.confidence = 1.0f;
+                octree->insert_sample(s);
+            }
+        octree->make_regular_octree();
+    }
+
+    void
+    expect_same_voxels (fssr::IsoOctree::VoxelVector const& v1,
+        fssr::IsoOctree::VoxelVector const& v2)
+    {
+        ASSERT_EQ(v1.size(), v2.size());
+        for (std::size_t i = 0; i < v1.size(); ++i)
+        {
+            EXPECT_EQ(v1[i].first.index, v2[i].first.index);
+            EXPECT_EQ(v1[i].second.value, v2[i].second.value);
+            EXPECT_EQ(v1[i].second.conf, v2[i].second.conf);
+            EXPECT_EQ(v1[i].second.scale, v2[i].second.scale);
+            EXPECT_EQ(v1[i].second.color, v2[i].second.color);
+        }
+    }
+}
+
+TEST(IsoOctreeTest, SaturationThreshold)
+{
+    fssr::IsoOctree reference;
+    make_plane_octree(&reference);
+    reference.compute_voxels();
+    EXPECT_EQ(0u, reference.get_num_skipped_samples());
+
+    /* A threshold that is never reached must not change the result. */
+    fssr::IsoOctree unsaturated;
+    make_plane_octree(&unsaturated);
+    unsaturated.set_saturation_threshold(1e30f);
+    unsaturated.compute_voxels();
+    EXPECT_EQ(0u, unsaturated.get_num_skipped_samples());
+
+    fssr::IsoOctree::VoxelVector const& v1 = reference.get_voxels();
+    fssr::IsoOctree::VoxelVector const& v2 = unsaturated.get_voxels();
+    ASSERT_EQ(v1.size(), v2.size());
+    for (std::size_t i = 0; i < v1.size(); ++i)
+    {
+        EXPECT_EQ(v1[i].first.index, v2[i].first.index);
+        EXPECT_NEAR(v1[i].second.value, v2[i].second.value, 1e-5f);
+        EXPECT_NEAR(v1[i].second.conf, v2[i].second.conf, 1e-5f);
+    }
+
+    /* A low threshold skips samples but keeps the voxel confident. */
+    fssr::IsoOctree saturated;
+    make_plane_octree(&saturated);
+    saturated.set_saturation_threshold(0.5f);
+    saturated.compute_voxels();
+    EXPECT_GT(saturated.get_num_skipped_samples(), 0u);
+    fssr::IsoOctree::VoxelVector const& v3 = saturated.get_voxels();
+    ASSERT_EQ(v1.size(), v3.size());
+    for (std::size_t i = 0; i < v3.size(); ++i)
+        EXPECT_LE(v3[i].second.conf, v1[i].second.conf + 1e-5f);
+}
+
+TEST(IsoOctreeTest, SamplingEnginesMatchVoxelEngine)
+{
+    fssr::IsoOctree voxel_engine;
+    make_plane_octree(&voxel_engine);
+    voxel_engine.set_sampling_engine(fssr::IsoOctree::SAMPLING_VOXELS);
+    voxel_engine.compute_voxels();
+
+    fssr::IsoOctree::SamplingEngine const engines[2] = {
+        fssr::IsoOctree::SAMPLING_BRICKS, fssr::IsoOctree::SAMPLING_SCATTER };
+    for (int i = 0; i < 2; ++i)
+    {
+        fssr::IsoOctree engine;
+        make_plane_octree(&engine);
+        engine.set_sampling_engine(engines[i]);
+        engine.compute_voxels();
+        expect_same_voxels(voxel_engine.get_voxels(), engine.get_voxels());
+    }
+}
+
+TEST(IsoOctreeTest, VoxelsAreUniqueLeafCorners)
+{
+    fssr::IsoOctree octree;
+    make_plane_octree(&octree);
+    octree.refine_octree();
+    octree.set_max_level(5);
+    octree.compute_voxels();
+
+    /* Reference: Insert the corners of all leafs into a set. */
+    std::set<uint64_t> reference;
+    std::vector<fssr::Octree::Iterator> stack;
+    stack.push_back(octree.get_iterator_for_root());
+    while (!stack.empty())
+    {
+        fssr::Octree::Iterator iter = stack.back();
+        stack.pop_back();
+        if (iter.node_path.level < octree.get_max_level()
+            && !iter.node->is_leaf())
+        {
+            for (int i = 0; i < 8; ++i)
+                if (iter.node->has_child(i))
+                    stack.push_back(iter.descend(i));
+            continue;
+        }
+        for (int i = 0; i < 8; ++i)
+        {
+            fssr::VoxelIndex index;
+            index.from_path_and_corner(iter.node_path, i);
+            reference.insert(index.index);
+        }
+    }
+
+    fssr::IsoOctree::VoxelVector const& voxels = octree.get_voxels();
+    ASSERT_EQ(reference.size(), voxels.size());
+    std::size_t i = 0;
+    for (std::set<uint64_t>::const_iterator it = reference.begin();
+        it != reference.end(); ++it, ++i)
+        EXPECT_EQ(*it, voxels[i].first.index);
+}
+
+namespace
+{
+    struct VoxelIndexLess
+    {
+        bool operator() (fssr::IsoOctree::VoxelVector::value_type const& a,
+            fssr::IsoOctree::VoxelVector::value_type const& b) const
+        {
+            return a.first.index < b.first.index;
+        }
+    };
+
+    struct Vec3fLess
+    {
+        bool operator() (math::Vec3f const& a, math::Vec3f const& b) const
+        {
+            return std::lexicographical_compare(*a, *a + 3, *b, *b + 3);
+        }
+    };
+
+    struct CountingProgress : public fssr::SamplingProgress
+    {
+        std::size_t num_calls;
+        std::size_t last_done;
+        std::size_t last_total;
+        bool monotonic;
+
+        CountingProgress (void)
+            : num_calls(0), last_done(0), last_total(0), monotonic(true)
+        {
+        }
+
+        void on_progress (std::size_t voxels_done, std::size_t voxels_total)
+        {
+            this->monotonic = this->monotonic && voxels_done >= last_done;
+            this->num_calls += 1;
+            this->last_done = voxels_done;
+            this->last_total = voxels_total;
+        }
+    };
+}
+
+TEST(IsoOctreeTest, ProgressCallback)
+{
+    fssr::IsoOctree octree;
+    make_plane_octree(&octree);
+    CountingProgress progress;
+    octree.set_progress_callback(&progress);
+    octree.compute_voxels();
+
+    EXPECT_GT(progress.num_calls, 0u);
+    EXPECT_TRUE(progress.monotonic);
+    EXPECT_EQ(octree.get_voxels().size(), progress.last_total);
+    EXPECT_EQ(progress.last_total, progress.last_done);
+}
+
+TEST(IsoOctreeTest, VoxelMortonCode)
+{
+    fssr::VoxelIndex index;
+    index.index = 1;
+    EXPECT_EQ(1u, index.get_morton_code());
+    index.index = uint64_t(1) << 21;
+    EXPECT_EQ(2u, index.get_morton_code());
+    index.index = uint64_t(1) << 42;
+    EXPECT_EQ(4u, index.get_morton_code());
+    index.index = 3 | uint64_t(2) << 21;
+    EXPECT_EQ(1u | 8u | 16u, index.get_morton_code());
+    index.index = 0x1fffff | uint64_t(0x1fffff) << 21
+        | uint64_t(0x1fffff) << 42;
+    EXPECT_EQ((uint64_t(1) << 63) - 1, index.get_morton_code());
+}
+
+TEST(IsoOctreeTest, CheckpointResume)
+{
+    std::string const filename = temp_filename("checkpoint");
+    std::remove(filename.c_str());
+
+    fssr::IsoOctree reference;
+    make_plane_octree(&reference);
+    reference.set_checkpoint(filename, 0, false);
+    reference.compute_voxels();
+    fssr::IsoOctree::VoxelVector const& v1 = reference.get_voxels();
+
+    /* Truncate the checkpoint in the middle of a voxel record. */
+    std::string content;
+    {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        content.assign(std::istreambuf_iterator<char>(in),
+            std::istreambuf_iterator<char>());
+    }
+    ASSERT_GT(content.size(), v1.size() * 28);
+    {
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out.write(content.data(), content.size() - v1.size() * 14 - 5);
+    }
+
+    /* Resume evaluates the missing voxels only. */
+    CountingProgress progress;
+    fssr::IsoOctree resumed;
+    make_plane_octree(&resumed);
+    resumed.set_checkpoint(filename, 0, true);
+    resumed.set_progress_callback(&progress);
+    resumed.compute_voxels();
+
+    fssr::IsoOctree::VoxelVector const& v2 = resumed.get_voxels();
+    expect_same_voxels(v1, v2);
+    EXPECT_EQ(v2.size(), progress.last_done);
+
+    /* A checkpoint for another saturation threshold is not resumed. */
+    fssr::IsoOctree saturated;
+    make_plane_octree(&saturated);
+    saturated.set_saturation_threshold(0.5f);
+    saturated.set_checkpoint(filename, 0, true);
+    saturated.compute_voxels();
+    fssr::IsoOctree::VoxelVector const& v3 = saturated.get_voxels();
+    ASSERT_EQ(v1.size(), v3.size());
+    std::size_t num_saturated = 0;
+    for (std::size_t i = 0; i < v1.size(); ++i)
+        num_saturated += v3[i].second.conf < v1[i].second.conf - 1e-5f;
+    EXPECT_GT(num_saturated, 0u);
+    std::remove(filename.c_str());
+}
+
+TEST(IsoOctreeTest, UpdateMatchesFullComputation)
+{
+    /* New fine-scale samples in one corner of the plane. */
+    std::vector<fssr::Sample> new_samples;
+    for (int i = 0; i < 16; ++i)
+    {
+        fssr::Sample s;
+        s.pos = math::Vec3f(-0.9f + (i % 4) * 0.02f,
+            -0.9f + (i / 4) * 0.02f, 0.0f);
+        s.normal = math::Vec3f(0.0f, 0.0f, 1.0f);
+        s.color = math::Vec3f(0.0f, 1.0f, 0.0f);
+        s.scale = 0.03f;
+        s.confidence = 1.0f;
+        new_samples.push_back(s);
+    }
+
+    fssr::IsoOctree previous;
+    make_plane_octree(&previous);
+    previous.compute_voxels();
+
+    fssr::IsoOctree reference;
+    make_plane_octree(&reference);
+    for (std::size_t i = 0; i < new_samples.size(); ++i)
+        reference.insert_sample(new_samples[i]);
+    reference.make_regular_octree();
+    reference.compute_voxels();
+
+    CountingProgress progress;
+    fssr::IsoOctree updated;
+    make_plane_octree(&updated);
+    for (std::size_t i = 0; i < new_samples.size(); ++i)
+        updated.insert_sample(new_samples[i]);
+    updated.make_regular_octree();
+    updated.set_update(previous, new_samples);
+    updated.set_progress_callback(&progress);
+    updated.compute_voxels();
+
+    fssr::IsoOctree::VoxelVector const& v1 = reference.get_voxels();
+    fssr::IsoOctree::VoxelVector const& v2 = updated.get_voxels();
+    ASSERT_GT(v1.size(), previous.get_voxels().size());
+    expect_same_voxels(v1, v2);
+    EXPECT_EQ(v2.size(), progress.last_done);
+
+    /* Most previous voxels are reused, only the others are evaluated. */
+    EXPECT_EQ(0u, reference.get_num_reused_voxels());
+    EXPECT_EQ(v1.size(), reference.get_num_evaluated_voxels());
+    EXPECT_GT(updated.get_num_reused_voxels(),
+        previous.get_voxels().size() * 3 / 4);
+    EXPECT_EQ(v2.size(), updated.get_num_reused_voxels()
+        + updated.get_num_evaluated_voxels());
+    EXPECT_LT(updated.get_num_evaluated_voxels(), v2.size() / 4);
+}
+
+TEST(IsoOctreeTest, UpdateWithExpandedRoot)
+{
+    /* New samples far outside the plane expand the octree root. */
+    std::vector<fssr::Sample> new_samples;
+    for (int i = 0; i < 16; ++i)
+    {
+        fssr::Sample s;
+        s.pos = math::Vec3f(3.0f + (i % 4) * 0.02f,
+            3.0f + (i / 4) * 0.02f, 3.0f);
+        s.normal = math::Vec3f(0.0f, 0.0f, 1.0f);
+        s.color = math::Vec3f(0.0f, 1.0f, 0.0f);
+        s.scale = 0.03f;
+        s.confidence = 1.0f;
+        new_samples.push_back(s);
+    }
+
+    fssr::IsoOctree previous;
+    make_plane_octree(&previous);
+    previous.compute_voxels();
+
+    fssr::IsoOctree reference;
+    make_plane_octree(&reference);
+    for (std::size_t i = 0; i < new_samples.size(); ++i)
+        reference.insert_sample(new_samples[i]);
+    reference.make_regular_octree();
+    reference.compute_voxels();
+    ASSERT_NE(previous.get_root_node_size(), reference.get_root_node_size());
+
+    fssr::IsoOctree updated;
+    make_plane_octree(&updated);
+    for (std::size_t i = 0; i < new_samples.size(); ++i)
+        updated.insert_sample(new_samples[i]);
+    updated.make_regular_octree();
+    updated.set_update(previous, new_samples);
+    updated.compute_voxels();
+
+    fssr::IsoOctree::VoxelVector const& v1 = reference.get_voxels();
+    fssr::IsoOctree::VoxelVector const& v2 = updated.get_voxels();
+    expect_same_voxels(v1, v2);
+    EXPECT_EQ(0u, updated.get_num_reused_voxels());
+    EXPECT_EQ(v2.size(), updated.get_num_evaluated_voxels());
+}
+
+TEST(IsoOctreeTest, WriteReadContainer)
+{
+    std::string const filename = temp_filename("octree");
+    fssr::IsoOctree octree;
+    make_plane_octree(&octree);
+    octree.compute_voxels();
+    octree.set_tile_level(0);
+    octree.write_to_file(filename);
+    fssr::IsoOctree::VoxelVector const& v1 = octree.get_voxels();
+
+    /* The mapped arrays are aligned and equal the written voxels. */
+    fssr::MappedOctreeFile file;
+    ASSERT_TRUE(fssr::MappedOctreeFile::is_container(filename));
+    file.map(filename);
+    ASSERT_EQ(v1.size(), file.get_num_voxels());
+    EXPECT_EQ(0u, reinterpret_cast<std::size_t>(file.get_voxel_indices())
+        % FSSR_OCTREE_CONTAINER_ALIGNMENT);
+    EXPECT_EQ(0u, reinterpret_cast<std::size_t>(file.get_voxel_data())
+        % FSSR_OCTREE_CONTAINER_ALIGNMENT);
+    for (std::size_t i = 0; i < v1.size(); ++i)
+    {
+        EXPECT_EQ(v1[i].first.index, file.get_voxel_indices()[i].index);
+        EXPECT_EQ(v1[i].second.value, file.get_voxel_data()[i].value);
+        EXPECT_EQ(v1[i].second.color, file.get_voxel_data()[i].color);
+    }
+    fssr::Octree hierarchy;
+    file.read_hierarchy(&hierarchy);
+    EXPECT_EQ(octree.get_num_nodes(), hierarchy.get_num_nodes());
+    file.close();
+
+    fssr::IsoOctree loaded;
+    loaded.read_from_file(filename);
+    fssr::IsoOctree::VoxelVector const& v2 = loaded.get_voxels();
+    expect_same_voxels(v1, v2);
+    EXPECT_EQ(octree.get_num_nodes(), loaded.get_num_nodes());
+    EXPECT_EQ(octree.get_num_levels(), loaded.get_num_levels());
+
+    /* Truncated files are rejected. */
+    std::string content;
+    {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        content.assign(std::istreambuf_iterator<char>(in),
+            std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out.write(content.data(), content.size() - 4);
+    }
+    EXPECT_THROW(file.map(filename), std::runtime_error);
+    std::remove(filename.c_str());
+}
+
+TEST(IsoOctreeTest, ReadLegacyFile)
+{
+    std::string const filename = temp_filename("octree_legacy");
+    fssr::IsoOctree octree;
+    make_plane_octree(&octree);
+    octree.compute_voxels();
+    fssr::IsoOctree::VoxelVector const& v1 = octree.get_voxels();
+
+    /* Legacy layout: Identifier, hierarchy, voxel count, voxel records. */
+    {
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out << "FSSR_OCTREE\n";
+        octree.write_hierarchy(out);
+        out << "\n" << v1.size() << "\n";
+        for (std::size_t i = 0; i < v1.size(); ++i)
+        {
+            fssr::VoxelData const& d = v1[i].second;
+            out.write(reinterpret_cast<char const*>(&v1[i].first.index), 8);
+            out.write(reinterpret_cast<char const*>(&d.value), 4);
+            out.write(reinterpret_cast<char const*>(&d.conf), 4);
+            out.write(reinterpret_cast<char const*>(&d.scale), 4);
+            out.write(reinterpret_cast<char const*>(*d.color), 12);
+        }
+    }
+    EXPECT_FALSE(fssr::MappedOctreeFile::is_container(filename));
+
+    fssr::IsoOctree loaded;
+    loaded.read_from_file(filename);
+    fssr::IsoOctree::VoxelVector const& v2 = loaded.get_voxels();
+    expect_same_voxels(v1, v2);
+    std::remove(filename.c_str());
+}
+
+TEST(IsoOctreeTest, WriteReadCompressed)
+{
+    std::string const filename = temp_filename("octree_compressed");
+    fssr::IsoOctree octree;
+    make_plane_octree(&octree);
+    octree.compute_voxels();
+    fssr::IsoOctree::VoxelVector const& v1 = octree.get_voxels();
+    EXPECT_THROW(octree.set_compression_level(10), std::invalid_argument);
+    octree.set_tile_level(0);
+
+    std::size_t file_sizes[2];
+    int const levels[2] = { 1, 9 };
+    for (int l = 0; l < 2; ++l)
+    {
+        octree.set_compression_level(levels[l]);
+        octree.write_to_file(filename);
+
+        fssr::MappedOctreeFile file;
+        file.map(filename);
+        EXPECT_TRUE(file.is_compressed());
+        ASSERT_EQ(v1.size(), file.get_num_voxels());
+        std::vector<fssr::VoxelIndex> indices(v1.size());
+        std::vector<fssr::VoxelData> data(v1.size());
+        file.decode_voxels(&indices[0], &data[0]);
+        for (std::size_t i = 0; i < v1.size(); ++i)
+        {
+            EXPECT_EQ(v1[i].first.index, indices[i].index);
+            EXPECT_EQ(v1[i].second.value, data[i].value);
+            EXPECT_EQ(v1[i].second.color, data[i].color);
+        }
+        file.close();
+
+        fssr::IsoOctree loaded;
+        loaded.read_from_file(filename);
+        fssr::IsoOctree::VoxelVector const& v2 = loaded.get_voxels();
+        expect_same_voxels(v1, v2);
+
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        in.seekg(0, std::ios::end);
+        file_sizes[l] = in.tellg();
+    }
+    EXPECT_LT(file_sizes[0], v1.size() * 32);
+    EXPECT_LE(file_sizes[1], file_sizes[0]);
+
+    /* Corrupt voxel blocks are detected. */
+    std::string content;
+    {
+        std::ifstream in(filename.c_str(), std::ios::binary);
+        content.assign(std::istreambuf_iterator<char>(in),
+            std::istreambuf_iterator<char>());
+    }
+    content[content.size() - 8] ^= 0x5a;
+    {
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out.write(content.data(), content.size());
+    }
+    fssr::IsoOctree corrupt;
+    EXPECT_THROW(corrupt.read_from_file(filename), std::runtime_error);
+    std::remove(filename.c_str());
+}
+
+TEST(IsoOctreeTest, WriteReadTiled)
+{
+    std::string const filename = temp_filename("octree_tiled");
+    fssr::IsoOctree octree;
+    make_plane_octree(&octree);
+    octree.compute_voxels();
+    fssr::IsoOctree::VoxelVector const& v1 = octree.get_voxels();
+    EXPECT_THROW(octree.set_tile_level(-1), std::invalid_argument);
+    EXPECT_THROW(octree.set_tile_level(FSSR_OCTREE_CONTAINER_MAX_TILE_LEVEL
+        + 1), std::invalid_argument);
+    octree.set_tile_level(3);
+
+    for (int compression = 0; compression < 2; ++compression)
+    {
+        octree.set_compression_level(compression);
+        octree.write_to_file(filename);
+
+        fssr::MappedOctreeFile file;
+        file.map(filename);
+        EXPECT_EQ(3, file.get_tile_level());
+        EXPECT_GT(file.get_num_tiles(), 1u);
+        file.close();
+
+        /* Loading all tiles restores the octree. */
+        fssr::IsoOctree loaded;
+        loaded.read_from_file(filename);
+        fssr::IsoOctree::VoxelVector const& v2 = loaded.get_voxels();
+        expect_same_voxels(v1, v2);
+        EXPECT_EQ(octree.get_num_nodes(), loaded.get_num_nodes());
+        EXPECT_EQ(octree.get_num_levels(), loaded.get_num_levels());
+
+        /* A region loads a subset of the voxels with the same data. */
+        math::Vec3d const aabb_min(-0.9, -0.9, -0.1);
+        math::Vec3d const aabb_max(-0.8, -0.8, 0.1);
+        fssr::IsoOctree region;
+        region.read_from_file(filename, aabb_min, aabb_max);
+        fssr::IsoOctree::VoxelVector const& v3 = region.get_voxels();
+        ASSERT_GT(v3.size(), 0u);
+        EXPECT_LT(v3.size(), v1.size() / 2);
+        EXPECT_LT(region.get_num_nodes(), octree.get_num_nodes());
+        std::size_t j = 0;
+        for (std::size_t i = 0; i < v3.size(); ++i)
+        {
+            while (j < v1.size() && v1[j].first.index < v3[i].first.index)
+                j += 1;
+            ASSERT_LT(j, v1.size());
+            EXPECT_EQ(v1[j].first.index, v3[i].first.index);
+            EXPECT_EQ(v1[j].second.value, v3[i].second.value);
+            EXPECT_EQ(v1[j].second.conf, v3[i].second.conf);
+        }
+
+        /* All voxels inside the region are loaded. */
+        std::size_t num_inside = 0;
+        for (std::size_t i = 0; i < v1.size(); ++i)
+        {
+            fssr::VoxelIndex index = v1[i].first;
+            math::Vec3d const pos = index.compute_position(
+                octree.get_root_node_center(), octree.get_root_node_size());
+            bool inside = true;
+            for (int k = 0; k < 3; ++k)
+                inside = inside && pos[k] >= aabb_min[k]
+                    && pos[k] <= aabb_max[k];
+            if (!inside)
+                continue;
+            num_inside += 1;
+            EXPECT_TRUE(std::binary_search(v3.begin(), v3.end(), v1[i],
+                VoxelIndexLess()));
+        }
+        EXPECT_GT(num_inside, 0u);
+
+        /* An empty region loads the top hierarchy only. */
+        fssr::IsoOctree outside;
+        outside.read_from_file(filename, math::Vec3d(10.0, 10.0, 10.0),
+            math::Vec3d(11.0, 11.0, 11.0));
+        EXPECT_EQ(0u, outside.get_voxels().size());
+    }
+    std::remove(filename.c_str());
+}
+
+TEST(IsoOctreeTest, ExtractTiledRegion)
+{
+    std::string const filename = temp_filename("octree_region");
+    {
+        fssr::IsoOctree octree;
+        make_plane_octree(&octree);
+        octree.compute_voxels();
+        octree.set_tile_level(3);
+        octree.write_to_file(filename);
+    }
+
+    MarchingCubes::SetCaseTable();
+    MarchingCubes::SetFullCaseTable();
+    mve::TriangleMesh::Ptr meshes[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        fssr::IsoOctree octree;
+        if (i == 0)
+            octree.read_from_file(filename);
+        else
+            octree.read_from_file(filename, math::Vec3d(-0.5, -0.5, -0.1),
+                math::Vec3d(-0.3, -0.3, 0.1));
+        SimonIsoOctree iso_tree;
+        iso_tree.set_octree(octree);
+        meshes[i] = iso_tree.extract_mesh();
+    }
+
+    /* The region only extracts the surface of the loaded voxels. */
+    mve::TriangleMesh::VertexList const& full = meshes[0]->get_vertices();
+    mve::TriangleMesh::VertexList const& region = meshes[1]->get_vertices();
+    ASSERT_GT(region.size(), 0u);
+    EXPECT_LT(region.size(), full.size());
+    std::set<math::Vec3f, Vec3fLess> full_set(full.begin(), full.end());
+    for (std::size_t i = 0; i < region.size(); ++i)
+        EXPECT_EQ(1u, full_set.count(region[i]));
+    std::remove(filename.c_str());
+}
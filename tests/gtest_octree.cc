@@ -2,6 +2,8 @@
 // Written by Simon Fuhrmann.
 
 #include <sstream>
+#include <stdexcept>
+#include <string>
 #include <gtest/gtest.h>
 
 #include "fssr/octree.h"
@@ -114,41 +116,342 @@ TEST(OctreeTest, TestInsertIntoOctants)
     EXPECT_EQ(9, octree.get_num_nodes());
 }
 
+namespace
+{
+    std::string
+    packed_hierarchy (std::string const& masks)
+    {
+        uint64_t const num_masks = masks.size();
+        return std::string(1, 'P') + std::string(
+            reinterpret_cast<char const*>(&num_masks), sizeof(uint64_t))
+            + masks;
+    }
+
+    /* Reads the legacy hierarchy, and checks the packed re-encoding. */
+    void
+    test_hierarchy (std::string const& legacy, std::string const& masks)
+    {
+        std::stringstream ss_in(legacy);
+        std::stringstream ss_out;
+        fssr::Octree octree;
+        octree.read_hierarchy(ss_in, false);
+        octree.write_hierarchy(ss_out, false);
+        EXPECT_EQ(packed_hierarchy(masks), ss_out.str());
+
+        std::stringstream ss_packed(ss_out.str());
+        std::stringstream ss_out2;
+        fssr::Octree octree2;
+        octree2.read_hierarchy(ss_packed, false);
+        octree2.write_hierarchy(ss_out2, false);
+        EXPECT_EQ(ss_out.str(), ss_out2.str());
+    }
+}
+
 TEST(OctreeTest, OctreeReadWriteEmpty)
 {
     // Just an empty octree.
-    std::stringstream ss_in("0");
-    std::stringstream ss_out;
-
-    fssr::Octree octree;
-    octree.read_hierarchy(ss_in, false);
-    octree.write_hierarchy(ss_out, false);
-    EXPECT_EQ(ss_out.str(), ss_in.str());
+    test_hierarchy("0", "");
 }
 
 TEST(OctreeTest, OctreeReadWriteRootOnly)
 {
     // Root node with no children.
-    std::stringstream ss_in("100000000");
-    std::stringstream ss_out;
-
-    fssr::Octree octree;
-    octree.read_hierarchy(ss_in, false);
-    octree.write_hierarchy(ss_out, false);
-    EXPECT_EQ(ss_out.str(), ss_in.str());
+    test_hierarchy("100000000", std::string(1, '\0'));
 }
 
 TEST(OctreeTest, OctreeReadWriteHierarcy1)
 {
     // More complicated hierarchy. Root node with two children.
     // Each child has another child.
-    std::stringstream ss_in(
+    test_hierarchy(
     //       root       child 1    child 2    child 1.1  child 2.1
-        "1" "00100100" "00010000" "00000010" "00000000" "00000000");
-    std::stringstream ss_out;
+        "1" "00100100" "00010000" "00000010" "00000000" "00000000",
+        std::string("\x24\x08\x40\0\0", 5));
+}
+
+TEST(OctreeTest, OctreeReadWriteWithMeta)
+{
+    fssr::Sample s;
+    s.pos = math::Vec3f(0.0f);
+    s.scale = 1.0f;
+    fssr::Octree octree;
+    octree.insert_sample(s);
+    s.pos = math::Vec3f(0.3f, 0.2f, -0.1f);
+    s.scale = 0.1f;
+    octree.insert_sample(s);
+
+    std::stringstream ss;
+    octree.write_hierarchy(ss);
+    fssr::Octree octree2;
+    octree2.read_hierarchy(ss);
+    EXPECT_EQ(octree.get_num_nodes(), octree2.get_num_nodes());
+    EXPECT_EQ(octree.get_num_levels(), octree2.get_num_levels());
+    EXPECT_EQ(octree.get_root_node_size(), octree2.get_root_node_size());
+    EXPECT_EQ(ss.tellg(), ss.tellp());
+
+    /* Truncated packed hierarchies are rejected. */
+    std::string const truncated = ss.str().substr(0, ss.str().size() - 1);
+    std::stringstream ss_truncated(truncated);
+    EXPECT_THROW(octree2.read_hierarchy(ss_truncated), std::runtime_error);
+}
+
+TEST(OctreeTest, InitRootNoExpansion)
+{
+    fssr::Sample s[3];
+    s[0].pos = math::Vec3f(-1.0f, 0.0f, 0.0f);
+    s[0].scale = 0.5f;
+    s[1].pos = math::Vec3f(3.0f, 1.0f, 2.0f);
+    s[1].scale = 1.0f;
+    s[2].pos = math::Vec3f(0.0f, 2.0f, 0.5f);
+    s[2].scale = 0.25f;
+
+    fssr::Octree octree1, octree2;
+    octree1.init_root(math::Vec3d(-1.0, 0.0, 0.0),
+        math::Vec3d(3.0, 2.0, 2.0), 1.0);
+    octree2.init_root(math::Vec3d(-1.0, 0.0, 0.0),
+        math::Vec3d(3.0, 2.0, 2.0), 1.0);
+    EXPECT_EQ(math::Vec3d(1.0, 1.0, 1.0), octree1.get_root_node_center());
+    EXPECT_EQ(4.0, octree1.get_root_node_size());
+
+    for (int i = 0; i < 3; ++i)
+    {
+        octree1.insert_sample(s[i]);
+        octree2.insert_sample(s[2 - i]);
+    }
+    EXPECT_EQ(math::Vec3d(1.0, 1.0, 1.0), octree1.get_root_node_center());
+    EXPECT_EQ(4.0, octree1.get_root_node_size());
+    EXPECT_EQ(3, octree1.get_num_samples());
+    EXPECT_EQ(octree1.get_num_nodes(), octree2.get_num_nodes());
+    EXPECT_EQ(octree1.get_num_levels(), octree2.get_num_levels());
+
+    std::stringstream ss1, ss2;
+    octree1.write_hierarchy(ss1);
+    octree2.write_hierarchy(ss2);
+    EXPECT_EQ(ss1.str(), ss2.str());
+}
+
+namespace
+{
+    void
+    compare_subtrees (fssr::Octree::Iterator const& iter1,
+        fssr::Octree::Iterator const& iter2)
+    {
+        ASSERT_EQ(iter1.node == NULL, iter2.node == NULL);
+        if (iter1.node == NULL)
+            return;
+
+        std::vector<fssr::Sample const*> samples1, samples2;
+        iter1.octree->get_node_samples(iter1.node, &samples1);
+        iter2.octree->get_node_samples(iter2.node, &samples2);
+        ASSERT_EQ(samples1.size(), samples2.size());
+        for (std::size_t i = 0; i < samples1.size(); ++i)
+        {
+            EXPECT_EQ(samples1[i]->pos, samples2[i]->pos);
+            EXPECT_EQ(samples1[i]->scale, samples2[i]->scale);
+        }
+        for (int i = 0; i < 8; ++i)
+            compare_subtrees(iter1.descend(i), iter2.descend(i));
+    }
+}
 
+TEST(OctreeTest, BulkInsertMatchesIncremental)
+{
+    /* Deterministic pseudo-random samples with a wide range of scales. */
+    fssr::PointSet pset;
+    unsigned int seed = 1;
+    for (int i = 0; i < 20000; ++i)
+    {
+        fssr::Sample sample;
+        for (int j = 0; j < 3; ++j)
+        {
+            seed = seed * 1103515245u + 12345u;
+            sample.pos[j] = static_cast<float>((seed >> 8) % 10000) / 100.0f;
+        }
+        seed = seed * 1103515245u + 12345u;
+        sample.scale = 0.05f * static_cast<float>(1 << ((seed >> 8) % 8));
+        sample.normal = math::Vec3f(0.0f, 0.0f, 1.0f);
+        pset.get_samples().push_back(sample);
+    }
+
+    fssr::Octree octree1, octree2;
+    octree1.insert_samples(pset);
+    for (std::size_t i = 0; i < pset.get_samples().size(); ++i)
+        octree2.insert_sample(pset.get_samples()[i]);
+
+    EXPECT_EQ(octree2.get_num_samples(), octree1.get_num_samples());
+    EXPECT_EQ(octree2.get_num_nodes(), octree1.get_num_nodes());
+    EXPECT_EQ(octree2.get_root_node_center(), octree1.get_root_node_center());
+    EXPECT_EQ(octree2.get_root_node_size(), octree1.get_root_node_size());
+    compare_subtrees(octree1.get_iterator_for_root(),
+        octree2.get_iterator_for_root());
+}
+
+TEST(OctreeTest, BulkInsertOnExpandedRootFace)
+{
+    /*
+     * The second sample lies on the lower face of the root. The third
+     * sample expands the root across this face, and the second sample
+     * must remain in the subtree of the previous root.
+     */
+    float const data[][4] = {
+        { 0.0f, 0.0f, 0.0f, 1.0f },
+        { -0.5f, 0.1f, -0.5f, 0.1f },
+        { -0.5f, -0.5f, 0.2f, 0.2f },
+        { -3.0f, -3.0f, -3.0f, 0.1f },
+        { 0.3f, 0.3f, 0.3f, 0.1f } };
+    fssr::PointSet pset;
+    for (int i = 0; i < 5; ++i)
+    {
+        fssr::Sample sample;
+        sample.pos = math::Vec3f(data[i][0], data[i][1], data[i][2]);
+        sample.scale = data[i][3];
+        sample.normal = math::Vec3f(0.0f, 0.0f, 1.0f);
+        pset.get_samples().push_back(sample);
+    }
+
+    fssr::Octree octree1, octree2;
+    octree1.insert_samples(pset);
+    for (std::size_t i = 0; i < pset.get_samples().size(); ++i)
+        octree2.insert_sample(pset.get_samples()[i]);
+
+    EXPECT_EQ(octree2.get_num_nodes(), octree1.get_num_nodes());
+    EXPECT_EQ(octree2.get_root_node_size(), octree1.get_root_node_size());
+    compare_subtrees(octree1.get_iterator_for_root(),
+        octree2.get_iterator_for_root());
+}
+
+TEST(OctreeTest, RepeatedBulkInsertMemory)
+{
+    /* Many small bulk insertions, such as one point set per view. */
     fssr::Octree octree;
-    octree.read_hierarchy(ss_in, false);
-    octree.write_hierarchy(ss_out, false);
-    EXPECT_EQ(ss_out.str(), ss_in.str());
+    unsigned int seed = 3;
+    for (int k = 0; k < 100; ++k)
+    {
+        fssr::PointSet pset;
+        for (int i = 0; i < 20; ++i)
+        {
+            fssr::Sample sample;
+            for (int j = 0; j < 3; ++j)
+            {
+                seed = seed * 1103515245u + 12345u;
+                sample.pos[j] = static_cast<float>((seed >> 8) % 10000)
+                    / 100.0f;
+            }
+            sample.scale = 0.1f;
+            sample.normal = math::Vec3f(0.0f, 0.0f, 1.0f);
+            pset.get_samples().push_back(sample);
+        }
+        octree.insert_samples(pset);
+    }
+    EXPECT_EQ(2000u, octree.get_num_samples());
+
+    /* Memory grows with the nodes, only a few chunks remain unused. */
+    std::size_t const chunk_size = sizeof(fssr::Octree::Node)
+        << FSSR_NODE_ARENA_CHUNK_BITS;
+    std::size_t const data_size = 8 * sizeof(fssr::Octree::Node)
+        * octree.get_num_nodes() + 2 * octree.get_num_samples()
+        * (sizeof(fssr::Sample) + sizeof(uint32_t));
+    EXPECT_LT(octree.get_memory_usage(), data_size + 64 * chunk_size);
+}
+
+TEST(OctreeTest, FinalizePacksSamples)
+{
+    fssr::Octree octree;
+    for (int i = 0; i < 100; ++i)
+    {
+        fssr::Sample sample;
+        sample.pos = math::Vec3f(float(i % 10), float(i / 10), float(i % 7));
+        sample.scale = (i % 3 == 0 ? 4.0f : 1.0f);
+        sample.confidence = float(i);
+        octree.insert_sample(sample);
+    }
+
+    math::Vec3d const query(4.0, 5.0, 3.0);
+    std::vector<fssr::Sample const*> before, after;
+    octree.influence_query(query, 3.0, &before);
+    octree.finalize();
+    EXPECT_TRUE(octree.is_finalized());
+    octree.influence_query(query, 3.0, &after);
+    ASSERT_EQ(before.size(), after.size());
+
+    /* Samples of every node are in insertion order after finalize. */
+    std::vector<fssr::Sample const*> samples;
+    octree.get_node_samples(octree.get_root_node(), &samples);
+    for (std::size_t i = 1; i < samples.size(); ++i)
+        EXPECT_LT(samples[i - 1]->confidence, samples[i]->confidence);
+
+    /* Inserting after finalize keeps all samples. */
+    fssr::Sample sample;
+    sample.pos = query;
+    sample.scale = 1.0f;
+    octree.insert_sample(sample);
+    EXPECT_FALSE(octree.is_finalized());
+    after.clear();
+    octree.influence_query(query, 3.0, &after);
+    EXPECT_EQ(before.size() + 1, after.size());
+    octree.finalize();
+    after.clear();
+    octree.influence_query(query, 3.0, &after);
+    EXPECT_EQ(before.size() + 1, after.size());
+}
+
+TEST(OctreeTest, ConcurrentInsertion)
+{
+    std::vector<fssr::Sample> samples;
+    unsigned int seed = 7;
+    for (int i = 0; i < 20000; ++i)
+    {
+        fssr::Sample sample;
+        for (int j = 0; j < 3; ++j)
+        {
+            seed = seed * 1103515245u + 12345u;
+            sample.pos[j] = static_cast<float>((seed >> 8) % 10000) / 100.0f;
+        }
+        seed = seed * 1103515245u + 12345u;
+        sample.scale = 0.05f * static_cast<float>(1 << ((seed >> 8) % 8));
+        samples.push_back(sample);
+    }
+
+    math::Vec3d const aabb_min(0.0, 0.0, 0.0);
+    math::Vec3d const aabb_max(100.0, 100.0, 100.0);
+    fssr::Octree octree1, octree2;
+    octree1.init_root(aabb_min, aabb_max, 6.4);
+    octree2.init_root(aabb_min, aabb_max, 6.4);
+    for (std::size_t i = 0; i < samples.size(); ++i)
+        octree1.insert_sample(samples[i]);
+
+    /* Samples outside the root are rejected without aborting. */
+    fssr::Sample outside;
+    outside.pos = math::Vec3f(-50.0f, 50.0f, 50.0f);
+    outside.scale = 1.0f;
+    /* Four threads insert concurrently even on single core machines. */
+    octree2.set_concurrent_insertion(true);
+#pragma omp parallel for num_threads(4)
+    for (std::size_t i = 0; i < samples.size(); ++i)
+    {
+        octree2.insert_sample(samples[i]);
+        if (i % 100 == 0)
+            octree2.insert_sample(outside);
+    }
+    octree2.set_concurrent_insertion(false);
+    EXPECT_EQ((samples.size() + 99) / 100,
+        octree2.get_num_rejected_samples());
+
+    EXPECT_EQ(octree1.get_num_samples(), octree2.get_num_samples());
+    EXPECT_EQ(octree1.get_num_nodes(), octree2.get_num_nodes());
+    std::stringstream ss1, ss2;
+    octree1.write_hierarchy(ss1);
+    octree2.write_hierarchy(ss2);
+    EXPECT_EQ(ss1.str(), ss2.str());
+
+    std::vector<std::size_t> stats1, stats2;
+    octree1.get_points_per_level(&stats1);
+    octree2.get_points_per_level(&stats2);
+    EXPECT_EQ(stats1, stats2);
+
+    math::Vec3d const query(50.0, 50.0, 50.0);
+    std::vector<fssr::Sample const*> result1, result2;
+    octree1.influence_query(query, 3.0, &result1);
+    octree2.influence_query(query, 3.0, &result2);
+    EXPECT_EQ(result1.size(), result2.size());
 }
@@ -0,0 +1,156 @@
+// Test cases for point set loading.
+// Written by Simon Fuhrmann.
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <gtest/gtest.h>
+
+#include "fssr/pointset.h"
+#include "fssr/sample.h"
+
+namespace
+{
+    /* Returns a temporary file name that is unique for this process. */
+    std::string
+    temp_filename (std::string const& name)
+    {
+        std::stringstream ss;
+        ss << "/tmp/fssr_test_" << ::getpid() << "_" << name;
+        return ss.str();
+    }
+
+    void
+    write_binary_ply (std::string const& filename, int num_verts)
+    {
+        std::ofstream out(filename.c_str(), std::ios::binary);
+        out << "ply\nformat binary_little_endian 1.0\n"
+            << "comment Test file\n"
+            << "element vertex " << num_verts << "\n"
+            << "property float x\nproperty float y\nproperty float z\n"
+            << "property float nx\nproperty float ny\nproperty float nz\n"
+            << "property uchar red\nproperty uchar green\n"
+            << "property uchar blue\nproperty float value\n"
+            << "element face 0\nproperty list uchar int vertex_indices\n"
+            << "end_header\n";
+        for (int i = 0; i < num_verts; ++i)
+        {
+            float pos[3] = { float(i), 0.0f, 0.0f };
+            float normal[3] = { 0.0f, 0.0f, 2.0f };
+            unsigned char color[3] = { 255, 0, 255 };
+            float scale = (i == 2 ? 0.0f : 0.5f);
+            out.write(reinterpret_cast<char const*>(pos), sizeof(pos));
+            out.write(reinterpret_cast<char const*>(normal), sizeof(normal));
+            out.write(reinterpret_cast<char const*>(color), sizeof(color));
+            out.write(reinterpret_cast<char const*>(&scale), sizeof(float));
+        }
+    }
+}
+
+TEST(PointSetTest, ReadAsciiPLY)
+{
+    std::string const filename = temp_filename("ascii.ply");
+    {
+        std::ofstream out(filename.c_str());
+        out << "ply\nformat ascii 1.0\nelement vertex 3\n"
+            << "property float x\nproperty float y\nproperty float z\n"
+            << "property float nx\nproperty float ny\nproperty float nz\n"
+            << "property float confidence\nproperty float value\n"
+            << "end_header\n"
+            << "1 2 3 0 0 1 0.5 2\n"
+            << "4 5 6 1 0 0 0 2\n"
+            << "7 8 9 0 1 0 1 1\n";
+    }
+
+    fssr::PointSet pset;
+    pset.set_scale_factor(2.0f);
+    pset.read_from_file(filename);
+    fssr::PointSet::SampleList const& samples = pset.get_samples();
+    ASSERT_EQ(2, samples.size());
+    EXPECT_EQ(math::Vec3f(1.0f, 2.0f, 3.0f), samples[0].pos);
+    EXPECT_EQ(math::Vec3f(0.0f, 0.0f, 1.0f), samples[0].normal);
+    EXPECT_FLOAT_EQ(0.5f, samples[0].confidence);
+    EXPECT_FLOAT_EQ(4.0f, samples[0].scale);
+    EXPECT_FLOAT_EQ(-1.0f, samples[0].color[0]);
+    EXPECT_EQ(math::Vec3f(7.0f, 8.0f, 9.0f), samples[1].pos);
+    EXPECT_FLOAT_EQ(2.0f, samples[1].scale);
+    std::remove(filename.c_str());
+}
+
+TEST(PointSetTest, ReadBinaryPLYWithSkip)
+{
+    std::string const filename = temp_filename("binary.ply");
+    write_binary_ply(filename, 100000);
+
+    fssr::PointSet pset;
+    pset.set_skip_samples(1);
+    pset.read_from_file(filename);
+    fssr::PointSet::SampleList const& samples = pset.get_samples();
+
+    /* Every other sample is read, sample 2 has invalid scale. */
+    ASSERT_EQ(49999, samples.size());
+    EXPECT_FLOAT_EQ(0.0f, samples[0].pos[0]);
+    EXPECT_FLOAT_EQ(4.0f, samples[1].pos[0]);
+    EXPECT_FLOAT_EQ(99998.0f, samples.back().pos[0]);
+    EXPECT_EQ(math::Vec3f(0.0f, 0.0f, 1.0f), samples[1].normal);
+    EXPECT_EQ(math::Vec3f(1.0f, 0.0f, 1.0f), samples[1].color);
+    EXPECT_FLOAT_EQ(1.0f, samples[1].confidence);
+    EXPECT_FLOAT_EQ(0.5f, samples[1].scale);
+    std::remove(filename.c_str());
+}
+
+TEST(PointSetTest, ReadMissingAttributes)
+{
+    std::string const filename = temp_filename("missing.ply");
+    {
+        std::ofstream out(filename.c_str());
+        out << "ply\nformat ascii 1.0\nelement vertex 1\n"
+            << "property float x\nproperty float y\nproperty float z\n"
+            << "property float value\nend_header\n1 2 3 1\n";
+    }
+
+    fssr::PointSet pset;
+    EXPECT_THROW(pset.read_from_file(filename), std::invalid_argument);
+    std::remove(filename.c_str());
+}
+
+TEST(PointSetTest, MemoryMappedBinaryPLY)
+{
+    std::string const filename = temp_filename("mapped.ply");
+    write_binary_ply(filename, 1000);
+
+    fssr::PointSet pset;
+    pset.set_skip_samples(1);
+    pset.read_from_file(filename);
+
+    fssr::PointSet mapped;
+    mapped.set_skip_samples(1);
+    mapped.set_memory_mapped(true);
+    mapped.read_from_file(filename);
+    EXPECT_TRUE(mapped.is_memory_mapped());
+    EXPECT_THROW(mapped.get_samples(), std::runtime_error);
+    ASSERT_EQ(500, mapped.get_num_samples());
+
+    /* Sample 2 has invalid scale and is only skipped on access. */
+    std::size_t num_valid = 0;
+    for (std::size_t i = 0; i < mapped.get_num_samples(); ++i)
+    {
+        fssr::Sample sample;
+        if (!mapped.get_sample(i, &sample))
+        {
+            EXPECT_EQ(1, i);
+            continue;
+        }
+        fssr::Sample const& ref = pset.get_samples()[num_valid];
+        EXPECT_EQ(ref.pos, sample.pos);
+        EXPECT_EQ(ref.normal, sample.normal);
+        EXPECT_EQ(ref.color, sample.color);
+        EXPECT_EQ(ref.scale, sample.scale);
+        num_valid += 1;
+    }
+    EXPECT_EQ(pset.get_samples().size(), num_valid);
+    std::remove(filename.c_str());
+}